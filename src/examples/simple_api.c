@@ -158,9 +158,9 @@ int main(int argc, char** argv) {
    struct subsys_accounting sa = agg->set[set_ix];
     // all relevant data within sa:
     //  - sa.cpu.cycles               : cycles spent in subsystem
-    //  - sa.cpu.wall_clock_time      : wct spent in subsystem
+    //  - sa.cpu.wall_clock_time      : wct (ns) spent in subsystem
     //  - sa.sched.cycles_out_local   : cycles spent scheduled-out
-    //  - sa.sched.wct_out_local      : wct spent scheduled-out
+    //  - sa.sched.wct_out_local      : wct (ns) spent scheduled-out
     //  ...
     //  The ... represent the other members of sa. At the moment we're not
     //  actually recording any of those extra members (except for extra data
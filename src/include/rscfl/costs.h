@@ -14,11 +14,13 @@
 
 #ifdef __KERNEL__
   #include <linux/limits.h>
+  #include <linux/stddef.h>
   #include <linux/tcp.h>
   #include <linux/time.h>
   #include <linux/types.h>
 #else
   #include <limits.h>
+  #include <stddef.h>
   #include <stdlib.h>
   #include <time.h>
   #include <sys/types.h>
@@ -51,6 +53,8 @@
  * acct_CPU and acct_Mem are always present and thus do not have
  * corresponding entries in the resource enum.
  *
+ * All durations are stored as nanoseconds, so that aggregating them is a
+ * plain integer addition.
  */
 struct acct_CPU
 {
@@ -58,7 +62,7 @@ struct acct_CPU
   ru64 branch_mispredictions; //count
   ru64 instructions; //count
   ru64 alignment_faults;
-  struct timespec wall_clock_time;
+  ru64 wall_clock_time; // ns
 };
 
 struct acct_Mem
@@ -83,7 +87,7 @@ struct acct_Net
 
 struct acct_Sched
 {
-  struct timespec wct_out_local;
+  ru64 wct_out_local; // ns
   ru64 cycles_out_local;
   ru64 run_delay;
 
@@ -91,7 +95,7 @@ struct acct_Sched
 
   // Scheduling out, due to end of quantum etc.
   ru64 xen_schedules;
-  struct timespec xen_sched_wct;
+  ru64 xen_sched_wct; // ns
   ru64 xen_sched_cycles;
   ru64 xen_sched_ns;
 
@@ -113,12 +117,21 @@ struct subsys_accounting
   ru64 subsys_entries;
   // The number of times this subsystem called into another subsystem.
   ru64 subsys_exits;
-  volatile _Bool in_use;
+};
+
+/*
+ * One kernel subsystem touched during a measurement: id is the rscfl_subsys
+ * value, slot the offset (in number of struct subsys_accountings) from the
+ * start of the subsys section of the shared buffer, where its data is kept.
+ */
+struct acct_subsys_entry
+{
+  short id;
+  short slot;
 };
 
 struct accounting
 {
-  volatile _Bool in_use;
   /*
    * Used as the interface for the kernel code to return an error to the
    * userspace.
@@ -126,10 +139,19 @@ struct accounting
   volatile int rc;
   unsigned short token_id;
   unsigned long syscall_id;
-  // Indexes into offsets from the start of the subsys section of
-  // rscfl_pid_page->buf.
-  short acct_subsys[NUM_SUBSYSTEMS];
   short nr_subsystems;
+  // Sampling (ACCT_SAMPLE): the number of syscalls this measurement stands
+  // for, 1 if it was not sampled. Use ACCT_SAMPLE_WEIGHT to read it.
+  unsigned short sample_weight;
+  // The subsystems touched, in the order in which they were first entered.
+  // Only the first nr_subsystems entries are valid; this must remain the last
+  // member, as only that prefix is initialised and copied.
+  struct acct_subsys_entry acct_subsys[NUM_SUBSYSTEMS];
 };
+#define ACCT_SAMPLE_WEIGHT(acct)                                               \
+  ( (acct)->sample_weight > 1 ? (unsigned int)(acct)->sample_weight : 1U )
+#define ACCT_USED_SIZE(acct)                                                   \
+  ( offsetof(struct accounting, acct_subsys)                                   \
+    + (acct)->nr_subsystems * sizeof(struct acct_subsys_entry) )
 
 #endif /*_SYSCALL_COST_H_*/
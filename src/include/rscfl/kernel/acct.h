@@ -20,10 +20,54 @@ struct rscfl_kernel_token
   // holds snapshot of xen sched_out value
   uint64_t val2;
   struct accounting* account;
+  // process-wide tokens: account is fixed, and lives (with its subsystems)
+  // in buf, the process-wide slice of the region rather than the shared_buf
+  // of a thread
+  _Bool shared;
+  struct rscfl_acct_layout_t *buf;
 };
 typedef struct rscfl_kernel_token rscfl_kernel_token;
 
+struct pid_acct;
+
 int update_acct(void);
+
+/*
+ * Sampling (ACCT_SAMPLE): decide whether the syscall starting now is
+ * measured, either every sample_period-th one or each with probability
+ * 1 / sample_period. Called once per syscall, from its first subsystem
+ * entry (see rscfl_subsys_entry).
+ */
+_Bool acct_sampled(struct pid_acct *current_pid_acct);
 int clear_acct_next(void);
 
+/*
+ * Create up to num new tokens for pa, growing its token table if needed.
+ * Returns the number of tokens created, or -ENOMEM. Must be called from
+ * process context.
+ */
+int new_kernel_tokens(struct pid_acct *pa, unsigned int num);
+void free_kernel_tokens(struct pid_acct *pa);
+
+/*
+ * Completion notification (RSCFL_NOTIFY_CMD). acct_notify counts one completed
+ * measurement (or an error, if err is set) of pa, and signals the eventfd
+ * registered for pa once watermark measurements completed since it was last
+ * signalled, or straight away on errors. The eventfd is signalled from an
+ * irq_work, so acct_notify is safe to call from any probe.
+ *
+ * set_acct_notify registers efd for pa (replacing any previous eventfd), or
+ * stops notifications if watermark is 0. Must be called from process context.
+ *
+ * release_pid_acct frees pa on thread exit, from a context that cannot sleep.
+ * If pa has an eventfd, waiting for its irq_work and dropping the eventfd
+ * reference are left to a work item, which frees pa afterwards.
+ * acct_notify_drain waits for those work items (module unload).
+ */
+void acct_notify(struct pid_acct *pa, _Bool err);
+int set_acct_notify(struct pid_acct *pa, int efd, unsigned int watermark);
+void free_acct_notify(struct pid_acct *pa);
+void release_pid_acct(struct pid_acct *pa);
+void acct_notify_drain(void);
+
 #endif
@@ -15,4 +15,16 @@
 int _rscfl_dev_init(void);
 int _rscfl_dev_cleanup(void);
 
+struct pid_acct;
+// hand the per-process region slice of an exiting thread back, so that
+// another thread can register into it. Does nothing for threads that mapped
+// buffers of their own
+void rscfl_region_release_slice(struct pid_acct *pa);
+
+struct rscfl_kernel_token;
+// the process-wide token with the given id (see RSCFL_SHARED_TOKEN_BIT) of
+// the region pa belongs to, or NULL
+struct rscfl_kernel_token *rscfl_region_shared_token(struct pid_acct *pa,
+                                                     short token_id);
+
 #endif
@@ -10,6 +10,10 @@
 #ifndef _RSCFL_PERCPU_H_
 #define _RSCFL_PERCPU_H_
 
+#include <linux/atomic.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+
 #include "rscfl/config.h"
 #include "rscfl/costs.h"
 #include "rscfl/kernel/hasht.h"
@@ -59,23 +63,54 @@ struct probe_priv {
 };
 typedef struct probe_priv probe_priv;
 
+struct rscfl_region;
+struct eventfd_ctx;
+
 struct pid_acct {
   struct hlist_node link; // item in the per-bucket linked list
   pid_t pid;
   struct rscfl_acct_layout_t *shared_buf;        // shared with user-space
+  rscfl_acct_geom_t geom;     // layout of shared_buf, kernel-private copy
   probe_priv *probe_data;     // private data used by each probe
   rscfl_ctrl_layout_t *ctrl;  // pointer to the mapped data in the control driver.
   rscfl_subsys subsys_stack[SUBSYS_STACK_HEIGHT];
   rscfl_subsys *subsys_ptr;
+  // lookup from subsystem id to its position in the acct_subsys list of the
+  // struct accounting being filled in. Never cleared: an entry is only used
+  // after checking it against that list (see get_subsys)
+  short subsys_pos[NUM_SUBSYSTEMS];
   _Bool executing_probe;
+  // sampling (ACCT_SAMPLE): sample_skip is set while in a syscall that was
+  // left out, sample_count counts syscalls for the deterministic mode
+  _Bool sample_skip;
+  unsigned int sample_count;
   struct rscfl_kernel_token *default_token;
 //  struct rscfl_kernel_token *null_token;
-  struct rscfl_kernel_token *token_ix[MAX_TOKENS];
+  // token table, indexed by token id. Grown on demand (see
+  // new_kernel_tokens), up to geom.token_num entries
+  struct rscfl_kernel_token **token_ix;
+  unsigned int token_ix_size;
   volatile struct rscfl_kernel_token *active_token;
-  unsigned short num_tokens;
-  unsigned short next_ctrl_token;
+  unsigned int num_tokens;
+  unsigned int next_ctrl_token;
   int shdw_kernel;
   int shdw_pages;
+  // completion notification, see acct_notify. notify_pending is only
+  // updated by the probes of this pid; notify_signal is the value the
+  // irq_work adds to the eventfd
+  struct eventfd_ctx *notify_ctx;
+  unsigned int notify_watermark;
+  unsigned int notify_pending;
+  atomic_t notify_signal;
+  struct irq_work notify_work;
+  // releases the eventfd and pa itself when the thread exits, see
+  // release_pid_acct
+  struct eventfd_ctx *notify_release_ctx;
+  struct work_struct release_work;
+  // per-process mode: the region holding shared_buf and ctrl, and the slice
+  // of it owned by this thread. NULL otherwise (see chardev.c)
+  struct rscfl_region *region;
+  unsigned int slice;
 };
 typedef struct pid_acct pid_acct;
 
@@ -91,6 +126,21 @@ DECLARE_PER_CPU_HASHTABLE(pid_acct_tbl, CPU_PIDACCT_HTBL_LOGSIZE);
  */
 DECLARE_PER_CPU(pid_acct*, current_acct);
 
+/* rscfl_acct_active
+ * 1 while current_acct != NULL, 0 otherwise. The kamprobes wrappers test it
+ * before saving any registers and go straight to the probed code when it is 0,
+ * so processes not using rscfl never call into the probe handlers.
+ *
+ * Only update current_acct through set_current_acct, to keep the two in sync.
+ */
+DECLARE_PER_CPU(u8, rscfl_acct_active);
+
+static inline void set_current_acct(pid_acct *pa)
+{
+  CPU_VAR(current_acct) = pa;
+  CPU_VAR(rscfl_acct_active) = (pa != NULL);
+}
+
 
 /*
  * Per-CPU initialization and cleanup. Run these with preemption disabled,
@@ -18,6 +18,16 @@ void kamprobes_free(void);
 
 void kamprobes_unregister_all(void);
 
-int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
-                       void (*post_handler)(void));
+/*
+ * kamprobes_register only builds the wrapper of a probe, and puts it in group
+ * (< BITS_PER_LONG); call sites are pointed at their wrappers by kamprobes_arm,
+ * for the groups set in its mask, and restored by kamprobes_disarm_all (or
+ * kamprobes_unregister_all).
+ */
+int kamprobes_register(u8 **orig_addr, char sys_type, unsigned int group,
+                       int (*pre_handler)(void), void (*post_handler)(void));
+
+void kamprobes_arm(unsigned long groups);
+
+void kamprobes_disarm_all(void);
 #endif
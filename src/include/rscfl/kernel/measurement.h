@@ -12,6 +12,19 @@
 
 #include "rscfl/costs.h"
 
+/*
+ * counter += val, for a counter of a struct subsys_accounting. The subsystems
+ * of process-wide tokens (shared) can be updated by threads running on other
+ * CPUs at the same time, so their counters are updated atomically.
+ */
+#define RSCFL_SUBSYS_ADD(shared, counter, val)                                 \
+  do {                                                                         \
+    if (shared)                                                                \
+      __sync_fetch_and_add(&(counter), (val));                                 \
+    else                                                                       \
+      (counter) += (val);                                                      \
+  } while (0)
+
 int rscfl_counters_init(void);
 
 void rscfl_counters_stop(void);
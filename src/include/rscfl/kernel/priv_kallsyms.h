@@ -13,6 +13,7 @@
 #include <linux/mutex.h>
 #include <linux/tracepoint.h>
 #include <linux/types.h>
+#include <linux/version.h>
 
 #include "rscfl/config.h"
 
@@ -41,6 +42,25 @@ _(xen_dummy_shared_info)   \
 _(xen_evtchn_do_upcall)    \
 
 
+// int3-based patching of live call sites, see poke_site in kamprobes.c
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+#define PRIV_KSYM_POKE_TABLE(_) \
+_(text_poke_finish)             \
+_(text_poke_queue)              \
+_(x86_nops)                     \
+
+#else
+#define PRIV_KSYM_POKE_TABLE(_) \
+_(ideal_nops)                   \
+_(text_poke_finish)             \
+_(text_poke_queue)              \
+
+#endif
+
+#endif
+
 #if SHDW_ENABLED != 0
 
 #define PRIV_KSYM_SHDW_TABLE(_) \
@@ -64,6 +84,16 @@ _once void (*KPRIV(put_balloon_scratch_page))(void);
 _once void (*KPRIV(set_pte_vaddr))(unsigned long vaddr, pte_t pte);
 _once struct mutex *KPRIV(text_mutex);
 _once void* (*KPRIV(text_poke))(void *addr, const void *opcode, size_t len);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+_once void (*KPRIV(text_poke_finish))(void);
+_once void (*KPRIV(text_poke_queue))(void *addr, const void *opcode,
+                                     size_t len, const void *emulate);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+_once const unsigned char * const *KPRIV(x86_nops);
+#else
+_once const unsigned char * const **KPRIV(ideal_nops);
+#endif
+#endif
 _once struct shared_info *KPRIV(xen_dummy_shared_info);
 _once void (*KPRIV(xen_evtchn_do_upcall))(struct pt_regs *regs);
 
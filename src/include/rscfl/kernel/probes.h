@@ -12,10 +12,35 @@
 
 #include <trace/events/sched.h>
 
+#include "rscfl/res_common.h"
+
 int probes_init(void);
 void probes_free(void);
 int probes_unregister(void);
 
+/*
+ * The probes and the scheduler interposition are only armed while rscfl is in
+ * use: while the data device is open or at least one thread is registered
+ * (has a pid_acct). Each of those holds a reference, dropped with probes_put;
+ * the probes are disarmed (from a work item) once none are left.
+ *
+ * probes_get takes the reference of an open data device and arms the probes
+ * straight away. It sleeps for as long as that takes, so it must not be
+ * called with mmap_lock held. probes_hold takes the reference of a new
+ * pid_acct without sleeping; if the probes are not armed by then, they get
+ * armed from a work item. probes_put can be called from atomic context.
+ */
+void probes_get(void);
+void probes_hold(void);
+void probes_put(void);
+
+/*
+ * Applies mask->enable and mask->disable to the set of probed subsystems (see
+ * rscfl_probe_subsys), re-poking the call sites of the subsystems changed if
+ * the probes are armed, and fills in mask->probed.
+ */
+void probes_set_subsys(rscfl_subsys_mask *mask);
+
 // tracepoints for scheduler interposition
 void get_tracepoints(struct tracepoint*, void*);
 int register_sched_interposition(void);
@@ -26,32 +26,46 @@
 #define RSCFL_CTRL_DRIVER "rscfl-ctrl"
 
 /*
- * as a point of reference,
- *  STRUCT_ACCT_NUM 136
- *  ACCT_SUBSYS_RATIO 5
- *
- *  allocates 81920 bytes (20 pages) per rscfl handle (thread using rscfl)
- *  with space for 136 struct accounting
- *                 684 struct subsys_accounting
- *                 32 bytes wasted (aligning to PAGE_SIZE)
- *  the ratio is not fully respected in order to optimize memory usage
- *  (if more struct subsys_accounting fit because of the alignment, we'll
- *  allow those as well)
- *
- *  estimates above done for
- *    sizeof(struct accounting) = 240
- *    sizeof(struct subsys_accounting) = 72
- *
+ * Default sizes of the per-thread accounting buffers. Applications can ask for
+ * different sizes through the acct_num and subsys_num members of rscfl_config
+ * (see rscfl_acct_geom_init). The defaults allocate a few pages per rscfl
+ * handle (thread using rscfl), with space for
+ *   STRUCT_ACCT_NUM struct accounting
+ *   STRUCT_ACCT_NUM * ACCT_SUBSYS_RATIO struct subsys_accounting
+ * the ratio is not fully respected in order to optimize memory usage
+ * (if more struct subsys_accounting fit because of the alignment, we'll
+ * allow those as well)
  */
 #define STRUCT_ACCT_NUM 20
 #define ACCT_SUBSYS_RATIO 7   // assume one syscall touches ~ ACCT_SUBSYS_RATIO subsystems
-#define MAX_TOKENS 32
-#define NUM_READY_TOKENS 12   // Number of tokens that the kernel can prepare
-                              // in advance.
+// slot indices are shared as shorts between the kernel and user space
+#define RSCFL_MAX_ACCT_NUM 8192
+#define RSCFL_MAX_SUBSYS_NUM 32767
+/*
+ * Tokens are created by the kernel on demand (RSCFL_NEW_TOKENS_CMD), up to
+ * rscfl_config.max_tokens per thread. Each ioctl hands out a batch of new
+ * token ids through the ctrl page; batches start at MIN_READY_TOKENS and
+ * double with the number of tokens a thread already has, up to
+ * NUM_READY_TOKENS.
+ */
+#define TOKEN_NUM 1024
+#define RSCFL_MAX_TOKEN_NUM 16384  // token ids are shared as shorts
+#define MIN_READY_TOKENS 16
+#define NUM_READY_TOKENS 256
 // special tokens
 #define DEFAULT_TOKEN -15
 #define NULL_TOKEN -14
 #define IS_USER_TOKEN(token_id) (token_id >= 0)
+/*
+ * Process-wide tokens (per-process mode only) have RSCFL_SHARED_TOKEN_BIT set
+ * in their id; regular token ids are below RSCFL_MAX_TOKEN_NUM. The rest of
+ * the id is the index of the struct accounting the token owns in the
+ * process-wide slice (see RSCFL_SHARED_SLICE).
+ */
+#define RSCFL_SHARED_TOKEN_BIT 0x4000
+#define IS_SHARED_TOKEN(token_id)                                              \
+  ( IS_USER_TOKEN(token_id) && ((token_id) & RSCFL_SHARED_TOKEN_BIT) )
+#define SHARED_TOKEN_IX(token_id) ((token_id) & ~RSCFL_SHARED_TOKEN_BIT)
 
 #define RSCFL_SYSCALL_ID_OFFSET 10
 
@@ -60,15 +74,92 @@
 #endif
 #define PAGE_ROUND_UP(x) ( (((unsigned int)(x)) + PAGE_SIZE - 1)               \
                            & (~(PAGE_SIZE - 1)) )
+#define RSCFL_ALIGN_UP(x, a) ( ((x) + (a) - 1) & ~((a) - 1) )
+
+/*
+ * Memory shared with the kernel is laid out so that data written by the kernel
+ * and data written by user space never share a cache line; otherwise a thread
+ * reading measurements makes the lines bounce while the probes keep writing.
+ */
+#define RSCFL_CACHELINE 64
+#define RSCFL_CACHELINE_ALIGNED __attribute__((aligned(RSCFL_CACHELINE)))
 
-#define PAIR_ALLOC_SIZE (sizeof(struct accounting)                             \
-                         + ACCT_SUBSYS_RATIO * sizeof(struct subsys_accounting))
-#define MMAP_BUF_SIZE PAGE_ROUND_UP(STRUCT_ACCT_NUM * PAIR_ALLOC_SIZE)
 #define MMAP_CTL_SIZE PAGE_SIZE
 
-#define ACCT_SUBSYS_NUM ( (MMAP_BUF_SIZE                                       \
-                           - STRUCT_ACCT_NUM * sizeof(struct accounting)       \
-                          ) / sizeof(struct subsys_accounting) )
+/*
+ * Per-process mode (rscfl_config.max_threads): slice i of the data mapping
+ * starts at i * RSCFL_SLICE_SIZE(geom), and slice i of the ctrl mapping at
+ * i * MMAP_CTL_SIZE. Slices are handed to threads by
+ * RSCFL_REGISTER_THREAD_CMD.
+ *
+ * The data mapping has one more slice, at RSCFL_SHARED_SLICE, which belongs to
+ * no thread: struct accounting i in it is owned by the process-wide token
+ * with index i, and its subsystem data is allocated from the same slice. Any
+ * thread of the process can aggregate into it, so the kernel never marks it
+ * COMPLETE, and the acct_subsys entries past nr_subsystems are kept at
+ * RSCFL_SUBSYS_ENTRY_EMPTY, to be claimed with cmpxchg (see get_subsys).
+ */
+#define RSCFL_MAX_THREADS 4096
+#define RSCFL_SLICE_SIZE(geom) PAGE_ROUND_UP((geom)->size)
+#define RSCFL_SHARED_SLICE(max_threads) (max_threads)
+#define RSCFL_SUBSYS_ENTRY_EMPTY -1
+
+/*
+ * The subsys_accounting slots in use are tracked in a bitmap shared between
+ * the kernel (which sets bits when allocating slots) and user space (which
+ * clears them when releasing slots).
+ */
+#define RSCFL_BITS_PER_LONG (8 * sizeof(unsigned long))
+#define RSCFL_BITMAP_LONGS(nbits)                                              \
+  ( ((nbits) + RSCFL_BITS_PER_LONG - 1) / RSCFL_BITS_PER_LONG )
+
+/*
+ * Indexes into the slot ring lookup tables (see struct rscfl_acct_ring_t).
+ * All non-user tokens (DEFAULT_TOKEN) share the last entry of token_ix.
+ */
+#define ACCT_TOKEN_IX_NUM(geom) ((geom)->token_num + 1)
+#define ACCT_TOKEN_IX(geom, token_id)                                          \
+  ( (((short)(token_id) >= 0) && ((short)(token_id) < (geom)->token_num))      \
+    ? (short)(token_id) : (short)(geom)->token_num )
+#define ACCT_SYSCALL_IX(geom, syscall_id) ((syscall_id) % (geom)->acct_num)
+
+/*
+ * Accessors for the arrays of a data buffer (buf) described by geom, see
+ * struct rscfl_acct_geom_t
+ */
+#define RSCFL_GEOM_AT(buf, geom, member, type)                                 \
+  ( (type)((char *)(buf) + (geom)->member) )
+#define RSCFL_ACCT(buf, geom)                                                  \
+  RSCFL_GEOM_AT(buf, geom, acct_off, struct accounting *)
+#define RSCFL_SUBSYSES(buf, geom)                                              \
+  RSCFL_GEOM_AT(buf, geom, subsys_off, struct subsys_accounting *)
+#define RSCFL_RING_SLOTS(buf, geom)                                            \
+  RSCFL_GEOM_AT(buf, geom, slot_off, volatile short *)
+#define RSCFL_SYSCALL_IX(buf, geom)                                            \
+  RSCFL_GEOM_AT(buf, geom, syscall_ix_off, volatile short *)
+#define RSCFL_TOKEN_IX(buf, geom)                                              \
+  RSCFL_GEOM_AT(buf, geom, token_ix_off, volatile short *)
+#define RSCFL_ACCT_IN_USE(buf, geom)   /* slot states, see below */            \
+  RSCFL_GEOM_AT(buf, geom, in_use_off, volatile unsigned char *)
+#define RSCFL_SUBSYS_MAP(buf, geom)                                            \
+  RSCFL_GEOM_AT(buf, geom, subsys_map_off, unsigned long *)
+
+/*
+ * States of a struct accounting slot, as found in RSCFL_ACCT_IN_USE:
+ *
+ *   FREE     -> OPEN      kernel, when taking the slot from the free slot ring
+ *   OPEN     -> COMPLETE  kernel, when the syscall being measured returns
+ *   COMPLETE -> OPEN      kernel (cmpxchg), to aggregate more data for a token
+ *   OPEN/COMPLETE -> CLAIMED  user space (cmpxchg), before copying the slot
+ *   CLAIMED  -> FREE      user space, before putting the slot back in the ring
+ *
+ * The kernel never writes into a CLAIMED slot: if it loses the race to reopen
+ * a slot, it allocates a new one.
+ */
+#define RSCFL_ACCT_FREE 0
+#define RSCFL_ACCT_OPEN 1
+#define RSCFL_ACCT_COMPLETE 2
+#define RSCFL_ACCT_CLAIMED 3
 
 /* Configuration and IOCTLS
  */
@@ -79,6 +170,10 @@
 #define RSCFL_SHUTDOWN_CMD _IO('R', 0x31)
 #define RSCFL_NEW_TOKENS_CMD _IO('R', 0x32)
 #define RSCFL_DEBUG_CMD _IOW('R', 0x34, struct rscfl_debug)
+// returns the index of the slice given to the calling thread
+#define RSCFL_REGISTER_THREAD_CMD _IO('R', 0x35)
+#define RSCFL_NOTIFY_CMD _IOW('R', 0x36, struct rscfl_notify)
+#define RSCFL_SUBSYS_MASK_CMD _IOWR('R', 0x37, struct rscfl_subsys_mask)
 
 /*
  * Shadow kernels.
@@ -86,14 +181,79 @@
 typedef enum {NOP, SPAWN_ONLY, SPAWN_SWAP_ON_SCHED, SWAP} shdw_op;
 typedef int shdw_hdl;
 
+/*
+ * Ring of free struct accounting slots, shared between the kernel and user
+ * space. The ring itself is the slot array found at geom->slot_off.
+ *
+ * The kernel is the only consumer: alloc_acct takes the slot index found at
+ * head. User space is the only producer: once a measurement has been read, the
+ * index of its slot is written at tail. head and tail are free-running
+ * counters, so tail - head is the number of free slots and allocating or
+ * releasing a slot never depends on the number of slots.
+ *
+ * The syscall_ix and token_ix arrays let user space find the slot holding a
+ * measurement without scanning the struct accounting array: the kernel
+ * records there the slot it allocated last for a given syscall id
+ * (ACCT_SYSCALL_IX) or token (ACCT_TOKEN_IX). An entry is -1 if nothing was
+ * allocated for it yet; entries may be stale, so readers must check the
+ * in_use, syscall_id and token_id of the slot.
+ */
+struct rscfl_acct_ring_t
+{
+  volatile unsigned int head RSCFL_CACHELINE_ALIGNED;  // written by the kernel
+  volatile unsigned int tail RSCFL_CACHELINE_ALIGNED;  // written by user space
+};
+typedef struct rscfl_acct_ring_t rscfl_acct_ring_t;
+
+/*
+ * Fixed-size header found at the start of every data buffer. It is followed by
+ * arrays whose sizes are decided at rscfl_init time; their position is
+ * described by a struct rscfl_acct_geom_t, which the kernel publishes in the
+ * ctrl page.
+ */
 struct rscfl_acct_layout_t
 {
-  struct accounting acct[STRUCT_ACCT_NUM];
-  struct subsys_accounting subsyses[ACCT_SUBSYS_NUM];
   int subsys_exits;
+  rscfl_acct_ring_t acct_ring;
 };
 typedef struct rscfl_acct_layout_t rscfl_acct_layout_t;
 
+/*
+ * Geometry of a data buffer: sizes and offsets (in bytes, from the start of
+ * the buffer) of the arrays following the rscfl_acct_layout_t header. Each
+ * group starts on its own cache line and is tagged with who writes it:
+ *
+ *   short slot[acct_num]                     (user)    free slot ring
+ *   short syscall_ix[acct_num]               (kernel)  slot lookup by syscall
+ *   short token_ix[ACCT_TOKEN_IX_NUM(geom)]  (kernel)  slot lookup by token id
+ *   unsigned char in_use[acct_num]           (both, once per measurement)
+ *   unsigned long subsys_map[]               (both, once per subsystem)
+ *   struct accounting acct[acct_num]         (kernel)
+ *   struct subsys_accounting subsyses[]      (kernel)
+ *
+ * in_use[i] is the state of acct[i] (RSCFL_ACCT_FREE etc.); it is not FREE
+ * while acct[i] holds a measurement user space has not read. It is kept out of
+ * struct accounting so that releasing a slot does not write to the lines the
+ * probes update.
+ *
+ * Computed by rscfl_acct_geom_init, identically in the kernel and in librscfl.
+ */
+struct rscfl_acct_geom_t
+{
+  unsigned int size;
+  unsigned int acct_num;
+  unsigned int subsys_num;
+  unsigned int token_num;
+  unsigned int slot_off;
+  unsigned int syscall_ix_off;
+  unsigned int token_ix_off;
+  unsigned int in_use_off;
+  unsigned int subsys_map_off;
+  unsigned int acct_off;
+  unsigned int subsys_off;
+};
+typedef struct rscfl_acct_geom_t rscfl_acct_geom_t;
+
 /*
  * Expressing interest in resources consumed by syscalls
  */
@@ -117,11 +277,17 @@ typedef enum {
                                    // to the currently active token.
                                    // Also clears the corresponding subsystem
                                    // data.
+  ACCT_SAMPLE       = EBIT(5),     // only measure one in
+                                   // rscfl_config.sample_period of the
+                                   // syscalls; measurements record the
+                                   // sampling weight (sample_weight)
 
   ACCT_KNOP          = EBIT(6),   // For benchmarking calibration: run
                                   // acct_next but don't actually express
                                   // interest (no kernel-side effects)
   __ACCT_ERR         = EBIT(7),
+  __ACCT_NOT_SAMPLED = EBIT(8),   // set by the kernel when the last syscall
+                                  // was left out by ACCT_SAMPLE
   __ACCT_FLAG_IS_PERSISTENT        = (EBIT(0) | EBIT(1) | EBIT(7)),
 
 } interest_flags;
@@ -141,13 +307,40 @@ struct syscall_interest_t
 };
 typedef struct syscall_interest_t syscall_interest_t;
 
+/*
+ * Sizes and offsets of the shared data structures, as compiled into the
+ * kernel module and published in the ctrl page. rscfl_init compares them with
+ * its own (rscfl_layout_check_init) and refuses to run on a mismatch, which
+ * the data layout version alone does not catch (for example when the module
+ * and the library were built against different subsystem lists).
+ */
+struct rscfl_layout_check_t
+{
+  unsigned int cacheline;
+  unsigned int ctrl_size;
+  unsigned int interest_off;
+  unsigned int tokens_off;
+  unsigned int acct_hdr_size;
+  unsigned int acct_size;
+  unsigned int subsys_size;
+};
+typedef struct rscfl_layout_check_t rscfl_layout_check_t;
+
 struct rscfl_ctrl_layout_t
 {
+  // written by the kernel when the page is mapped, read-only afterwards.
+  // version and layout must stay the first members across layout versions.
   unsigned int version;
-  volatile syscall_interest_t interest;
+  rscfl_layout_check_t layout;
   rscfl_config config;
+  // the geometry of this thread's data buffer, as used by the kernel
+  rscfl_acct_geom_t geom;
+
+  // written by user space on every rscfl_acct call, read by the probes
+  volatile syscall_interest_t interest RSCFL_CACHELINE_ALIGNED;
 
-  int avail_token_ids[NUM_READY_TOKENS];
+  // written by the kernel on RSCFL_NEW_TOKENS_CMD, consumed by user space
+  int avail_token_ids[NUM_READY_TOKENS] RSCFL_CACHELINE_ALIGNED;
   int num_avail_token_ids;
 };
 typedef struct rscfl_ctrl_layout_t rscfl_ctrl_layout_t;
@@ -166,6 +359,28 @@ struct rscfl_ioctl
 };
 typedef struct rscfl_ioctl rscfl_ioctl_t;
 
+// see rscfl_notify_fd
+struct rscfl_notify
+{
+  int efd;                 // eventfd to signal
+  unsigned int watermark;  // 0 stops notifications
+};
+typedef struct rscfl_notify rscfl_notify;
+
+// see rscfl_probe_subsys. Bit i of each mask stands for rscfl_subsys i
+#define RSCFL_SUBSYS_MASK_WORDS ((NUM_SUBSYSTEMS + 63) / 64)
+#define RSCFL_SUBSYS_MASK_SET(mask, id)                                        \
+  ( (mask)[(id) / 64] |= 1ULL << ((id) % 64) )
+#define RSCFL_SUBSYS_MASK_ISSET(mask, id)                                      \
+  ( ((mask)[(id) / 64] >> ((id) % 64)) & 1 )
+struct rscfl_subsys_mask
+{
+  unsigned long long enable[RSCFL_SUBSYS_MASK_WORDS];   // in
+  unsigned long long disable[RSCFL_SUBSYS_MASK_WORDS];  // in, after enable
+  unsigned long long probed[RSCFL_SUBSYS_MASK_WORDS];   // out
+};
+typedef struct rscfl_subsys_mask rscfl_subsys_mask;
+
 struct rscfl_debug
 {
   char msg[5];
@@ -178,6 +393,17 @@ extern "C" {
 #endif
 void rscfl_init_default_config(rscfl_config* default_cfg);
 
+// fills geom with the layout of a data buffer holding acct_num struct
+// accounting, at least subsys_num struct subsys_accounting and indexing
+// token_num tokens. zero values select the defaults (STRUCT_ACCT_NUM,
+// ACCT_SUBSYS_RATIO * acct_num capped at RSCFL_MAX_SUBSYS_NUM, TOKEN_NUM).
+// returns -EINVAL if explicitly requested sizes are above RSCFL_MAX_*_NUM
+int rscfl_acct_geom_init(rscfl_acct_geom_t *geom, unsigned int acct_num,
+                         unsigned int subsys_num, unsigned int token_num);
+
+// fills chk with the layout of the shared data structures in this build
+void rscfl_layout_check_init(rscfl_layout_check_t *chk);
+
 ru64 rscfl_get_cycles(void);
 void rscfl_timespec_add(struct timespec *to, const struct timespec *from);
 void rscfl_timespec_add_ns(struct timespec *to, const ru64 from);
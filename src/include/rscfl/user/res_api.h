@@ -91,16 +91,22 @@ struct rscfl_token {
   unsigned short id;
   _Bool first_acct;
   _Bool data_read;
-  _Bool in_use; //prevents double-free situations
+  volatile _Bool in_use; //prevents double-free situations
+  short next_free;       // next id on the handle's free token stack
 };
 typedef struct rscfl_token rscfl_token;
 
-
-struct rscfl_token_list {
-  rscfl_token *token;
-  struct rscfl_token_list *next;
-};
-typedef struct rscfl_token_list rscfl_token_list;
+/*
+ * The free token stack is intrusive (linked through rscfl_token.next_free) and
+ * its top is a single word holding both the id of the top token and a
+ * generation tag, so that it can be popped and pushed with one
+ * compare-and-swap even when the handle is shared between threads. The tag is
+ * incremented on every update to avoid ABA problems.
+ */
+#define TK_STACK_EMPTY -1
+#define TK_STACK_TOP(word) ((short)((word) & 0xffff))
+#define TK_STACK_WORD(word, top)                                               \
+  ((((word) & ~0xffffUL) + 0x10000UL) | ((unsigned short)(top)))
 
 
 /*
@@ -111,6 +117,7 @@ typedef struct rscfl_token_list rscfl_token_list;
  */
 struct rscfl_handle_t {
   char *buf;
+  rscfl_acct_geom_t geom;  // layout of buf, see rscfl_acct_geom_init
   unsigned long lst_syscall_id;
   rscfl_ctrl_layout_t *ctrl;
   /*
@@ -118,12 +125,22 @@ struct rscfl_handle_t {
    * performing a mode switch into the kernel.
    * This pool is replenished whenever there is a system call that finds a
    * reduction in the number of free tokens.
+   *
+   * Tokens are allocated with the handle (geom.token_num of them) and live at
+   * the index of their kernel id, so getting and freeing a token never
+   * allocates memory. Ids handed over by the kernel and ids of freed tokens
+   * are kept on the free token stack.
    */
-  //rscfl_token *fresh_tokens[NUM_READY_TOKENS];
-  rscfl_token_list *free_token_list;
+  rscfl_token *tokens;
+  volatile unsigned long free_tokens; // TK_STACK_WORD
+  // free slot ring positions handed out to releasing threads; runs ahead of
+  // acct_ring.tail while slot indices are being written
+  volatile unsigned int ring_reserve;
   rscfl_token *current_token;
-  //int ready_token_sp;
   int fd_ctrl;
+  // buf and ctrl are slices of the per-process region, see
+  // rscfl_config.max_threads
+  _Bool shared_map;
 };
 typedef struct rscfl_handle_t *rscfl_handle;
 
@@ -147,6 +164,13 @@ typedef struct rscfl_handle_t *rscfl_handle;
  * set_size:        the number of subsystems currently stored in the set array
  * max_set_size:    the maximum number of subsystems that can be stored in the
  *                  set array. this is the allocated size of set.
+ * weight:          the number of syscalls the data stands for (see
+ *                  ACCT_SAMPLE). rscfl_get_subsys_into and the merge functions
+ *                  scale the data of sampled measurements by their
+ *                  sample_weight, so that set holds estimates for all the
+ *                  syscalls; weight is the sum of the sample weights merged.
+ *                  Views (rscfl_get_subsys_view) and REDUCE_SUBSYS are not
+ *                  scaled.
  */
 struct subsys_idx_set {
   short idx[NUM_SUBSYSTEMS];
@@ -155,9 +179,41 @@ struct subsys_idx_set {
   void *app_data;
   short set_size;
   short max_set_size;
+  unsigned long weight;
 };
 typedef struct subsys_idx_set subsys_idx_set;
 
+/*
+ * rscfl_subsys_view is a read-only, borrowed view of the subsystem data of one
+ * measurement: instead of copies, set[j] points into the buffer shared with
+ * the kernel. It is filled by rscfl_get_subsys_view and must be handed back
+ * with rscfl_subsys_view_release, after which the pointers are invalid.
+ *
+ * idx, ids and set_size have the same meaning as in subsys_idx_set.
+ */
+struct rscfl_subsys_view {
+  short idx[NUM_SUBSYSTEMS];
+  short ids[NUM_SUBSYSTEMS];
+  const struct subsys_accounting *set[NUM_SUBSYSTEMS];
+  short set_size;
+};
+typedef struct rscfl_subsys_view rscfl_subsys_view;
+
+/*
+ * rscfl_arena is a bump allocator for subsys_idx_set objects. Sets carved out
+ * of an arena are never freed individually: rscfl_arena_reset releases all of
+ * them at once, in O(1), and keeps the memory for reuse. An arena is not
+ * thread-safe; use one per thread (rscfl handle).
+ */
+typedef struct rscfl_arena rscfl_arena;
+
+/*
+ * rscfl_collector is a background thread that drains the measurements of the
+ * handles added to it into a ring in user memory, handing their slots and
+ * subsystem data back to the kernel straight away. See rscfl_collector_start.
+ */
+typedef struct rscfl_collector rscfl_collector;
+
 
 /****************************
  *
@@ -201,6 +257,11 @@ typedef struct subsys_idx_set subsys_idx_set;
  * resources (buffers for holding resource accounting for the thread) are
  * allocated.
  *
+ * If cfg->max_threads is set (per-process mode), only the first thread to call
+ * rscfl_init opens the rscfl devices and maps memory shared with the kernel;
+ * other threads of the process get a slice of that memory with a single
+ * ioctl. All threads of the process must then use the same configuration.
+ *
  * Parameters:
  *   ver (rscfl_version_t): The rscfl version that matches the current headers
  *    (res_api.h). This is checked against the version baked in the user-space
@@ -260,11 +321,37 @@ int rscfl_get_token(rscfl_handle rhdl, rscfl_token **token);
 int rscfl_switch_token_api(rscfl_handle rhdl, rscfl_token *token_to, token_switch_flags fl);
 
 /*
- * Returns an int as we put the token on a reuse list. Allocation of
- * memory to put the element on the list may fail.
+ * Puts the token back on the handle's free token stack. Freeing a token that
+ * is not in use (i.e. a second free of the same token) does nothing.
+ *
+ * Returns 0 on success and -EINVAL for tokens that do not belong to rhdl (or,
+ * for process-wide tokens, to the process).
  */
 int rscfl_free_token(rscfl_handle, rscfl_token *);
 
+/*
+ * Process-wide tokens (per-process mode only, see rscfl_config.max_threads).
+ *
+ * A token returned by rscfl_get_shared_token can be passed to rscfl_acct and
+ * rscfl_switch_token on the handle of any thread of the process, so a request
+ * moving from one thread to another (an acceptor handing a connection to a
+ * worker, say) keeps accumulating into a single struct accounting. Threads
+ * measuring syscalls for the same process-wide token at the same time update
+ * it atomically. There are acct_num process-wide tokens per process; -EAGAIN
+ * is returned when all are in use.
+ *
+ * rscfl_read_acct(rhdl, acct, token) copies the measurement and starts a new
+ * one for the token; call it once no thread is inside a syscall measured for
+ * the token. The subsystem data of a process-wide token is kept in a separate
+ * buffer: pass the handle returned by rscfl_shared_handle (rather than rhdl)
+ * to rscfl_get_subsys, rscfl_subsys_free, REDUCE_SUBSYS and the other
+ * functions reading it. Free process-wide tokens with rscfl_free_token.
+ */
+int rscfl_get_shared_token(rscfl_handle rhdl, rscfl_token **token);
+
+// returns NULL when rhdl was not initialised in per-process mode
+rscfl_handle rscfl_shared_handle(rscfl_handle rhdl);
+
 /*
  *
  */
@@ -274,11 +361,65 @@ int rscfl_free_token(rscfl_handle, rscfl_token *);
 #define rscfl_acct_3(handle, token, fl) rscfl_acct_api(handle, token, fl)
 int rscfl_acct_api(rscfl_handle, rscfl_token *token, interest_flags fl);
 
+/*
+ * With ACCT_SAMPLE, only one in rscfl_config.sample_period of the syscalls is
+ * measured; rscfl_read_acct returns -ENODATA for a syscall left out. Sampled
+ * measurements carry sample_period as their sample_weight.
+ */
 #define rscfl_read_acct(...) CONCAT(rscfl_read_acct_, VARGS_NR(__VA_ARGS__))(__VA_ARGS__)
 #define rscfl_read_acct_2(handle, acct) rscfl_read_acct_api(handle, acct, NULL)
 #define rscfl_read_acct_3(handle, acct, token) rscfl_read_acct_api(handle, acct, token)
 int rscfl_read_acct_api(rscfl_handle handle, struct accounting *acct, rscfl_token *token);
 
+/*
+ * Reads up to max completed measurements (those whose syscalls have returned)
+ * into acct[], in a single pass over the shared buffer, and hands their slots
+ * back to the kernel at once. Each struct accounting carries the token_id and
+ * syscall_id it was recorded for. Measurements the kernel is still writing
+ * into are left in place.
+ *
+ * As with rscfl_read_acct, subsystem data stays in the shared buffer until
+ * rscfl_subsys_free is called for each returned struct accounting.
+ *
+ * Returns the number of measurements read, or -EINVAL.
+ */
+int rscfl_read_acct_batch(rscfl_handle rhdl, struct accounting *acct, int max);
+
+/*
+ * Sets up an eventfd that the kernel signals once watermark measurements of
+ * the calling thread have completed since it was last signalled, and as soon
+ * as an error (__ACCT_ERR) is raised. The value read from the eventfd is the
+ * number of measurements completed (plus one for each error), so a collector
+ * can poll the eventfd and drain measurements with rscfl_read_acct_batch
+ * instead of spinning on the shared buffer.
+ *
+ * Pass efd = -1 to get a new (non-blocking, close-on-exec) eventfd, or an
+ * existing eventfd to share it between threads. watermark is capped to the
+ * number of struct accounting in the buffer; 0 stops the notifications for
+ * the calling thread.
+ *
+ * Must be called on the thread owning rhdl. Returns the eventfd (0 if
+ * watermark is 0), or a negative error.
+ */
+int rscfl_notify_fd(rscfl_handle rhdl, int efd, unsigned int watermark);
+
+/*
+ * Turns the probes of whole subsystems on or off at run time, for every
+ * process using rscfl, by re-poking their call sites in the kernel. Only the
+ * subsystems the kernel module probes (BLOCKLAYER, the NETWORKING ones, ...)
+ * are affected: the subsystems set in mask->enable are turned on, then those
+ * set in mask->disable are turned off (use RSCFL_SUBSYS_MASK_SET to fill them
+ * in). On return, mask->probed holds the subsystems being probed.
+ *
+ * The costs of a subsystem turned off are accounted to the subsystem calling
+ * into it, so per-syscall totals do not change. The initial set comes from the
+ * probe_subsys parameter of the kernel module.
+ *
+ * Needs CAP_SYS_ADMIN. Returns 0, -EPERM for unprivileged callers, or another
+ * negative error.
+ */
+int rscfl_probe_subsys(rscfl_handle rhdl, rscfl_subsys_mask *mask);
+
 /*
  * -- high level API functions --
  */
@@ -303,6 +444,41 @@ int rscfl_read_acct_api(rscfl_handle handle, struct accounting *acct, rscfl_toke
  */
 subsys_idx_set* rscfl_get_subsys(rscfl_handle rhdl, struct accounting *acct);
 
+/*!
+ * \brief like rscfl_get_subsys, but fills a subsys_idx_set owned by the caller
+ *        instead of allocating a new one
+ *
+ * subsys_set is reset first, so the same set (e.g. one obtained from
+ * rscfl_get_new_aggregator(NUM_SUBSYSTEMS)) can be reused for every
+ * measurement without further allocations.
+ *
+ * The kernel resources of all the subsystems of acct are freed. Returns the
+ * number of subsystems that did not fit in subsys_set (0 on normal exit), or
+ * -EINVAL.
+ */
+int rscfl_get_subsys_into(rscfl_handle rhdl, struct accounting *acct,
+                          subsys_idx_set *subsys_set);
+
+/*!
+ * \brief gives read-only access to the per-subsystem resource accounting of
+ *        acct without copying it out of the buffer shared with the kernel
+ *
+ * \param [in] acct a pointer to the accounting data structure obtained from
+ *                  calling rscfl_acct_read
+ * \param [out] view filled with pointers to the subsystem data of acct
+ *
+ * The kernel resources are only freed when calling
+ * rscfl_subsys_view_release(rhdl, view). Returns 0 or -EINVAL.
+ */
+int rscfl_get_subsys_view(rscfl_handle rhdl, const struct accounting *acct,
+                          rscfl_subsys_view *view);
+
+/*!
+ * \brief frees the kernel resources of the subsystems in view. The data in
+ *        view must not be used after this call.
+ */
+void rscfl_subsys_view_release(rscfl_handle rhdl, rscfl_subsys_view *view);
+
 /*!
  * \brief returns an empty subsys_idx_set capable of holding resource accounting
  *        data for no_subsystems.
@@ -355,6 +531,99 @@ int rscfl_merge_idx_set_into(subsys_idx_set *current, subsys_idx_set *aggregator
 int rscfl_merge_acct_into(rscfl_handle rhdl, struct accounting *acct_from,
                           subsys_idx_set *aggregator_into);
 
+/*!
+ * \brief creates an arena for subsys_idx_set objects, with block_size bytes
+ *        of memory allocated upfront (0 selects RSCFL_ARENA_BLOCK_SIZE)
+ *
+ * The arena grows by further blocks if needed. rhdl is the handle whose
+ * measurements are copied with rscfl_arena_get_subsys, and can be NULL if the
+ * arena is only used for aggregators.
+ */
+#define RSCFL_ARENA_BLOCK_SIZE (64 * 1024)
+rscfl_arena* rscfl_arena_create(rscfl_handle rhdl, size_t block_size);
+
+/*!
+ * \brief invalidates all the subsys_idx_set objects allocated from arena
+ */
+void rscfl_arena_reset(rscfl_arena *arena);
+
+/*!
+ * \brief frees arena and all the memory allocated from it
+ */
+void rscfl_arena_destroy(rscfl_arena *arena);
+
+/*!
+ * \brief like rscfl_get_new_aggregator, but allocates from arena.
+ *
+ * The returned set is valid until the next rscfl_arena_reset or
+ * rscfl_arena_destroy, and must not be passed to free_subsys_idx_set.
+ */
+subsys_idx_set* rscfl_arena_new_aggregator(rscfl_arena *arena,
+                                           unsigned short no_subsystems);
+
+/*!
+ * \brief like rscfl_get_subsys, but allocates from arena (see
+ *        rscfl_arena_new_aggregator)
+ */
+subsys_idx_set* rscfl_arena_get_subsys(rscfl_arena *arena,
+                                       struct accounting *acct);
+
+/*!
+ * \brief starts a collector thread, draining measurements into a ring of
+ *        ring_size bytes (rounded up to a power of two, 0 selects
+ *        RSCFL_COLLECTOR_RING_SIZE)
+ *
+ * With a collector, application threads only call rscfl_acct: the collector
+ * reads completed measurements (with their subsystem data) as soon as the
+ * kernel signals them, or every RSCFL_COLLECTOR_PERIOD_MS, so the per-thread
+ * buffers never fill up. Measurements are then consumed from the ring with
+ * rscfl_collector_pop. When the ring is full, new measurements are dropped
+ * (and counted, see rscfl_collector_dropped).
+ *
+ * Up to max_handles handles can be added (0 selects
+ * RSCFL_COLLECTOR_MAX_HANDLES).
+ */
+#define RSCFL_COLLECTOR_RING_SIZE (4 * 1024 * 1024)
+#define RSCFL_COLLECTOR_MAX_HANDLES 1024
+#define RSCFL_COLLECTOR_PERIOD_MS 10
+rscfl_collector* rscfl_collector_start(size_t ring_size,
+                                       unsigned int max_handles);
+
+/*!
+ * \brief hands the measurements of rhdl over to the collector
+ *
+ * Must be called on the thread owning rhdl (it sets up rscfl_notify_fd).
+ * Measurements of rhdl must not be read by the application afterwards.
+ * Handles can not be removed from a collector.
+ */
+int rscfl_collector_add(rscfl_collector *c, rscfl_handle rhdl);
+
+/*!
+ * \brief takes the oldest measurement out of the ring
+ *
+ * The struct accounting is copied into acct, and its subsystem data into
+ * subsys_set (as rscfl_get_subsys_into does; subsys_set can be NULL).
+ * If rhdl is not NULL, it is set to the handle the measurement was taken on.
+ * Only one thread at a time may pop measurements from a collector.
+ *
+ * Returns 1 if a measurement was popped, 0 if the ring is empty, or -ENOSPC
+ * (leaving the measurement in the ring) if subsys_set can not hold all its
+ * subsystems.
+ */
+int rscfl_collector_pop(rscfl_collector *c, struct accounting *acct,
+                        subsys_idx_set *subsys_set, rscfl_handle *rhdl);
+
+/*!
+ * \brief number of measurements dropped because the ring was full
+ */
+unsigned long rscfl_collector_dropped(rscfl_collector *c);
+
+/*!
+ * \brief drains the added handles one last time and stops the collector
+ *        thread. Measurements still in the ring are lost.
+ */
+void rscfl_collector_stop(rscfl_collector *c);
+
 /*!
  * \brief get the number of probes for which accounting took place and resets
  *        the number to 0
@@ -376,7 +645,7 @@ void free_subsys_idx_set(subsys_idx_set *subsys_set);
  *
  * for example, using rscfl_get_subsys_by_id does not free the kernel-side
  * resources allocated for storing per-subsystem measurement data. You would
- * need to explicitly set subsys->in_use to 0 or call rscfl_subsys_free
+ * need to explicitly call rscfl_subsys_release or rscfl_subsys_free
  * afterwards.
  *
  * failing to use the proper calling protocol of those functions might lead to
@@ -406,12 +675,29 @@ void rscfl_subsys_merge(struct subsys_accounting *existing_subsys,
  * \param subsys_id the id of the subsystem (one of the values in the
  *                  rscfl_subsys enum)
  *
- * returns NULL if the measured code path did not touch subsystem subsys_id
+ * returns NULL if the measured code path did not touch subsystem subsys_id.
+ * This searches the acct->nr_subsystems subsystems touched by the
+ * measurement; to visit all of them, use rscfl_get_subsys_at instead.
  */
 struct subsys_accounting* rscfl_get_subsys_by_id(rscfl_handle rhdl,
                                                  struct accounting *acct,
                                                  rscfl_subsys subsys_id);
 
+/*!
+ * \brief gets the measurements done for acct in the pos-th kernel subsystem it
+ *        touched
+ *
+ * \param [in] acct a pointer to the accounting data structure obtained from
+ *                  calling rscfl_acct_read
+ * \param pos       0 <= pos < acct->nr_subsystems. The id of the subsystem is
+ *                  acct->acct_subsys[pos].id
+ *
+ * returns NULL if pos is out of range
+ */
+struct subsys_accounting* rscfl_get_subsys_at(rscfl_handle rhdl,
+                                              struct accounting *acct,
+                                              int pos);
+
 /*!
  * \brief marks the kernel-side memory used for subsystem accounting storage as
  *        free
@@ -421,6 +707,16 @@ struct subsys_accounting* rscfl_get_subsys_by_id(rscfl_handle rhdl,
  */
 void rscfl_subsys_free(rscfl_handle rhdl, struct accounting *acct);
 
+/*!
+ * \brief marks the kernel-side memory used by one subsys_accounting as free
+ *
+ * \param rhdl the resourceful handle for the thread where measurement is done
+ * \param subsys a pointer into kernel-shared memory, as returned by
+ *               rscfl_get_subsys_by_id. subsys must not be used after this
+ *               call.
+ */
+void rscfl_subsys_release(rscfl_handle rhdl, struct subsys_accounting *subsys);
+
 
 /****************************
  *
@@ -457,14 +753,13 @@ int rscfl_subsys_reduce_##pname(rscfl_handle rhdl, struct accounting *acct,    \
   int i;                                                                       \
   if(acct == NULL) return -EINVAL;                                             \
                                                                                \
-  for(i = 0; i < NUM_SUBSYSTEMS; ++i) {                                        \
-    struct subsys_accounting *subsys =                                         \
-      rscfl_get_subsys_by_id(rhdl, acct, (rscfl_subsys)i);                     \
+  for(i = 0; i < acct->nr_subsystems; ++i) {                                   \
+    struct subsys_accounting *subsys = rscfl_get_subsys_at(rhdl, acct, i);     \
     rtype* current;                                                            \
     if(subsys != NULL) {                                                       \
-      current = select(subsys, (rscfl_subsys)i);                               \
+      current = select(subsys, (rscfl_subsys)acct->acct_subsys[i].id);         \
       combine(accum, current);                                                 \
-      if(free_subsys) subsys->in_use = 0;                                      \
+      if(free_subsys) rscfl_subsys_release(rhdl, subsys);                      \
     }                                                                          \
   }                                                                            \
                                                                                \
@@ -479,9 +774,102 @@ DEFINE_SELECT_FCT_PTR(rint, ru64);
 DEFINE_COMBINE_FCT_PTR(rint, ru64);
 DECLARE_REDUCE_FUNCTION(rint, ru64);
 
-DEFINE_SELECT_FCT_PTR(wc, struct timespec);
-DEFINE_COMBINE_FCT_PTR(wc, struct timespec);
-DECLARE_REDUCE_FUNCTION(wc, struct timespec);
+
+/*
+ * -- offline aggregation --
+ *
+ * rscfl_subsys_soa holds copies of subsys_accounting records in
+ * structure-of-arrays form: one contiguous column per counter, row i holding
+ * the i-th record appended to it.
+ *
+ * Columns are aligned to RSCFL_SOA_ALIGN bytes, so that merging and reducing
+ * them adds whole columns with SSE2 (or AVX2, when the CPU supports it)
+ * instead of walking the records field by field. Use it when aggregating
+ * large numbers of records copied out of the kernel-shared buffer; the
+ * records appended are copies, so kernel-side memory can be released as soon
+ * as rscfl_soa_append returns.
+ */
+#define RSCFL_SOA_ALIGN 32
+
+enum rscfl_soa_col {
+  RSCFL_SOA_CPU_CYCLES,
+  RSCFL_SOA_CPU_BRANCH_MISPREDICTIONS,
+  RSCFL_SOA_CPU_INSTRUCTIONS,
+  RSCFL_SOA_CPU_ALIGNMENT_FAULTS,
+  RSCFL_SOA_CPU_WALL_CLOCK_NS,
+  RSCFL_SOA_MEM_ALLOC,
+  RSCFL_SOA_MEM_FREED,
+  RSCFL_SOA_MEM_PAGE_FAULTS,
+  RSCFL_SOA_MEM_ALIGN_FAULTS,
+  RSCFL_SOA_SCHED_WCT_OUT_LOCAL_NS,
+  RSCFL_SOA_SCHED_CYCLES_OUT_LOCAL,
+  RSCFL_SOA_SCHED_RUN_DELAY,
+  RSCFL_SOA_SCHED_XEN_SCHEDULES,
+  RSCFL_SOA_SCHED_XEN_SCHED_WCT_NS,
+  RSCFL_SOA_SCHED_XEN_SCHED_CYCLES,
+  RSCFL_SOA_SCHED_XEN_SCHED_NS,
+  RSCFL_SOA_SCHED_XEN_BLOCKS,
+  RSCFL_SOA_SCHED_XEN_YIELDS,
+  RSCFL_SOA_SCHED_XEN_EVTCHN_PENDING_SIZE,
+  RSCFL_SOA_SUBSYS_ENTRIES,
+  RSCFL_SOA_SUBSYS_EXITS,
+  RSCFL_SOA_U64_COLS
+};
+
+/*
+ * col[c]:          column c (one of enum rscfl_soa_col), size elements in use
+ * xen_credits_*:   the int columns, merged with min/max rather than +
+ * size:            the number of rows currently in use
+ * capacity:        the number of rows allocated for each column
+ */
+struct rscfl_subsys_soa {
+  ru64 *col[RSCFL_SOA_U64_COLS];
+  int *xen_credits_min;
+  int *xen_credits_max;
+  unsigned int size;
+  unsigned int capacity;
+};
+typedef struct rscfl_subsys_soa rscfl_subsys_soa;
+
+/*!
+ * \brief allocate a rscfl_subsys_soa with room for capacity rows
+ *
+ * returns NULL if memory can not be allocated. The result must be freed with
+ * rscfl_soa_free
+ */
+rscfl_subsys_soa* rscfl_soa_alloc(unsigned int capacity);
+void rscfl_soa_free(rscfl_subsys_soa *soa);
+
+/*!
+ * \brief copy subsys into a new row of soa
+ *
+ * returns the index of the new row, or -ENOMEM if soa is full
+ */
+int rscfl_soa_append(rscfl_subsys_soa *soa,
+                     const struct subsys_accounting *subsys);
+
+/*!
+ * \brief copy row of soa back into a struct subsys_accounting
+ */
+void rscfl_soa_get(const rscfl_subsys_soa *soa, unsigned int row,
+                   struct subsys_accounting *subsys);
+
+/*!
+ * \brief row-wise merge: row i of from is added to row i of into, for all rows
+ *
+ * The column equivalent of calling rscfl_subsys_merge for every row.
+ * returns -EINVAL if the two sets do not have the same number of rows.
+ */
+int rscfl_soa_merge(rscfl_subsys_soa *into, const rscfl_subsys_soa *from);
+
+/*!
+ * \brief aggregate all the rows of soa into accum
+ *
+ * Equivalent to (but faster than) calling rscfl_subsys_merge(accum, row) for
+ * every row; counters which rscfl_subsys_merge skips are added as well.
+ */
+void rscfl_soa_reduce(const rscfl_subsys_soa *soa,
+                      struct subsys_accounting *accum);
 
 
 // Shadow kernels.
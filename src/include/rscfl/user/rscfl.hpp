@@ -0,0 +1,271 @@
+/**** Notice
+ * rscfl.hpp: Resourceful C++ API
+ *
+ * Copyright 2015-2017 The rscfl owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the rscfl open-source project: github.com/lc525/rscfl;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+/**
+ * Header-only C++ layer over res_api.h.
+ *
+ * Usage example:
+ *
+ *   rscfl_handle rhdl = rscfl_init();
+ *   rscfl::Token token(rhdl);
+ *   {
+ *     rscfl::ScopedAcct measure(rhdl, token);
+ *     int fd = open("/../file_path", O_CREAT); // syscall being measured
+ *     measure.read();
+ *     ru64 cycles = measure.reduce<rscfl::field::cpu_cycles, rscfl::op::sum>();
+ *   } // subsystem data is released here, the token when it goes out of scope
+ *
+ * rscfl::reduce<Field, Op> is the equivalent of REDUCE_SUBSYS: Field selects a
+ * member of struct subsys_accounting and Op combines values, but both are
+ * types, so the loop over subsystems is inlined at compile time instead of
+ * calling a select and a combine function pointer for every subsystem.
+ */
+#ifndef _RSCFL_API_HPP_
+#define _RSCFL_API_HPP_
+
+#include <errno.h>
+#include <limits>
+
+#include "rscfl/costs.h"
+#include "rscfl/res_common.h"
+#include "rscfl/user/res_api.h"
+
+namespace rscfl {
+
+/*
+ * Fields of struct subsys_accounting that can be reduced. Each defines its
+ * value type and a get() returning a reference to the member.
+ */
+namespace field {
+
+#define RSCFL_HPP_FIELD(name, member)                                          \
+  struct name {                                                                \
+    typedef decltype(((struct subsys_accounting *)0)->member) type;            \
+    static const type& get(const struct subsys_accounting &s)                  \
+    {                                                                          \
+      return s.member;                                                         \
+    }                                                                          \
+  };
+
+RSCFL_HPP_FIELD(cpu_cycles,                  cpu.cycles)
+RSCFL_HPP_FIELD(cpu_branch_mispredictions,   cpu.branch_mispredictions)
+RSCFL_HPP_FIELD(cpu_instructions,            cpu.instructions)
+RSCFL_HPP_FIELD(cpu_alignment_faults,        cpu.alignment_faults)
+RSCFL_HPP_FIELD(cpu_wall_clock_ns,           cpu.wall_clock_time)
+RSCFL_HPP_FIELD(mem_alloc,                   mem.alloc)
+RSCFL_HPP_FIELD(mem_freed,                   mem.freed)
+RSCFL_HPP_FIELD(mem_page_faults,             mem.page_faults)
+RSCFL_HPP_FIELD(mem_align_faults,            mem.align_faults)
+RSCFL_HPP_FIELD(sched_wct_out_local_ns,      sched.wct_out_local)
+RSCFL_HPP_FIELD(sched_cycles_out_local,      sched.cycles_out_local)
+RSCFL_HPP_FIELD(sched_run_delay,             sched.run_delay)
+RSCFL_HPP_FIELD(sched_xen_schedules,         sched.xen_schedules)
+RSCFL_HPP_FIELD(sched_xen_sched_wct_ns,      sched.xen_sched_wct)
+RSCFL_HPP_FIELD(sched_xen_sched_cycles,      sched.xen_sched_cycles)
+RSCFL_HPP_FIELD(sched_xen_sched_ns,          sched.xen_sched_ns)
+RSCFL_HPP_FIELD(sched_xen_blocks,            sched.xen_blocks)
+RSCFL_HPP_FIELD(sched_xen_yields,            sched.xen_yields)
+RSCFL_HPP_FIELD(sched_xen_evtchn_pending_size, sched.xen_evtchn_pending_size)
+RSCFL_HPP_FIELD(sched_xen_credits_min,       sched.xen_credits_min)
+RSCFL_HPP_FIELD(sched_xen_credits_max,       sched.xen_credits_max)
+RSCFL_HPP_FIELD(subsys_entries,              subsys_entries)
+RSCFL_HPP_FIELD(subsys_exits,                subsys_exits)
+
+#undef RSCFL_HPP_FIELD
+
+} // namespace field
+
+/*
+ * Reduction operations: identity<T>() is the value a reduction starts from,
+ * combine folds one more value into the accumulator.
+ */
+namespace op {
+
+struct sum {
+  template <typename T> static T identity() { return T(); }
+  template <typename T> static void combine(T &accum, const T &v)
+  {
+    accum += v;
+  }
+};
+
+struct min {
+  template <typename T> static T identity()
+  {
+    return std::numeric_limits<T>::max();
+  }
+  template <typename T> static void combine(T &accum, const T &v)
+  {
+    if (v < accum) accum = v;
+  }
+};
+
+struct max {
+  template <typename T> static T identity()
+  {
+    return std::numeric_limits<T>::lowest();
+  }
+  template <typename T> static void combine(T &accum, const T &v)
+  {
+    if (v > accum) accum = v;
+  }
+};
+
+} // namespace op
+
+/*!
+ * \brief folds Field of all the subsystems touched by acct into *accum, using
+ *        Op. Same semantics and return values as REDUCE_SUBSYS
+ *
+ * If free_subsys is set, the kernel-side subsystem data of acct is released.
+ */
+template <typename Field, typename Op>
+inline int reduce(rscfl_handle rhdl, struct accounting *acct,
+                  typename Field::type *accum, bool free_subsys = false)
+{
+  if (rhdl == NULL || acct == NULL || accum == NULL) return -EINVAL;
+
+  // same checks as rscfl_get_subsys_at, without a call per subsystem
+  const struct subsys_accounting *subsyses =
+    RSCFL_SUBSYSES(rhdl->buf, &rhdl->geom);
+  for (int i = 0; i < acct->nr_subsystems; ++i) {
+    short slot = acct->acct_subsys[i].slot;
+    if (slot < 0 || (unsigned int)slot >= rhdl->geom.subsys_num) continue;
+    Op::combine(*accum, Field::get(subsyses[slot]));
+  }
+  if (free_subsys) rscfl_subsys_free(rhdl, acct);
+  return 0;
+}
+
+/*!
+ * \brief owns a rscfl_token for the lifetime of the object
+ *
+ * Getting a token can fail (see rscfl_get_token); check status() or the
+ * boolean value of the Token before using it.
+ */
+class Token
+{
+ public:
+  explicit Token(rscfl_handle rhdl) : rhdl_(rhdl), token_(NULL)
+  {
+    rc_ = rscfl_get_token(rhdl_, &token_);
+    if (rc_ != 0) token_ = NULL;
+  }
+
+  Token(Token &&other)
+    : rhdl_(other.rhdl_), token_(other.token_), rc_(other.rc_)
+  {
+    other.token_ = NULL;
+  }
+
+  Token& operator=(Token &&other)
+  {
+    if (this != &other) {
+      release();
+      rhdl_ = other.rhdl_;
+      token_ = other.token_;
+      rc_ = other.rc_;
+      other.token_ = NULL;
+    }
+    return *this;
+  }
+
+  Token(const Token&) = delete;
+  Token& operator=(const Token&) = delete;
+
+  ~Token() { release(); }
+
+  rscfl_token* get() const { return token_; }
+  int status() const { return rc_; }
+  explicit operator bool() const { return token_ != NULL; }
+
+ private:
+  void release()
+  {
+    if (token_ != NULL) rscfl_free_token(rhdl_, token_);
+    token_ = NULL;
+  }
+
+  rscfl_handle rhdl_;
+  rscfl_token *token_;
+  int rc_;
+};
+
+/*!
+ * \brief measures the syscalls made while the object is in scope
+ *
+ * The constructor expresses interest in the measurement (rscfl_acct). read()
+ * ends it (issuing ACCT_STOP for ACCT_START measurements) and copies the
+ * struct accounting into the object. The destructor reads the measurement if
+ * read() was not called, so that its slot is handed back to the kernel, and
+ * releases its subsystem data.
+ */
+class ScopedAcct
+{
+ public:
+  explicit ScopedAcct(rscfl_handle rhdl, rscfl_token *token = NULL,
+                      interest_flags fl = ACCT_DEFAULT)
+    : rhdl_(rhdl), token_(token), fl_(fl), read_rc_(-ENODATA), read_(false)
+  {
+    acct_.nr_subsystems = 0;
+    rc_ = rscfl_acct_api(rhdl_, token_, fl_);
+  }
+
+  ScopedAcct(rscfl_handle rhdl, const Token &token,
+             interest_flags fl = ACCT_DEFAULT)
+    : ScopedAcct(rhdl, token.get(), fl) {}
+
+  ScopedAcct(const ScopedAcct&) = delete;
+  ScopedAcct& operator=(const ScopedAcct&) = delete;
+
+  ~ScopedAcct()
+  {
+    if (rc_ != 0) return;
+    read();
+    if (read_rc_ >= 0) rscfl_subsys_free(rhdl_, &acct_);
+  }
+
+  // the return value of rscfl_acct
+  int status() const { return rc_; }
+
+  // the return value of rscfl_read_acct. Calling read() again returns the
+  // result of the first call
+  int read()
+  {
+    if (rc_ != 0 || read_) return rc_ != 0 ? rc_ : read_rc_;
+    if ((fl_ & ACCT_START) != 0) {
+      rscfl_acct_api(rhdl_, token_, ACCT_STOP);
+    }
+    read_rc_ = rscfl_read_acct_api(rhdl_, &acct_, token_);
+    read_ = true;
+    return read_rc_;
+  }
+
+  const struct accounting& acct() const { return acct_; }
+
+  template <typename Field, typename Op>
+  typename Field::type reduce()
+  {
+    typename Field::type accum = Op::template identity<typename Field::type>();
+    if (read() >= 0) rscfl::reduce<Field, Op>(rhdl_, &acct_, &accum);
+    return accum;
+  }
+
+ private:
+  rscfl_handle rhdl_;
+  rscfl_token *token_;
+  interest_flags fl_;
+  int rc_;
+  int read_rc_;
+  bool read_;
+  struct accounting acct_;
+};
+
+} // namespace rscfl
+
+#endif // _RSCFL_API_HPP_
@@ -0,0 +1,215 @@
+/**** Notice
+ * rscfl_coro.hpp: Resourceful C++20 coroutine integration
+ *
+ * Copyright 2015-2017 The rscfl owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the rscfl open-source project: github.com/lc525/rscfl;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+/**
+ * Attributes the syscalls made by coroutines to the rscfl token of the request
+ * they serve, as the coroutines get suspended and resumed on the threads of a
+ * pool.
+ *
+ * Usage example:
+ *
+ *   // on every thread of the pool, before running coroutines
+ *   rscfl_handle rhdl = rscfl_init(&cfg);  // cfg.max_threads != 0
+ *   rscfl::coro::bind_thread(rhdl);
+ *
+ *   struct task {
+ *     struct promise_type : rscfl::coro::TokenPromise {
+ *       ...
+ *       std::suspend_always final_suspend() noexcept {
+ *         release_thread();
+ *         return {};
+ *       }
+ *     };
+ *   };
+ *
+ *   task handle_request(rscfl_token *token) {  // from rscfl_get_shared_token
+ *     co_await rscfl::coro::with_token(token);
+ *     co_await read_request();  // measured, except while suspended
+ *     ...
+ *   }
+ *
+ * bind_thread starts accounting on the thread (ACCT_START) with NULL_TOKEN
+ * active, so that nothing is measured outside coroutines. TokenPromise makes
+ * every co_await of the coroutine switch to NULL_TOKEN before suspending and
+ * back to the token of the request on resume. A switch is a single store into
+ * ctrl->interest of the thread running the coroutine: the kernel picks up the
+ * new token on the next syscall.
+ *
+ * A coroutine created by another one (say, a lazy task it then co_awaits)
+ * starts with the token of its creator, and co_await handing the thread
+ * straight to another coroutine (await_suspend returning a handle) keeps the
+ * token active: the nested coroutine is measured as part of the same request.
+ * Only giving the thread back (to the pool, or to noop_coroutine) drops it.
+ *
+ * Coroutines resumed on other threads need process-wide tokens
+ * (rscfl_get_shared_token); per-thread tokens only work for coroutines that
+ * never leave the thread their token was created on.
+ */
+#ifndef _RSCFL_CORO_HPP_
+#define _RSCFL_CORO_HPP_
+
+#if !defined(__cpp_impl_coroutine)
+#error "rscfl_coro.hpp needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <errno.h>
+#include <type_traits>
+#include <utility>
+
+#include "rscfl/res_common.h"
+#include "rscfl/user/res_api.h"
+
+namespace rscfl {
+namespace coro {
+
+namespace detail {
+
+// The handle bound to the calling thread. Not inlined, so that compilers
+// cannot keep the address of the thread_local across a suspension point of
+// the caller: the coroutine may be resumed on another thread.
+[[gnu::noinline]] inline rscfl_handle& bound_handle()
+{
+  static thread_local rscfl_handle rhdl = NULL;
+  return rhdl;
+}
+
+template <typename A>
+decltype(auto) get_awaiter(A &&a)
+{
+  if constexpr (requires { static_cast<A&&>(a).operator co_await(); })
+    return static_cast<A&&>(a).operator co_await();
+  else if constexpr (requires { operator co_await(static_cast<A&&>(a)); })
+    return operator co_await(static_cast<A&&>(a));
+  else
+    return static_cast<A&&>(a);
+}
+
+} // namespace detail
+
+/*!
+ * \brief starts accounting on the calling thread, with nothing measured until
+ *        a coroutine switches to its token
+ */
+inline int bind_thread(rscfl_handle rhdl)
+{
+  int rc;
+  if (rhdl == NULL) return -EINVAL;
+  if ((rc = rscfl_acct_api(rhdl, NULL, ACCT_START)) != 0) return rc;
+  rhdl->ctrl->interest.token_id = NULL_TOKEN;
+  detail::bound_handle() = rhdl;
+  return 0;
+}
+
+inline int unbind_thread()
+{
+  rscfl_handle rhdl = detail::bound_handle();
+  if (rhdl == NULL) return -EINVAL;
+  detail::bound_handle() = NULL;
+  return rscfl_acct_api(rhdl, NULL, ACCT_STOP);
+}
+
+// make token_id the active token of the calling thread
+inline void switch_to(short token_id) noexcept
+{
+  rscfl_handle rhdl = detail::bound_handle();
+  if (rhdl != NULL) rhdl->ctrl->interest.token_id = token_id;
+}
+
+// the active token of the calling thread
+inline short active_token() noexcept
+{
+  rscfl_handle rhdl = detail::bound_handle();
+  return rhdl != NULL ? (short)rhdl->ctrl->interest.token_id
+                      : (short)NULL_TOKEN;
+}
+
+/*
+ * Wraps the awaiter of every co_await in a TokenPromise coroutine: the token
+ * is dropped in await_suspend when the thread goes back to whoever resumed
+ * the coroutine, and made active again in await_resume, on the thread
+ * resuming it.
+ */
+template <typename Awaiter>
+struct TokenAwaiter {
+  Awaiter inner;
+  short token_id;
+
+  bool await_ready() { return inner.await_ready(); }
+
+  template <typename Promise>
+  auto await_suspend(std::coroutine_handle<Promise> h)
+  {
+    typedef decltype(inner.await_suspend(h)) ret_t;
+    if constexpr (std::is_void_v<ret_t> || std::is_same_v<ret_t, bool>) {
+      // the coroutine can be resumed elsewhere before this returns
+      switch_to(NULL_TOKEN);
+      return inner.await_suspend(h);
+    } else {
+      // symmetric transfer: the returned coroutine runs next on this thread.
+      // A TokenPromise one being resumed switches to its own token; one
+      // starting now (a nested coroutine) runs with the token of the request
+      ret_t next = inner.await_suspend(h);
+      if (std::coroutine_handle<>(next) == std::noop_coroutine())
+        switch_to(NULL_TOKEN);
+      return next;
+    }
+  }
+
+  decltype(auto) await_resume()
+  {
+    switch_to(token_id);
+    return inner.await_resume();
+  }
+};
+
+// co_await with_token(token) sets the token of the calling coroutine
+struct with_token {
+  explicit with_token(rscfl_token *tk)
+    : token_id(tk != NULL ? (short)tk->id : (short)NULL_TOKEN) {}
+  short token_id;
+};
+
+/*!
+ * \brief mixin for promise types, switching tokens around every co_await
+ */
+class TokenPromise
+{
+ public:
+  // a coroutine created by another one serves the same request
+  TokenPromise() noexcept : token_id_(active_token()) {}
+
+  std::suspend_never await_transform(with_token tk) noexcept
+  {
+    token_id_ = tk.token_id;
+    switch_to(token_id_);
+    return {};
+  }
+
+  template <typename A>
+  auto await_transform(A &&a)
+  {
+    typedef decltype(detail::get_awaiter(std::forward<A>(a))) awaiter_t;
+    return TokenAwaiter<awaiter_t>{detail::get_awaiter(std::forward<A>(a)),
+                                   token_id_};
+  }
+
+  // call from final_suspend (or before handing the thread back to the pool
+  // in any other way): the coroutine will not make any more syscalls
+  void release_thread() noexcept { switch_to(NULL_TOKEN); }
+
+  short token_id() const { return token_id_; }
+
+ protected:
+  short token_id_;
+};
+
+} // namespace coro
+} // namespace rscfl
+
+#endif // _RSCFL_CORO_HPP_
@@ -10,51 +10,295 @@
 #include "rscfl/kernel/acct.h"
 
 #include <linux/compiler.h>
+#include <linux/eventfd.h>
 #include <linux/hashtable.h>
+#include <linux/irq_work.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "rscfl/config.h"
 #include "rscfl/costs.h"
 #include "rscfl/res_common.h"
+#include "rscfl/kernel/chardev.h"
 #include "rscfl/kernel/cpu.h"
 #include "rscfl/kernel/measurement.h"
 #include "rscfl/kernel/xen.h"
 
-static struct accounting *alloc_acct(pid_acct *current_pid_acct)
+static inline volatile unsigned char *acct_state(pid_acct *current_pid_acct,
+                                                  struct accounting *acct)
+{
+  rscfl_acct_geom_t *geom = &current_pid_acct->geom;
+  return &RSCFL_ACCT_IN_USE(current_pid_acct->shared_buf, geom)
+           [acct - RSCFL_ACCT(current_pid_acct->shared_buf, geom)];
+}
+
+/*
+ * Make sure acct (a slot of the shared buffer of current_pid_acct) is OPEN so
+ * that more data can be aggregated into it. Fails if user space has claimed
+ * (or read and released) the measurement in the meantime.
+ */
+static inline int acct_reopen(pid_acct *current_pid_acct,
+                              struct accounting *acct)
+{
+  volatile unsigned char *state = acct_state(current_pid_acct, acct);
+  return *state == RSCFL_ACCT_OPEN ||
+         cmpxchg(state, RSCFL_ACCT_COMPLETE, RSCFL_ACCT_OPEN) ==
+           RSCFL_ACCT_COMPLETE;
+}
+
+/*
+ * Take a free struct accounting from the slot ring of the shared buffer.
+ *
+ * If recycle is not NULL, it points to a slot that the current pid already
+ * owns (the unread measurement of a token being reset); that slot is
+ * re-initialised instead, as the kernel never produces into the ring.
+ */
+static struct accounting *alloc_acct(pid_acct *current_pid_acct,
+                                     struct accounting *recycle)
 {
   rscfl_acct_layout_t *rscfl_shared_mem = current_pid_acct->shared_buf;
-  struct accounting *acct_buf = rscfl_shared_mem->acct;
-
-  BUG_ON(!acct_buf);
-  while (acct_buf->in_use) {
-    acct_buf++;
-    if ((void *)(acct_buf + 1) >
-        (void *)current_pid_acct->shared_buf->subsyses) {
-      //acct_buf = current_pid_acct->shared_buf->acct;
+  rscfl_acct_geom_t *geom = &current_pid_acct->geom;
+  rscfl_acct_ring_t *ring = &rscfl_shared_mem->acct_ring;
+  struct accounting *accts;
+  struct accounting *acct_buf;
+  short ix;
+
+  BUG_ON(!rscfl_shared_mem);
+  accts = RSCFL_ACCT(rscfl_shared_mem, geom);
+  if (recycle != NULL) {
+    ix = recycle - accts;
+  } else {
+    if (ring->head == ring->tail) {
       printk(KERN_WARNING "_should_acct: wraparound!<<<<<<<\n");
       return NULL;
     }
+    // Only read the slot index after seeing the tail that published it.
+    smp_rmb();
+    ix = RSCFL_RING_SLOTS(rscfl_shared_mem, geom)[ring->head % geom->acct_num];
+    // The ring is writable from user space, don't trust its contents.
+    if (ix < 0 || ix >= geom->acct_num) {
+      printk(KERN_ERR "rscfl: invalid accounting slot %d in ring\n", ix);
+      return NULL;
+    }
+    ring->head++;
   }
-  /*
-   *if(IS_USER_TOKEN(acct_buf->token_id)) {
-   *  current_pid_acct->token_ix[acct_buf->token_id]->account = NULL;
-   *} else if(acct_buf->token_id == DEFAULT_TOKEN) {
-   *  current_pid_acct->default_token->account = NULL;
-   *}
-   */
-  acct_buf->in_use = 1;
+  acct_buf = &accts[ix];
+
+  RSCFL_ACCT_IN_USE(rscfl_shared_mem, geom)[ix] = RSCFL_ACCT_OPEN;
+  acct_buf->rc = 0;
   acct_buf->nr_subsystems = 0;
+  acct_buf->sample_weight =
+    (current_pid_acct->ctrl->interest.flags & ACCT_SAMPLE) != 0 &&
+    current_pid_acct->ctrl->config.sample_period > 1 ?
+      current_pid_acct->ctrl->config.sample_period : 1;
+  acct_buf->token_id = current_pid_acct->active_token->id;
   acct_buf->syscall_id = current_pid_acct->ctrl->interest.syscall_id;
-  // Initialise the subsys_accounting indices to -1, as they are used
-  // to index an array, so 0 is valid.
-  memset(acct_buf->acct_subsys, -1, sizeof(short) * NUM_SUBSYSTEMS);
+  // acct_subsys is only valid up to nr_subsystems, so it needs no clearing
+
+  smp_wmb();
+  RSCFL_SYSCALL_IX(rscfl_shared_mem, geom)
+    [ACCT_SYSCALL_IX(geom, acct_buf->syscall_id)] = ix;
 
   return acct_buf;
 }
 
+/*
+ * Grow the token table of pa so that it has room for at least size tokens.
+ *
+ * The table is read by the probes without locking (possibly on another CPU,
+ * when monitoring a different pid), so a bigger copy is published and the old
+ * table is only freed after all probes that might still use it have
+ * finished. Probe handlers run with preemption disabled.
+ */
+static int grow_token_ix(pid_acct *pa, unsigned int size)
+{
+  rscfl_kernel_token **new_ix, **old_ix;
+  unsigned int new_size = max(pa->token_ix_size, (unsigned int)MIN_READY_TOKENS);
+
+  while (new_size < size) new_size *= 2;
+  new_size = min(new_size, pa->geom.token_num);
+
+  new_ix = kcalloc(new_size, sizeof(rscfl_kernel_token *), GFP_KERNEL);
+  if (new_ix == NULL) return -ENOMEM;
+  old_ix = pa->token_ix;
+  if (old_ix != NULL) {
+    memcpy(new_ix, old_ix, pa->num_tokens * sizeof(rscfl_kernel_token *));
+  }
+  smp_wmb();
+  pa->token_ix = new_ix;
+  pa->token_ix_size = new_size;
+
+  if (old_ix != NULL) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+    synchronize_sched();
+#else
+    synchronize_rcu();
+#endif
+    kfree(old_ix);
+  }
+  return 0;
+}
+
+int new_kernel_tokens(pid_acct *pa, unsigned int num)
+{
+  unsigned int i, n = pa->num_tokens;
+
+  if (num > pa->geom.token_num - n) num = pa->geom.token_num - n;
+  if (n + num > pa->token_ix_size && grow_token_ix(pa, n + num)) {
+    return -ENOMEM;
+  }
+  for (i = 0; i < num; i++) {
+    rscfl_kernel_token *token =
+      kzalloc(sizeof(struct rscfl_kernel_token), GFP_KERNEL);
+    if (token == NULL) {
+      break;
+    }
+    token->id = n + i;
+    pa->token_ix[n + i] = token;
+  }
+  // probes check token ids against num_tokens before looking them up
+  smp_wmb();
+  pa->num_tokens = n + i;
+  return i;
+}
+
+void free_kernel_tokens(pid_acct *pa)
+{
+  unsigned int i;
+
+  for (i = 0; i < pa->num_tokens; i++) {
+    kfree(pa->token_ix[i]);
+  }
+  kfree(pa->token_ix);
+  kfree(pa->default_token);
+  pa->token_ix = NULL;
+  pa->token_ix_size = 0;
+  pa->num_tokens = 0;
+  pa->default_token = NULL;
+}
+
+static void acct_notify_work(struct irq_work *work)
+{
+  pid_acct *pa = container_of(work, pid_acct, notify_work);
+  struct eventfd_ctx *ctx = READ_ONCE(pa->notify_ctx);
+  int n = atomic_xchg(&pa->notify_signal, 0);
+
+  if (ctx != NULL && n > 0) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(ctx, n);
+#else
+    eventfd_signal(ctx);
+#endif
+  }
+}
+
+void acct_notify(pid_acct *pa, _Bool err)
+{
+  if (READ_ONCE(pa->notify_ctx) == NULL) return;
+
+  // eventfd_signal takes a spinlock and wakes up the reader, which is not
+  // safe from every probe (the scheduler ones in particular)
+  pa->notify_pending++;
+  if (err || pa->notify_pending >= pa->notify_watermark) {
+    atomic_add(pa->notify_pending, &pa->notify_signal);
+    pa->notify_pending = 0;
+    irq_work_queue(&pa->notify_work);
+  }
+}
+
+int set_acct_notify(pid_acct *pa, int efd, unsigned int watermark)
+{
+  struct eventfd_ctx *ctx = NULL;
+
+  if (watermark != 0) {
+    ctx = eventfd_ctx_fdget(efd);
+    if (IS_ERR(ctx)) return PTR_ERR(ctx);
+  }
+  free_acct_notify(pa);
+
+  init_irq_work(&pa->notify_work, acct_notify_work);
+  atomic_set(&pa->notify_signal, 0);
+  pa->notify_pending = 0;
+  // no more than acct_num measurements can wait to be read
+  pa->notify_watermark = min(watermark, pa->geom.acct_num);
+  smp_wmb();
+  pa->notify_ctx = ctx;
+  return 0;
+}
+
+void free_acct_notify(pid_acct *pa)
+{
+  struct eventfd_ctx *ctx = xchg(&pa->notify_ctx, NULL);
+
+  // a zeroed irq_work (notifications never set up) is never busy
+  irq_work_sync(&pa->notify_work);
+  if (ctx != NULL) {
+    eventfd_ctx_put(ctx);
+  }
+}
+
+static atomic_t pid_acct_releases = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(pid_acct_releases_wq);
+
+static void release_pid_acct_work(struct work_struct *work)
+{
+  pid_acct *pa = container_of(work, pid_acct, release_work);
+
+  // acct_notify_work reads notify_ctx, which is already NULL: once the
+  // irq_work is done, nothing else uses the eventfd
+  irq_work_sync(&pa->notify_work);
+  eventfd_ctx_put(pa->notify_release_ctx);
+  kfree(pa);
+  if (atomic_dec_and_test(&pid_acct_releases))
+    wake_up(&pid_acct_releases_wq);
+}
+
+void release_pid_acct(pid_acct *pa)
+{
+  // only the exiting thread queues notifications for pa, so after this no
+  // new irq_work can be queued
+  struct eventfd_ctx *ctx = xchg(&pa->notify_ctx, NULL);
+
+  if (ctx == NULL) {
+    // set_acct_notify/free_acct_notify synced any earlier irq_work
+    kfree(pa);
+    return;
+  }
+  pa->notify_release_ctx = ctx;
+  atomic_inc(&pid_acct_releases);
+  INIT_WORK(&pa->release_work, release_pid_acct_work);
+  schedule_work(&pa->release_work);
+}
+
+void acct_notify_drain(void)
+{
+  wait_event(pid_acct_releases_wq, atomic_read(&pid_acct_releases) == 0);
+}
+
+_Bool acct_sampled(pid_acct *current_pid_acct)
+{
+  unsigned int period = current_pid_acct->ctrl->config.sample_period;
+
+  if (period <= 1) return 1;
+  if (current_pid_acct->ctrl->config.sample_random) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+    return prandom_u32() % period == 0;
+#else
+    return get_random_u32() % period == 0;
+#endif
+  }
+  return current_pid_acct->sample_count++ % period == 0;
+}
+
 int update_acct(void)
 {
   volatile syscall_interest_t *interest;
   pid_acct *current_pid_acct;
+  struct accounting *recycle = NULL;
 
   current_pid_acct = CPU_VAR(current_acct);
   interest = &current_pid_acct->ctrl->interest;
@@ -63,7 +307,20 @@ int update_acct(void)
   if(current_pid_acct->active_token->id != interest->token_id) {
     // we're swapping tokens to interest->token_id
     // printk(KERN_ERR "token swap from %d to %d\n", current_pid_acct->active_token->id, interest->token_id);
-    if(IS_USER_TOKEN(interest->token_id)) {
+    if(IS_SHARED_TOKEN(interest->token_id)) {
+      rscfl_kernel_token *tk =
+        rscfl_region_shared_token(current_pid_acct, interest->token_id);
+      if(tk == NULL) {
+        // not in per-process mode, or a bogus id
+        interest->syscall_id = 0;
+        interest->flags |= __ACCT_ERR;
+        return 1;
+      }
+      current_pid_acct->active_token = tk;
+    } else if(IS_USER_TOKEN(interest->token_id) &&
+       interest->token_id < current_pid_acct->num_tokens) {
+      // pairs with the smp_wmb in new_kernel_tokens
+      smp_rmb();
       current_pid_acct->active_token =
         current_pid_acct->token_ix[interest->token_id];
     } else { // DEFAULT_TOKEN
@@ -71,14 +328,34 @@ int update_acct(void)
     }
   }
 
+  // process-wide tokens always aggregate into the same struct accounting,
+  // possibly from several threads at once; user space resets it on reads
+  if(current_pid_acct->active_token->shared) {
+    interest->first_measurement = 0;
+    current_pid_acct->probe_data->syscall_acct =
+      current_pid_acct->active_token->account;
+    return 0;
+  }
+
   if(interest->first_measurement && current_pid_acct->active_token != current_pid_acct->default_token) {
     volatile rscfl_kernel_token *tk = current_pid_acct->active_token;
-    if(tk->account != NULL && tk->account->token_id == tk->id ) {
-      tk->account->in_use = 0;
+    if(tk->account != NULL && tk->account->token_id == tk->id &&
+       acct_reopen(current_pid_acct, tk->account)) {
+      // the previous measurement of this token was never read, reuse its slot
+      recycle = tk->account;
     }
    tk->account = NULL;
   }
 
+  // user space might have read (and released) the struct accounting of the
+  // active token in the meantime; stop aggregating into it if so
+  if(current_pid_acct->active_token->account != NULL) {
+    volatile rscfl_kernel_token *tk = current_pid_acct->active_token;
+    if(tk->account->token_id != (unsigned short)tk->id ||
+       !acct_reopen(current_pid_acct, tk->account))
+      tk->account = NULL;
+  }
+
   current_pid_acct->probe_data->syscall_acct =
     current_pid_acct->active_token->account;
 
@@ -91,14 +368,17 @@ int update_acct(void)
   if(current_pid_acct->active_token == current_pid_acct->default_token){
     printk("alloc for default token, first:%d\n", interest->first_measurement);
   }
-  current_pid_acct->probe_data->syscall_acct = alloc_acct(current_pid_acct);
+  current_pid_acct->probe_data->syscall_acct =
+    alloc_acct(current_pid_acct, recycle);
   if(current_pid_acct->probe_data->syscall_acct == NULL) {
     interest->syscall_id = 0;
     interest->flags |= __ACCT_ERR;
+    acct_notify(current_pid_acct, 1);
     return 1;
   }
 
-  // diff = current_pid_acct->probe_data->syscall_acct - current_pid_acct->shared_buf->acct
+  // diff = current_pid_acct->probe_data->syscall_acct -
+  //          RSCFL_ACCT(current_pid_acct->shared_buf, &current_pid_acct->geom)
   // printk(KERN_ERR "alloc_acct: %d for token %d\n", diff, current_pid_acct->active_token->id);
   if(interest->first_measurement) {
     volatile rscfl_kernel_token *tk = current_pid_acct->active_token;
@@ -107,6 +387,9 @@ int update_acct(void)
     tk->val2 = xen_current_sched_out();
     tk->account = current_pid_acct->probe_data->syscall_acct;
     tk->account->token_id = tk->id;
+    RSCFL_TOKEN_IX(current_pid_acct->shared_buf, &current_pid_acct->geom)
+      [ACCT_TOKEN_IX(&current_pid_acct->geom, tk->id)] = tk->account -
+        RSCFL_ACCT(current_pid_acct->shared_buf, &current_pid_acct->geom);
     //xen_clear_current_sched_out();
   } else {
     printk(KERN_ERR "Alloc but not first!");
@@ -138,6 +421,19 @@ int clear_acct_next(void)
  *  current_pid_acct->active_token->val2 = -1 * xen_current_sched_out();
  *#endif
  */
+  // The syscall has returned, so user space can now read the measurement.
+  // Process-wide tokens have no slot state: other threads may still be
+  // aggregating into their struct accounting.
+  if(current_pid_acct->probe_data->syscall_acct != NULL &&
+     !current_pid_acct->active_token->shared) {
+    smp_wmb();
+    if (cmpxchg(acct_state(current_pid_acct,
+                           current_pid_acct->probe_data->syscall_acct),
+                RSCFL_ACCT_OPEN, RSCFL_ACCT_COMPLETE) == RSCFL_ACCT_OPEN) {
+      acct_notify(current_pid_acct, 0);
+    }
+  }
+
   // If we're not aggregating in kernel-space, clear the cached pointer to the
   // struct accounting.
   if(current_pid_acct->ctrl->config.kernel_agg != 1) {
@@ -9,14 +9,21 @@
 
 #include "rscfl/kernel/chardev.h"
 
+#include <linux/capability.h>
 #include <linux/cdev.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
 #include <linux/rwlock_types.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
 
 #include "rscfl/config.h"
 #include "rscfl/costs.h"
 #include "rscfl/res_common.h"
 #include "rscfl/kernel/acct.h"
 #include "rscfl/kernel/cpu.h"
+#include "rscfl/kernel/probes.h"
 #include "rscfl/kernel/rscfl.h"
 #include "rscfl/kernel/shdw.h"
 
@@ -30,19 +37,50 @@ struct device *rscfl_ctrl_device;
 
 static struct class *data_class, *ctrl_class;
 
+static int data_open(struct inode *, struct file *);
 static int data_mmap(struct file *, struct vm_area_struct *);
+static int data_release(struct inode *, struct file *);
 static int ctrl_mmap(struct file *, struct vm_area_struct *);
+static int ctrl_release(struct inode *, struct file *);
 static long rscfl_ioctl(struct file *, unsigned int cmd, unsigned long arg);
 
-static struct file_operations data_fops = {.mmap = data_mmap, };
+static struct file_operations data_fops = {
+  .open = data_open,
+  .mmap = data_mmap,
+  .release = data_release,
+};
 static struct file_operations ctrl_fops = {
   .mmap = ctrl_mmap,
+  .release = ctrl_release,
   .unlocked_ioctl = rscfl_ioctl,
 };
 
+/*
+ * How the memory shared with user space was allocated:
+ *
+ * RSCFL_BUF_KMALLOC: small buffers (up to PAGE_ALLOC_COSTLY_ORDER pages).
+ *                    kzalloc-ed, mapped with remap_pfn_range.
+ * RSCFL_BUF_VMALLOC: larger buffers. Those do not need to be physically
+ *                    contiguous, so they don't fail under fragmentation.
+ * RSCFL_BUF_PAGES:   opt-in (rscfl_config.huge_pages) for buffers of at
+ *                    least PMD_SIZE: a compound allocation. The kernel
+ *                    writes to it through the huge-page direct mapping,
+ *                    so the probes don't pay for 4K TLB entries as they do
+ *                    with vmalloc-ed memory.
+ */
+enum rscfl_buf_alloc {
+  RSCFL_BUF_KMALLOC,
+  RSCFL_BUF_VMALLOC,
+  RSCFL_BUF_PAGES,
+};
+
+#define RSCFL_KMALLOC_MAX_BUF (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
+
 struct rscfl_vma_data {
   pid_acct *pid_acct_node;
   char *mmap_shared_buf;
+  enum rscfl_buf_alloc alloc;
+  unsigned int order; // for RSCFL_BUF_PAGES
   int ref_count;
 };
 typedef struct rscfl_vma_data rscfl_vma_data;
@@ -55,6 +93,75 @@ static struct vm_operations_struct rscfl_mmap_vm_ops = {
   .close = rscfl_vma_close,
 };
 
+/*
+ * Per-process mode (rscfl_config.max_threads != 0).
+ *
+ * The first thread of a process maps a region with room for max_threads
+ * slices. Slice i is the data buffer found at i * RSCFL_SLICE_SIZE of the data
+ * mapping, together with the ctrl page found at i * MMAP_CTL_SIZE of the ctrl
+ * mapping. The other threads of the process share the fds and the mappings,
+ * and take a slice with RSCFL_REGISTER_THREAD_CMD.
+ *
+ * The memory of a slice is allocated when a thread first registers into it,
+ * and mapped into user space page by page, when touched (rscfl_region_fault).
+ * When its thread exits, a slice is kept for the next thread that registers,
+ * so the user space mappings never go stale. All slices are freed with the
+ * region, once both mappings and the ctrl fd are gone.
+ *
+ * The process-wide slice (RSCFL_SHARED_SLICE) follows the thread slices in
+ * the data mapping and in the slices array. It is allocated with the region,
+ * together with the process-wide tokens aggregating into it.
+ *
+ * region_lock protects the slice owners, the pid_acct->region links and the
+ * region reference counts. It is only taken when threads register or exit and
+ * when the mappings are created or destroyed.
+ */
+struct rscfl_region_slice {
+  char *data;                 // vmalloc_user-ed, slice_size bytes
+  rscfl_ctrl_layout_t *ctrl;  // a zeroed page
+  pid_acct *owner;
+  _Bool busy;                 // owned, or being set up for a new owner
+};
+
+struct rscfl_region {
+  rscfl_config config;
+  rscfl_acct_geom_t geom;
+  unsigned long slice_size;
+  unsigned int nr_slices;
+  struct rscfl_region_slice *slices;  // nr_slices + 1, see above
+  rscfl_kernel_token *shared_tokens;  // geom.acct_num
+  int ref_count;              // mappings and the ctrl fd
+};
+
+static DEFINE_SPINLOCK(region_lock);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+typedef int vm_fault_t;
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+// vm_flags became read-only in 6.3; it is only written through vm_flags_set
+static inline void vm_flags_set(struct vm_area_struct *vma, vm_flags_t flags)
+{
+  vma->vm_flags |= flags;
+}
+#endif
+
+static void rscfl_region_vma_open(struct vm_area_struct *);
+static void rscfl_region_vma_close(struct vm_area_struct *);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+static vm_fault_t rscfl_region_fault(struct vm_area_struct *,
+                                     struct vm_fault *);
+#else
+static vm_fault_t rscfl_region_fault(struct vm_fault *);
+#endif
+
+static struct vm_operations_struct rscfl_region_vm_ops = {
+  .open = rscfl_region_vma_open,
+  .close = rscfl_region_vma_close,
+  .fault = rscfl_region_fault,
+};
+
 
 static int drv_dev_uevent_r(struct device *dev, struct kobj_uevent_env *env) {
   add_uevent_var(env, "DEVMODE=%#o", 0444);
@@ -134,6 +241,22 @@ static void rscfl_vma_open(struct vm_area_struct *vma)
   drv_data->ref_count++;
 }
 
+static void free_shared_buf(char *shared_buf, enum rscfl_buf_alloc alloc,
+                            unsigned int order)
+{
+  switch (alloc) {
+    case RSCFL_BUF_KMALLOC:
+      kfree(shared_buf);
+      break;
+    case RSCFL_BUF_VMALLOC:
+      vfree(shared_buf);
+      break;
+    case RSCFL_BUF_PAGES:
+      __free_pages(virt_to_page(shared_buf), order);
+      break;
+  }
+}
+
 static void rscfl_vma_close(struct vm_area_struct *vma)
 {
   rscfl_vma_data *drv_data = (rscfl_vma_data*) vma->vm_private_data;
@@ -149,7 +272,8 @@ static void rscfl_vma_close(struct vm_area_struct *vma)
         drv_data->pid_acct_node->shared_buf = NULL;
       }
 
-      kfree(drv_data->mmap_shared_buf);
+      free_shared_buf(drv_data->mmap_shared_buf, drv_data->alloc,
+                      drv_data->order);
       vma->vm_private_data = NULL;
       kfree(drv_data);
     }
@@ -159,21 +283,49 @@ static void rscfl_vma_close(struct vm_area_struct *vma)
 /*
  * Alloc and mmap some memory. Return the address of the memory through
  * mapped_mem.
+ *
+ * Buffers larger than RSCFL_KMALLOC_MAX_BUF are vmalloc-ed, or, if huge is
+ * set, allocated as physically contiguous pages when possible (see
+ * enum rscfl_buf_alloc).
  */
 static int mmap_common(struct file *filp, struct vm_area_struct *vma,
-                       char **mapped_mem, size_t req_length)
+                       char **mapped_mem, size_t req_length, int huge)
 {
-  unsigned long page;
-  unsigned long pos;
   unsigned long size = (unsigned long)vma->vm_end - vma->vm_start;
-  unsigned long start = (unsigned long)vma->vm_start;
   struct rscfl_vma_data *drv_data;
-  char *shared_buf;
+  enum rscfl_buf_alloc alloc = RSCFL_BUF_KMALLOC;
+  unsigned int order = 0;
+  char *shared_buf = NULL;
+  int rc;
 
   if (size > req_length) return -EINVAL;
 
-  shared_buf = kzalloc(req_length, GFP_KERNEL);
-  //shared_buf = dma_zalloc_coherent(dev, req_length, GFP_KERNEL);
+  if (req_length <= RSCFL_KMALLOC_MAX_BUF) {
+    shared_buf = kzalloc(req_length, GFP_KERNEL);
+    //shared_buf = dma_zalloc_coherent(dev, req_length, GFP_KERNEL);
+  } else {
+    // a contiguous allocation only pays off when it can be mapped with
+    // at least one PMD; smaller buffers stay on vmalloc
+    if (huge && req_length >= PMD_SIZE) {
+      struct page *pages = NULL;
+      order = get_order(req_length);
+      if (order < MAX_ORDER) {
+        pages = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_COMP |
+                            __GFP_NOWARN, order);
+      }
+      if (pages) {
+        alloc = RSCFL_BUF_PAGES;
+        shared_buf = page_address(pages);
+      } else {
+        printk(KERN_WARNING "rscfl: no contiguous memory for a %zu byte "
+                            "buffer, falling back to vmalloc\n", req_length);
+      }
+    }
+    if (!shared_buf) {
+      alloc = RSCFL_BUF_VMALLOC;
+      shared_buf = vmalloc_user(req_length);
+    }
+  }
   if (!shared_buf) {
     return -ENOMEM;
   }
@@ -181,30 +333,30 @@ static int mmap_common(struct file *filp, struct vm_area_struct *vma,
 
   // do the actual mmap-ing of shared_buf (kernel memory) into the address space
   // of the calling process (user space)
-  pos = (unsigned long)shared_buf;
   //vma->vm_page_prot = PAGE_SHARED;
   //vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-
-  while (size > 0) {
-    page = virt_to_phys((void *)pos);
-    if (remap_pfn_range(vma, start, page >> PAGE_SHIFT, req_length,
-                        vma->vm_page_prot)) {
-      kfree(shared_buf);
-      printk(KERN_ERR "ERROR remap_pfn_range!\n");
-      return -EAGAIN;
-    }
-    start += req_length;
-    pos += req_length;
-    size -= req_length;
+  if (alloc == RSCFL_BUF_VMALLOC) {
+    rc = remap_vmalloc_range(vma, shared_buf, 0);
+  } else {
+    rc = remap_pfn_range(vma, vma->vm_start,
+                         virt_to_phys(shared_buf) >> PAGE_SHIFT, size,
+                         vma->vm_page_prot);
+  }
+  if (rc) {
+    free_shared_buf(shared_buf, alloc, order);
+    printk(KERN_ERR "ERROR remapping rscfl shared memory!\n");
+    return -EAGAIN;
   }
 
   drv_data = kzalloc(sizeof(rscfl_vma_data), GFP_KERNEL);
   if (!drv_data) {
-    kfree(shared_buf);
+    free_shared_buf(shared_buf, alloc, order);
     return -ENOMEM;
   }
   drv_data->ref_count = 0;
   drv_data->mmap_shared_buf = shared_buf;
+  drv_data->alloc = alloc;
+  drv_data->order = order;
   vma->vm_private_data = (void*) drv_data;
   vma->vm_ops = &rscfl_mmap_vm_ops;
   rscfl_vma_open(vma); // increment ref count
@@ -214,62 +366,507 @@ static int mmap_common(struct file *filp, struct vm_area_struct *vma,
 
 
 /*
- * Perform memory mapping for the data driver. That is to say the driver
- * that stores struct accountings and struct subsys_accountings.
+ * Initially, all struct accounting slots are free and nothing is indexed.
  */
-static int data_mmap(struct file *filp, struct vm_area_struct *vma)
+static void init_acct_ring(rscfl_acct_layout_t *layout,
+                           const rscfl_acct_geom_t *geom)
+{
+  int i;
+  volatile short *slot = RSCFL_RING_SLOTS(layout, geom);
+  volatile short *syscall_ix = RSCFL_SYSCALL_IX(layout, geom);
+  volatile short *token_ix = RSCFL_TOKEN_IX(layout, geom);
+
+  for (i = 0; i < geom->acct_num; i++) {
+    slot[i] = i;
+    syscall_ix[i] = -1;
+  }
+  for (i = 0; i < ACCT_TOKEN_IX_NUM(geom); i++) {
+    token_ix[i] = -1;
+  }
+  layout->acct_ring.head = 0;
+  layout->acct_ring.tail = geom->acct_num;
+}
+
+/*
+ * Create the pid_acct of a thread whose measurements go into shared_data_buf.
+ */
+static pid_acct *new_pid_acct(pid_t pid, char *shared_data_buf,
+                              const rscfl_acct_geom_t *geom)
 {
   pid_acct *pid_acct_node;
   probe_priv *probe_data;
-  char *shared_data_buf;
-  struct rscfl_vma_data *drv_data;
-  int rc;
 
-  // new pid wants resource accounting data, so add (pid, shared_data_buf) into
-  // per-cpu hash table.
-  //
-  // TODO(lc525, review discussion): decide on whether to add (pid, shared_buf)
-  // into the hash tables of every CPU or just in the hash table of the CPU
-  // currently running the app. If we get switched a lot between CPUs it might
-  // pay off to pre-add entries at the expense of some memory.
-  //
   pid_acct_node = (pid_acct *)kzalloc(sizeof(pid_acct), GFP_KERNEL);
   if (!pid_acct_node) {
-    return -ENOMEM;
+    return NULL;
   }
   probe_data = (probe_priv *)kzalloc(sizeof(probe_priv), GFP_KERNEL);
   if (!probe_data) {
     kfree(pid_acct_node);
-    return -ENOMEM;
+    return NULL;
   }
 
-  if ((rc = mmap_common(filp, vma, &shared_data_buf, MMAP_BUF_SIZE))) {
-    kfree(probe_data);
-    kfree(pid_acct_node);
-    return rc;
-  }
   pid_acct_node->subsys_ptr = pid_acct_node->subsys_stack;
   *(pid_acct_node->subsys_ptr) = USERSPACE_LOCAL;
   pid_acct_node->subsys_ptr++;
 
-  if(rscfl_user_config.monitored_pid == RSCFL_PID_SELF) {
-    pid_acct_node->pid = current->pid;
-  }
-  else {
-    pid_acct_node->pid = rscfl_user_config.monitored_pid;
-  }
+  pid_acct_node->pid = pid;
   pid_acct_node->shared_buf = (rscfl_acct_layout_t *)shared_data_buf;
+  pid_acct_node->geom = *geom;
   pid_acct_node->shared_buf->subsys_exits = 0;
+  init_acct_ring(pid_acct_node->shared_buf, &pid_acct_node->geom);
   pid_acct_node->probe_data = probe_data;
+  // tokens are created on demand, by RSCFL_NEW_TOKENS_CMD
+  pid_acct_node->token_ix = NULL;
+  pid_acct_node->token_ix_size = 0;
   pid_acct_node->next_ctrl_token = 0;
   pid_acct_node->num_tokens = 0;
+  pid_acct_node->region = NULL;
+  return pid_acct_node;
+}
 
-  drv_data = (rscfl_vma_data*) vma->vm_private_data;
-  drv_data->pid_acct_node = pid_acct_node;
+/*
+ * New pid wants resource accounting data, so add (pid, pid_acct) into the
+ * per-cpu hash table.
+ *
+ * TODO(lc525, review discussion): decide on whether to add (pid, shared_buf)
+ * into the hash tables of every CPU or just in the hash table of the CPU
+ * currently running the app. If we get switched a lot between CPUs it might
+ * pay off to pre-add entries at the expense of some memory.
+ */
+static void add_pid_acct(pid_acct *pid_acct_node)
+{
+  // this can run under mmap_lock; the open data device already armed the
+  // probes (see data_open)
+  probes_hold();
   preempt_disable();
   hash_add(CPU_TBL(pid_acct_tbl), &pid_acct_node->link, pid_acct_node->pid);
-  CPU_VAR(current_acct) = pid_acct_node;
+  set_current_acct(pid_acct_node);
   preempt_enable();
+}
+
+/*
+ * Fill in the ctrl page of a thread, and make pid_acct_node use it.
+ */
+static void init_ctrl(pid_acct *pid_acct_node, rscfl_ctrl_layout_t *ctrl_layout,
+                      const rscfl_config *config,
+                      rscfl_kernel_token *default_token)
+{
+  ctrl_layout->version = RSCFL_VERSION.data_layout;
+  rscfl_layout_check_init(&ctrl_layout->layout);
+  ctrl_layout->config = *config;
+  ctrl_layout->interest.token_id = DEFAULT_TOKEN;
+  ctrl_layout->interest.first_measurement = 1;
+
+  // We need to store the address of the control page for the pid, so we
+  // can see when an interest is raised.
+  pid_acct_node->ctrl = ctrl_layout;
+  ctrl_layout->geom = pid_acct_node->geom;
+
+  // User tokens are created on demand (RSCFL_NEW_TOKENS_CMD)
+  pid_acct_node->default_token = default_token;
+  pid_acct_node->active_token = pid_acct_node->default_token;
+  /*
+   *pid_acct_node->null_token = kzalloc(GFP_KERNEL,
+   *                                    sizeof(struct rscfl_kernel_token));
+   *pid_acct_node->null_token->id = NULL_TOKEN;
+   */
+}
+
+static rscfl_kernel_token *new_default_token(void)
+{
+  rscfl_kernel_token *default_token;
+  default_token = kzalloc(sizeof(struct rscfl_kernel_token), GFP_KERNEL);
+  if (default_token) {
+    default_token->id = DEFAULT_TOKEN;
+  }
+  return default_token;
+}
+
+static void region_get(struct rscfl_region *region)
+{
+  spin_lock(&region_lock);
+  region->ref_count++;
+  spin_unlock(&region_lock);
+}
+
+static void region_put(struct rscfl_region *region)
+{
+  unsigned int i;
+  pid_acct *owner;
+
+  spin_lock(&region_lock);
+  if (--region->ref_count > 0) {
+    spin_unlock(&region_lock);
+    return;
+  }
+  for (i = 0; i < region->nr_slices; i++) {
+    owner = region->slices[i].owner;
+    if (owner != NULL) {
+      // stop any other probes from firing
+      owner->ctrl = NULL;
+      owner->shared_buf = NULL;
+      owner->region = NULL;
+      owner->active_token = owner->default_token;
+    }
+  }
+  spin_unlock(&region_lock);
+
+  for (i = 0; i <= region->nr_slices; i++) {
+    vfree(region->slices[i].data);
+    free_page((unsigned long)region->slices[i].ctrl);
+  }
+  vfree(region->slices);
+  kfree(region->shared_tokens);
+  kfree(region);
+}
+
+void rscfl_region_release_slice(pid_acct *pa)
+{
+  struct rscfl_region *region;
+
+  spin_lock(&region_lock);
+  region = pa->region;
+  if (region != NULL) {
+    region->slices[pa->slice].owner = NULL;
+    region->slices[pa->slice].busy = 0;
+    pa->region = NULL;
+  }
+  spin_unlock(&region_lock);
+}
+
+rscfl_kernel_token *rscfl_region_shared_token(pid_acct *pa, short token_id)
+{
+  struct rscfl_region *region = pa->region;
+  unsigned int ix = SHARED_TOKEN_IX(token_id);
+
+  if (region == NULL || !IS_SHARED_TOKEN(token_id) ||
+      ix >= region->geom.acct_num) {
+    return NULL;
+  }
+  return &region->shared_tokens[ix];
+}
+
+/*
+ * Allocate the process-wide slice and its tokens. Process-wide token i
+ * aggregates into struct accounting i of the slice, for as long as the region
+ * exists.
+ */
+static int region_shared_init(struct rscfl_region *region)
+{
+  struct rscfl_region_slice *slice = &region->slices[region->nr_slices];
+  struct accounting *acct;
+  unsigned int i, j;
+
+  slice->data = vmalloc_user(region->slice_size);
+  region->shared_tokens = kcalloc(region->geom.acct_num,
+                                  sizeof(rscfl_kernel_token), GFP_KERNEL);
+  if (!slice->data || !region->shared_tokens) {
+    return -ENOMEM;
+  }
+  for (i = 0; i < region->geom.acct_num; i++) {
+    acct = &RSCFL_ACCT(slice->data, &region->geom)[i];
+    region->shared_tokens[i].id = RSCFL_SHARED_TOKEN_BIT | i;
+    region->shared_tokens[i].account = acct;
+    region->shared_tokens[i].shared = 1;
+    region->shared_tokens[i].buf = (rscfl_acct_layout_t *)slice->data;
+    acct->token_id = RSCFL_SHARED_TOKEN_BIT | i;
+    for (j = 0; j < NUM_SUBSYSTEMS; j++) {
+      acct->acct_subsys[j].id = RSCFL_SUBSYS_ENTRY_EMPTY;
+      acct->acct_subsys[j].slot = RSCFL_SUBSYS_ENTRY_EMPTY;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Allocate the memory of a slice when it is used for the first time, or clear
+ * what its previous owner left in it.
+ */
+static int region_slice_init(struct rscfl_region *region,
+                             struct rscfl_region_slice *slice)
+{
+  if (slice->data == NULL) {
+    slice->data = vmalloc_user(region->slice_size);
+    if (!slice->data) return -ENOMEM;
+  } else {
+    memset(slice->data, 0, region->slice_size);
+  }
+  if (slice->ctrl == NULL) {
+    slice->ctrl = (rscfl_ctrl_layout_t *)get_zeroed_page(GFP_KERNEL);
+    if (!slice->ctrl) return -ENOMEM;
+  } else {
+    memset(slice->ctrl, 0, MMAP_CTL_SIZE);
+  }
+  return 0;
+}
+
+/*
+ * Give a free slice of region to the calling thread. Returns the index of the
+ * slice, or a negative error.
+ */
+static int region_register_thread(struct rscfl_region *region)
+{
+  struct rscfl_region_slice *slice;
+  rscfl_kernel_token *default_token;
+  pid_acct *pid_acct_node;
+  unsigned int ix;
+  int rc;
+
+  spin_lock(&region_lock);
+  for (ix = 0; ix < region->nr_slices; ix++) {
+    if (!region->slices[ix].busy) {
+      region->slices[ix].busy = 1;
+      break;
+    }
+  }
+  spin_unlock(&region_lock);
+  if (ix == region->nr_slices) {
+    printk(KERN_ERR "rscfl: all %u thread slices are in use\n",
+           region->nr_slices);
+    return -ENOSPC;
+  }
+  slice = &region->slices[ix];
+
+  if ((rc = region_slice_init(region, slice))) {
+    goto error;
+  }
+  rc = -ENOMEM;
+  default_token = new_default_token();
+  if (!default_token) {
+    goto error;
+  }
+  pid_acct_node = new_pid_acct(current->pid, slice->data, &region->geom);
+  if (!pid_acct_node) {
+    kfree(default_token);
+    goto error;
+  }
+  init_ctrl(pid_acct_node, slice->ctrl, &region->config, default_token);
+
+  spin_lock(&region_lock);
+  slice->owner = pid_acct_node;
+  pid_acct_node->region = region;
+  pid_acct_node->slice = ix;
+  spin_unlock(&region_lock);
+
+  add_pid_acct(pid_acct_node);
+  return ix;
+
+error:
+  spin_lock(&region_lock);
+  slice->busy = 0;
+  spin_unlock(&region_lock);
+  return rc;
+}
+
+static void rscfl_region_vma_open(struct vm_area_struct *vma)
+{
+  region_get((struct rscfl_region *)vma->vm_private_data);
+}
+
+static void rscfl_region_vma_close(struct vm_area_struct *vma)
+{
+  region_put((struct rscfl_region *)vma->vm_private_data);
+}
+
+/*
+ * Map a page of a slice into user space. Slice memory is never freed or
+ * replaced while the region is mapped, so the pointers can be read without
+ * taking region_lock: a thread only touches its slice once registered.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+static vm_fault_t rscfl_region_fault(struct vm_area_struct *vma,
+                                     struct vm_fault *vmf)
+{
+#else
+static vm_fault_t rscfl_region_fault(struct vm_fault *vmf)
+{
+  struct vm_area_struct *vma = vmf->vma;
+#endif
+  struct rscfl_region *region = (struct rscfl_region *)vma->vm_private_data;
+  unsigned long slice_pages = region->slice_size >> PAGE_SHIFT;
+  unsigned long ix;
+  struct page *page = NULL;
+  char *mem;
+
+  if (vma->vm_file->f_op == &ctrl_fops) {
+    ix = vmf->pgoff;
+    if (ix < region->nr_slices) {
+      mem = (char *)READ_ONCE(region->slices[ix].ctrl);
+      if (mem != NULL) page = virt_to_page(mem);
+    }
+  } else {
+    ix = vmf->pgoff / slice_pages;
+    if (ix <= region->nr_slices) {
+      mem = READ_ONCE(region->slices[ix].data);
+      if (mem != NULL) {
+        page = vmalloc_to_page(mem +
+                               ((vmf->pgoff % slice_pages) << PAGE_SHIFT));
+      }
+    }
+  }
+  if (page == NULL) {
+    return VM_FAULT_SIGBUS;
+  }
+  get_page(page);
+  vmf->page = page;
+  return 0;
+}
+
+/*
+ * Data mmap in per-process mode: create the region and give its first slice
+ * to the calling thread. Nothing is mapped yet, see rscfl_region_fault.
+ */
+static int region_data_mmap(struct vm_area_struct *vma,
+                            const rscfl_acct_geom_t *geom)
+{
+  struct rscfl_region *region;
+  int rc;
+
+  if (rscfl_user_config.max_threads > RSCFL_MAX_THREADS ||
+      rscfl_user_config.monitored_pid != RSCFL_PID_SELF) {
+    return -EINVAL;
+  }
+  if (vma->vm_end - vma->vm_start != RSCFL_SLICE_SIZE(geom) *
+        ((unsigned long)rscfl_user_config.max_threads + 1)) {
+    printk(KERN_ERR "rscfl: data mmap of %lu bytes, expected %u slices of "
+                    "%lu\n", vma->vm_end - vma->vm_start,
+           rscfl_user_config.max_threads + 1,
+           (unsigned long)RSCFL_SLICE_SIZE(geom));
+    return -EINVAL;
+  }
+
+  region = kzalloc(sizeof(struct rscfl_region), GFP_KERNEL);
+  if (!region) {
+    return -ENOMEM;
+  }
+  region->config = rscfl_user_config;
+  region->geom = *geom;
+  region->slice_size = RSCFL_SLICE_SIZE(geom);
+  region->nr_slices = rscfl_user_config.max_threads;
+  region->slices = vzalloc((region->nr_slices + 1) *
+                           sizeof(struct rscfl_region_slice));
+  if (!region->slices) {
+    kfree(region);
+    return -ENOMEM;
+  }
+  region->ref_count = 1; // held by vma, from here on
+
+  if ((rc = region_shared_init(region)) ||
+      (rc = region_register_thread(region)) < 0) {
+    region_put(region);
+    return rc;
+  }
+
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+  vma->vm_private_data = (void*) region;
+  vma->vm_ops = &rscfl_region_vm_ops;
+  return 0;
+}
+
+/*
+ * Ctrl mmap in per-process mode. The ctrl fd keeps a reference to the region,
+ * for registering the other threads of the process.
+ */
+static int region_ctrl_mmap(struct file *filp, struct vm_area_struct *vma,
+                            struct rscfl_region *region)
+{
+  if (filp->private_data != NULL) {
+    return -EBUSY;
+  }
+  if (vma->vm_end - vma->vm_start !=
+      (unsigned long)region->nr_slices * MMAP_CTL_SIZE) {
+    printk(KERN_ERR "rscfl: ctrl mmap of %lu bytes, expected %u pages\n",
+           vma->vm_end - vma->vm_start, region->nr_slices);
+    return -EINVAL;
+  }
+
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+  vma->vm_private_data = (void*) region;
+  vma->vm_ops = &rscfl_region_vm_ops;
+  rscfl_region_vma_open(vma);
+
+  region_get(region);
+  filp->private_data = region;
+  return 0;
+}
+
+static int ctrl_release(struct inode *inode, struct file *filp)
+{
+  if (filp->private_data != NULL) {
+    region_put((struct rscfl_region *)filp->private_data);
+  }
+  return 0;
+}
+
+/*
+ * Arm the probes when the data device is opened, ahead of the mmap that
+ * registers the thread: arming pokes every probed call site, which is too
+ * long to do while holding the mmap_lock of the process.
+ */
+static int data_open(struct inode *inode, struct file *filp)
+{
+  probes_get();
+  return 0;
+}
+
+static int data_release(struct inode *inode, struct file *filp)
+{
+  probes_put();
+  return 0;
+}
+
+/*
+ * Perform memory mapping for the data driver. That is to say the driver
+ * that stores struct accountings and struct subsys_accountings.
+ */
+static int data_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  pid_acct *pid_acct_node;
+  char *shared_data_buf;
+  struct rscfl_vma_data *drv_data;
+  rscfl_acct_geom_t geom;
+  pid_t pid;
+  int rc;
+
+  // The buffer size is decided by user space (rscfl_config, sent through
+  // the RSCFL_CONFIG_CMD ioctl before mmap-ing); the geometry is recomputed
+  // here rather than trusted.
+  if ((rc = rscfl_acct_geom_init(&geom, rscfl_user_config.acct_num,
+                                 rscfl_user_config.subsys_num,
+                                 rscfl_user_config.max_tokens))) {
+    return rc;
+  }
+  if (rscfl_user_config.max_threads != 0) {
+    return region_data_mmap(vma, &geom);
+  }
+  if (vma->vm_end - vma->vm_start != geom.size) {
+    printk(KERN_ERR "rscfl: data mmap of %lu bytes, expected %u\n",
+           vma->vm_end - vma->vm_start, geom.size);
+    return -EINVAL;
+  }
+
+  if ((rc = mmap_common(filp, vma, &shared_data_buf, geom.size,
+                        rscfl_user_config.huge_pages))) {
+    return rc;
+  }
+
+  if(rscfl_user_config.monitored_pid == RSCFL_PID_SELF) {
+    pid = current->pid;
+  }
+  else {
+    pid = rscfl_user_config.monitored_pid;
+  }
+  drv_data = (rscfl_vma_data*) vma->vm_private_data;
+  pid_acct_node = new_pid_acct(pid, shared_data_buf, &geom);
+  if (!pid_acct_node) {
+    // mmap_common took the vma's reference; drop it and free the buffer
+    rscfl_vma_close(vma);
+    return -ENOMEM;
+  }
+
+  drv_data->pid_acct_node = pid_acct_node;
+  add_pid_acct(pid_acct_node);
   return 0;
 }
 
@@ -280,50 +877,35 @@ static int data_mmap(struct file *filp, struct vm_area_struct *vma)
  */
 static int ctrl_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-  int rc, i;
+  int rc;
   char *shared_ctrl_buf;
   struct rscfl_vma_data *drv_data;
-  rscfl_ctrl_layout_t *ctrl_layout;
   pid_acct *current_pid_acct;
+  rscfl_kernel_token *default_token;
 
-  if ((rc = mmap_common(filp, vma, &shared_ctrl_buf, MMAP_CTL_SIZE))) {
-    return rc;
-  }
+  BUILD_BUG_ON(sizeof(rscfl_ctrl_layout_t) > MMAP_CTL_SIZE);
 
   preempt_disable();
+  current_pid_acct = CPU_VAR(current_acct);
+  preempt_enable();
+  if (current_pid_acct != NULL && current_pid_acct->region != NULL) {
+    return region_ctrl_mmap(filp, vma, current_pid_acct->region);
+  }
 
-  ctrl_layout = (rscfl_ctrl_layout_t *)shared_ctrl_buf;
-  ctrl_layout->version = RSCFL_VERSION.data_layout;
-  ctrl_layout->config = rscfl_user_config;
-  ctrl_layout->interest.token_id = DEFAULT_TOKEN;
-  ctrl_layout->interest.first_measurement = 1;
+  default_token = new_default_token();
+  if (!default_token) {
+    return -ENOMEM;
+  }
 
-  // We need to store the address of the control page for the pid, so we
-  // can see when an interest is raised.
-  current_pid_acct = CPU_VAR(current_acct);
-  current_pid_acct->ctrl = ctrl_layout;
+  if ((rc = mmap_common(filp, vma, &shared_ctrl_buf, MMAP_CTL_SIZE, 0))) {
+    kfree(default_token);
+    return rc;
+  }
 
-  // Initialise kernel-side tokens
-  for(i=0; i<NUM_READY_TOKENS; i++) {
-    rscfl_kernel_token *token =
-            kzalloc(GFP_KERNEL, sizeof(struct rscfl_kernel_token));
-    if (token == NULL) {
-      break;
-    }
-    token->id = current_pid_acct->num_tokens++;
-    token->val = 0;
-    token->val2 = 0;
-    current_pid_acct->token_ix[i] = token;
-  }
-  current_pid_acct->default_token = kzalloc(GFP_KERNEL,
-                                            sizeof(struct rscfl_kernel_token));
-  current_pid_acct->default_token->id = DEFAULT_TOKEN;
-  current_pid_acct->active_token = current_pid_acct->default_token;
-  /*
-   *current_pid_acct->null_token = kzalloc(GFP_KERNEL,
-   *                                       sizeof(struct rscfl_kernel_token));
-   *current_pid_acct->null_token->id = NULL_TOKEN;
-   */
+  preempt_disable();
+  current_pid_acct = CPU_VAR(current_acct);
+  init_ctrl(current_pid_acct, (rscfl_ctrl_layout_t *)shared_ctrl_buf,
+            &rscfl_user_config, default_token);
 
   drv_data = (rscfl_vma_data*) vma->vm_private_data;
   drv_data->pid_acct_node = current_pid_acct;
@@ -377,7 +959,7 @@ static long rscfl_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
       break;
     }
     case RSCFL_NEW_TOKENS_CMD : {
-      int i, j, next, n, ngen;
+      unsigned int i, j, next, n, ngen;
       pid_acct *current_pid_acct;
       current_pid_acct = CPU_VAR(current_acct);
       if(current_pid_acct != NULL) {
@@ -385,27 +967,23 @@ static long rscfl_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 
         next = current_pid_acct->next_ctrl_token;
         n = current_pid_acct->num_tokens;
-        if(n >= MAX_TOKENS) {
-          printk("rscfl: max number of tokens exceeded\n");
-          return -EINVAL;
-        }
-
-        current_pid_acct->ctrl->num_avail_token_ids = n - next;
         if(n - next == 0) {
-          // we'll need to generate some new tokens, up to MAX_TOKENS in total
-          if(n + NUM_READY_TOKENS < MAX_TOKENS) ngen = NUM_READY_TOKENS;
-          else ngen = MAX_TOKENS - n;
-          for(i = n; i < n + ngen ; i++) {
-            rscfl_kernel_token *token =
-              kzalloc(GFP_KERNEL, sizeof(struct rscfl_kernel_token));
-            if (token == NULL) {
-              break;
-            }
-            token->id = current_pid_acct->num_tokens++;
-            current_pid_acct->token_ix[i] = token;
+          // we'll need to generate some new tokens, up to geom.token_num in
+          // total. Threads that use many tokens get bigger batches, so that
+          // they need fewer ioctls.
+          if(n >= current_pid_acct->geom.token_num) {
+            printk(KERN_ERR "rscfl: max number of tokens (%u) exceeded\n",
+                   current_pid_acct->geom.token_num);
+            return -EINVAL;
+          }
+          ngen = clamp(n, (unsigned int)MIN_READY_TOKENS,
+                       (unsigned int)NUM_READY_TOKENS);
+          if(new_kernel_tokens(current_pid_acct, ngen) <= 0) {
+            return -ENOMEM;
           }
-          n += ngen;
+          n = current_pid_acct->num_tokens;
         }
+        n = min(n, next + NUM_READY_TOKENS);
 
         // move existing kernel tokens into user-space
         for(i = next, j = 0; i < n; i++) {
@@ -424,6 +1002,60 @@ static long rscfl_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
       break;
     }
 
+    case RSCFL_NOTIFY_CMD: {
+      rscfl_notify notify;
+      pid_acct *current_pid_acct;
+      if(copy_from_user(&notify, (rscfl_notify *)arg, sizeof(rscfl_notify))) {
+        return -EFAULT;
+      }
+      preempt_disable();
+      current_pid_acct = CPU_VAR(current_acct);
+      preempt_enable();
+      if(current_pid_acct == NULL || current_pid_acct->pid != current->pid) {
+        printk(KERN_ERR "rscfl: pid not registered for notifications\n");
+        return -EINVAL;
+      }
+      return set_acct_notify(current_pid_acct, notify.efd, notify.watermark);
+      break;
+    }
+
+    case RSCFL_REGISTER_THREAD_CMD: {
+      struct rscfl_region *region = (struct rscfl_region *)f->private_data;
+      pid_acct *current_pid_acct;
+      if(region == NULL) {
+        printk(KERN_ERR "rscfl: registering a thread needs a per-process "
+                        "region (rscfl_config.max_threads)\n");
+        return -EINVAL;
+      }
+      preempt_disable();
+      current_pid_acct = CPU_VAR(current_acct);
+      preempt_enable();
+      if(current_pid_acct != NULL && current_pid_acct->pid == current->pid) {
+        return -EEXIST;
+      }
+      return region_register_thread(region);
+      break;
+    }
+
+    case RSCFL_SUBSYS_MASK_CMD: {
+      rscfl_subsys_mask mask;
+      // re-pokes kernel text and changes what every process measures
+      if(!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+      }
+      if(copy_from_user(&mask, (rscfl_subsys_mask *)arg,
+                        sizeof(rscfl_subsys_mask))) {
+        return -EFAULT;
+      }
+      probes_set_subsys(&mask);
+      if(copy_to_user((rscfl_subsys_mask *)arg, &mask,
+                      sizeof(rscfl_subsys_mask))) {
+        return -EFAULT;
+      }
+      return 0;
+      break;
+    }
+
     case RSCFL_SHUTDOWN_CMD: {
       do_module_shutdown();
       return 0;
@@ -16,6 +16,7 @@
 #include "rscfl/res_common.h"
 
 DEFINE_PER_CPU(pid_acct*, current_acct);
+DEFINE_PER_CPU(u8, rscfl_acct_active);
 DEFINE_PER_CPU_HASHTABLE(pid_acct_tbl, CPU_PIDACCT_HTBL_LOGSIZE);
 
 int _rscfl_cpus_init(void)
@@ -33,8 +34,9 @@ int _rscfl_cpus_cleanup(void)
   int bkt;
   pid_acct *it;
 
-  CPU_VAR(current_acct) = NULL;
+  set_current_acct(NULL);
   for_each_present_cpu(cpu_id) {
+    per_cpu(rscfl_acct_active, cpu_id) = 0;
     hash_for_each(per_cpu(pid_acct_tbl, cpu_id), bkt, it, link) {
       hash_del(&it->link);
     }
@@ -9,25 +9,41 @@
 
 #include "rscfl/kernel/kamprobes.h"
 
+#include <asm/nops.h>
 #include <linux/cpu.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+#include <linux/stop_machine.h>
+#include <linux/version.h>
 #include <linux/vmalloc.h>
 
+#include "rscfl/kernel/cpu.h"
 #include "rscfl/kernel/priv_kallsyms.h"
 #include "rscfl/res_common.h"
 #include "rscfl/subsys_list.h"
 
-#define WRAPPER_SIZE 76
+// Largest per-site wrapper (SyS_ functions): 8 bytes for the return address,
+// 15 for the activity check and 35 for the rest (see kamprobes_register)
+#define WRAPPER_SIZE 58
+// Trampolines are shared by all the probes with the same pre-handler (one per
+// subsystem), and live at the start of the wrapper area, one cache line each
+// (49 bytes are used, see emit_trampoline)
+#define TRAMPOLINE_SIZE 64
+#define MAX_TRAMPOLINES 32
 
 #define WORD_SIZE_IN_BYTES 8
 
 #define CALL_WIDTH 5
 #define JMP_WIDTH 5
-#define MOV_WIDTH 9
 
 struct orig_insn
 {
   u8 *loc;
   unsigned char vals[CALL_WIDTH];
+  // the call/jmp into the wrapper, poked over vals while armed
+  unsigned char probe[CALL_WIDTH];
+  unsigned char group;
+  _Bool armed;
 };
 
 static struct orig_insn *probe_list;
@@ -36,6 +52,15 @@ static unsigned int no_probes = 0;
 static char *wrapper_start = NULL;
 static char *wrapper_end;
 
+struct trampoline
+{
+  int (*pre_handler)(void);
+  char *code;
+};
+
+static struct trampoline trampolines[MAX_TRAMPOLINES];
+static unsigned int no_trampolines = 0;
+
 static const char ins_save_reg[] = {
   0x50,  // rax
 
@@ -82,29 +107,132 @@ static const char ins_restore_reg[] = {
   0x58,  // rax
 };
 
-static void add_to_probe_list(u8 *loc)
+static void add_to_probe_list(u8 *loc, const unsigned char *probe,
+                              unsigned int group)
 {
   int i;
   probe_list[no_probes].loc = loc;
+  probe_list[no_probes].group = group;
+  probe_list[no_probes].armed = 0;
   for (i = 0; i < CALL_WIDTH; i++) {
     probe_list[no_probes].vals[i] = loc[i];
+    probe_list[no_probes].probe[i] = probe[i];
   }
   no_probes++;
 }
 
-void kamprobes_unregister_all(void)
+/*
+ * The probed call sites are live kernel text: other CPUs may be executing
+ * one while it is rewritten, so a plain text_poke could let them fetch a
+ * torn instruction. The int3-based patching puts an int3 over the site
+ * first and emulates the new call for CPUs that hit it meanwhile; kernels
+ * without call emulation patch with all the other CPUs parked in
+ * stop_machine.
+ *
+ * Each int3 round costs three IPIs to every CPU, so sites are queued with
+ * text_poke_queue and patched together by text_poke_finish (poke_flush), once
+ * per batch. The queue is flushed early if the addresses stop ascending,
+ * hence probe_list gets sorted by address before it is first poked.
+ */
+static inline void poke_site(u8 *loc, const unsigned char *insn)
 {
-  int i;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+  KPRIV(text_poke_queue)(loc, insn, CALL_WIDTH, NULL);
+#else
+  KPRIV(text_poke)(loc, insn, CALL_WIDTH);
+#endif
+}
+
+static inline void poke_flush(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+  KPRIV(text_poke_finish)();
+#endif
+}
+
+static _Bool probe_list_sorted = 0;
+
+static int orig_insn_cmp(const void *a, const void *b)
+{
+  const u8 *la = ((const struct orig_insn *)a)->loc;
+  const u8 *lb = ((const struct orig_insn *)b)->loc;
+  return la < lb ? -1 : la > lb;
+}
+
+#define POKE_BATCH 512
+struct poke_batch
+{
+  int next;  // first probe_list entry not looked at yet
+  unsigned long groups;
+  int poked;
+};
+
+// call with text_mutex and the CPU hotplug lock held
+static int poke_next_batch(void *data)
+{
+  struct poke_batch *pb = data;
+
+  for (pb->poked = 0; pb->next < no_probes && pb->poked < POKE_BATCH;
+       pb->next++) {
+    struct orig_insn *p = &probe_list[pb->next];
+    _Bool arm = (pb->groups >> p->group) & 1;
+    if (p->armed != arm) {
+      poke_site(p->loc, arm ? p->probe : p->vals);
+      p->armed = arm;
+      pb->poked++;
+    }
+  }
+  poke_flush();
+  return 0;
+}
 
-  get_online_cpus();
-  mutex_lock(KPRIV(text_mutex));
-  for (i = 0; i < no_probes; i++) {
-    KPRIV(text_poke)(probe_list[i].loc, &probe_list[i].vals, CALL_WIDTH);
+/*
+ * Rewrites the probed call sites whose state changes, in batches of
+ * POKE_BATCH sites per text mutex hold (with a reschedule point in between,
+ * as there can be ~100k of them): sites of the groups set in groups call into
+ * their wrappers, all others run their original instructions.
+ *
+ * Might sleep.
+ */
+void kamprobes_arm(unsigned long groups)
+{
+  struct poke_batch pb = { .next = 0, .groups = groups };
+  int poked = 0;
+
+  // all the probes are registered before the first arm
+  if (!probe_list_sorted) {
+    sort(probe_list, no_probes, sizeof(struct orig_insn), orig_insn_cmp, NULL);
+    probe_list_sorted = 1;
+  }
+  while (pb.next < no_probes) {
+    get_online_cpus();
+    mutex_lock(KPRIV(text_mutex));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    poke_next_batch(&pb);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+    stop_machine_cpuslocked(poke_next_batch, &pb, NULL);
+#else
+    // get_online_cpus nests before 4.13
+    stop_machine(poke_next_batch, &pb, NULL);
+#endif
+    mutex_unlock(KPRIV(text_mutex));
+    put_online_cpus();
+    poked += pb.poked;
+    cond_resched();
   }
+  debugk(KERN_NOTICE "Poked %d probes (groups %#lx)\n", poked, groups);
+}
+
+void kamprobes_disarm_all(void)
+{
+  kamprobes_arm(0);
+}
+
+void kamprobes_unregister_all(void)
+{
+  kamprobes_arm(0);
   debugk(KERN_NOTICE "Unregistered %d probes\n", no_probes);
   no_probes = 0;
-  mutex_unlock(KPRIV(text_mutex));
-  put_online_cpus();
 }
 
 static inline void emit_rel_address(char **wrapper_end, char *addr)
@@ -173,16 +301,6 @@ static inline void emit_mov_r11_addr(char **wrapper_end, char *addr)
   emit_rel_address(wrapper_end, addr);
 }
 
-static inline void emit_mov_addr_rsp(char **wrapper_end, char *addr,
-                                     const char disp)
-{
-  // mov $addr disp(%rsp)
-  char machine_code[] = {0x48, 0xc7, 0x44, 0x24, 0x00};
-  machine_code[4] = disp;
-  emit_multiple_ins(wrapper_end, machine_code, sizeof(machine_code));
-  emit_abs_address(wrapper_end, addr);
-}
-
 static inline void emit_push_addr(char **wrapper_end, char *addr)
 {
   // push ($addr)
@@ -218,14 +336,138 @@ static inline void emit_short_cond_jmp(char **wrapper_end, const char *cond,
   emit_ins(wrapper_end, jmp_size);
 }
 
+/*
+ * cmpb $0, %gs:rscfl_acct_active
+ * je inactive_target
+ *
+ * Emitted at the very start of a wrapper, so that when current_acct is NULL on
+ * this CPU control goes to the probed code without saving registers or calling
+ * the pre-handler. Flags need not be preserved across the call or function
+ * entry being probed.
+ */
+static inline void emit_active_check(char **wrapper_end, char *inactive_target)
+{
+  const char cmpb_gs[] = {0x65, 0x80, 0x3c, 0x25};
+  const char je_rel32[] = {0x0f, 0x84};
+  int32_t *disp;
+
+  emit_multiple_ins(wrapper_end, cmpb_gs, sizeof(cmpb_gs));
+  // the per-cpu offset of rscfl_acct_active, as an absolute disp32
+  disp = (int32_t *)*wrapper_end;
+  *disp = (int32_t)(long)&rscfl_acct_active;
+  (*wrapper_end) += 4;
+  emit_ins(wrapper_end, 0x00);
+
+  emit_multiple_ins(wrapper_end, je_rel32, sizeof(je_rel32));
+  emit_rel_address(wrapper_end, inactive_target);
+}
+
+static inline _Bool can_emit_active_check(void)
+{
+  long off = (long)&rscfl_acct_active;
+  return off == (long)(int32_t)off;
+}
+
+/*
+ * The code shared by all the probes of a subsystem. Wrappers call it, so on
+ * entry the stack holds:
+ *
+ *   0(%rsp)  resume: the jmp to the original code that follows the call, in
+ *            the wrapper
+ *   8(%rsp)  the return address of the probed function
+ *
+ * The trampoline calls the pre-handler and, if it returned 0, replaces the
+ * return address with that of the rtn-handling code of the wrapper, which
+ * follows resume. It then returns to resume: the call/ret pair keeps the
+ * return stack buffer in sync, where an indirect jmp back would not.
+ *
+ * 49 bytes: 12 to save registers, 5 for the call, 5 + 5 + 9 to set the
+ * return address, 12 to restore registers and 1 for the ret.
+ */
+static char *emit_trampoline(char **tramp_end, int (*pre_handler)(void))
+{
+  char *tramp = *tramp_end;
+  // test rax, rax
+  const char jmpnz_cond[3] = {0x48, 0x85, 0xC0};
+  // mov 0x48(%rsp), %r11: resume, under the 9 saved registers
+  const char load_resume[] = {0x4c, 0x8b, 0x5c, 0x24, 0x48};
+  // lea JMP_WIDTH(%r11), %rax; mov %rax, 0x50(%rsp)
+  const char set_rtn[] = {0x49, 0x8d, 0x43, JMP_WIDTH,
+                          0x48, 0x89, 0x44, 0x24, 0x50};
+
+  // Preserve arguments passed through registers before calling into the
+  // pre-handler. This is to obey the system v abi, whereby the caller has to
+  // maintain registers.
+  emit_save_registers(tramp_end);
+
+  // Call into the pre-handler.
+  emit_callq(tramp_end, (char *)pre_handler);
+  emit_multiple_ins(tramp_end, load_resume, sizeof(load_resume));
+
+  // optimisation: if the pre_handler returned -1, leave the return address
+  // alone, so the rtn-handler is skipped
+  // test rax, rax
+  // jnz sizeof(set_rtn)
+  emit_short_cond_jmp(tramp_end, jmpnz_cond, sizeof(jmpnz_cond),
+                      sizeof(set_rtn));
+  emit_multiple_ins(tramp_end, set_rtn, sizeof(set_rtn));
+
+  // Restore the register file from what we just pushed onto the stack, and
+  // return to resume, which jumps into the original code.
+  emit_restore_registers(tramp_end);
+  // retq
+  emit_ins(tramp_end, 0xc3);
+
+  BUG_ON(*tramp_end - tramp > TRAMPOLINE_SIZE);
+  return tramp;
+}
+
+// the trampoline of pre_handler, emitted on first use
+static char *get_trampoline(int (*pre_handler)(void))
+{
+  char *tramp_end;
+  int i;
+
+  for (i = 0; i < no_trampolines; i++) {
+    if (trampolines[i].pre_handler == pre_handler) {
+      return trampolines[i].code;
+    }
+  }
+  if (no_trampolines == MAX_TRAMPOLINES) {
+    return NULL;
+  }
+  tramp_end = wrapper_start + no_trampolines * TRAMPOLINE_SIZE;
+  trampolines[no_trampolines].pre_handler = pre_handler;
+  trampolines[no_trampolines].code = emit_trampoline(&tramp_end, pre_handler);
+  return trampolines[no_trampolines++].code;
+}
+
 static inline int is_call_ins(u8 **addr)
 {
   return **addr == 0xe8;
 }
 
+/*
+ * text_poke_queue decodes what it writes, and BUG()s on anything but a call,
+ * a jmp or the kernel's own 5-byte nop; disarming writes the original bytes
+ * of a site back through it, so only sites holding that nop are probed.
+ */
+static inline _Bool is_pokable_noop(u8 *addr)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+  return memcmp(addr, KPRIV(x86_nops)[CALL_WIDTH], CALL_WIDTH) == 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+  return memcmp(addr, (*KPRIV(ideal_nops))[NOP_ATOMIC5], CALL_WIDTH) == 0;
+#else
+  // patched under stop_machine, whatever the bytes
+  return 1;
+#endif
+}
+
 static inline int is_noop(u8 **addr)
 {
-  return (**addr == 0x90 || **addr == 0x0f || **addr == 0x1f || **addr == 0x66);
+  return (**addr == 0x90 || **addr == 0x0f || **addr == 0x1f ||
+          **addr == 0x66) && is_pokable_noop(*addr);
 }
 
 int kamprobes_init(int max_probes)
@@ -237,11 +479,12 @@ int kamprobes_init(int max_probes)
 
   if (wrapper_start == NULL) {
     wrapper_start = KPRIV(__vmalloc_node_range)(
-        WRAPPER_SIZE * max_probes, 1, MODULES_VADDR, MODULES_END,
-        GFP_KERNEL | __GFP_HIGHMEM, PAGE_KERNEL_EXEC, NUMA_NO_NODE,
-        __builtin_return_address(0));
+        TRAMPOLINE_SIZE * MAX_TRAMPOLINES + WRAPPER_SIZE * max_probes, 1,
+        MODULES_VADDR, MODULES_END, GFP_KERNEL | __GFP_HIGHMEM,
+        PAGE_KERNEL_EXEC, NUMA_NO_NODE, __builtin_return_address(0));
 
-    wrapper_end = wrapper_start;
+    wrapper_end = wrapper_start + TRAMPOLINE_SIZE * MAX_TRAMPOLINES;
+    no_trampolines = 0;
 
     if (wrapper_start == NULL) {
       kfree(probe_list);
@@ -257,12 +500,14 @@ void kamprobes_free() {
   vfree(wrapper_start);
 }
 
-int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
-                       void (*post_handler)(void))
+int kamprobes_register(u8 **orig_addr, char sys_type, unsigned int group,
+                       int (*pre_handler)(void), void (*post_handler)(void))
 {
   char *wrapper_fp;
   int offset;
   char *target;
+  char *orig_target;
+  char *tramp;
   int32_t addr_ptr;
   unsigned char text_poke_isns[CALL_WIDTH];
 
@@ -270,8 +515,6 @@ int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
 
   const char callq_opcode = 0xe8;
   const char jmpq_opcode = 0xe9;
-  // test rax, rax
-  const char jmpnz_cond[3] = {0x48, 0x85, 0xC0};
 
   // Refuse to register probes on any addr which is not a callq or a noop
   if((!is_call_ins(orig_addr) && !is_noop(orig_addr)) ||
@@ -280,6 +523,12 @@ int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
     return -EINVAL;
   }
 
+  tramp = get_trampoline(pre_handler);
+  if (tramp == NULL) {
+    printk(KERN_ERR "rscfl: too many kamprobes trampolines\n");
+    return -ENOMEM;
+  }
+
   // If *orig_addr is not a call instruction then we assume it is the start
   // of a sys_ function, so is called through magic pointers. We don't want to
   // rewrite this code, so instead replace the call to __fentry__ with a call
@@ -294,21 +543,6 @@ int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
   // wrapper_fp always points to the start of the current wrapper frame.
   wrapper_fp = wrapper_end;
 
-  // The value of the address pointed to by the stack pointer currently
-  // contains the return address of the function we're interposing.
-  // If we are storing the return address before the start of the current
-  // wrapper frame then we need to take the value of the stack pointer, and
-  // put it in a register that we can trash (eg r11), and then move that
-  // register to the top of the wrapper frame.
-  if (!is_call_ins(orig_addr)) {
-    debugk("sys at %p, firstb: %#0x, wrapper @ %p\n", *orig_addr,
-           **orig_addr, wrapper_fp - 8);
-    emit_mov_rsp_r11(&wrapper_end);
-
-    // mov r11 wrapper_fp - 8
-    emit_mov_r11_addr(&wrapper_end, wrapper_fp - 8);
-  }
-
   // Find the target of the callq in the original instruction stream.
   // We need this so that after calling the pre handler we can then call
   // the original function.
@@ -316,56 +550,66 @@ int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
            ((*orig_addr)[3] << 16) + ((*orig_addr)[4] << 24) + CALL_WIDTH;
   target = (void *)*orig_addr + offset;
 
-  // Preserve arguments passed through registers before calling into the
-  // pre-handler. This is to obey the system v abi, whereby the caller has to
-  // maintain registers.
-  emit_save_registers(&wrapper_end);
-
-  // Call into the pre-handler.
-  emit_callq(&wrapper_end, (char *)pre_handler);
-
-  // optimisation: if the pre_handler returned -1, skip the bottom
-  // half of the wrapper (the rtn-handler)
-  // test rax, rax
-  // jnz MOV_WIDTH [over emit_mov_addr_rsp]
-  emit_short_cond_jmp(&wrapper_end, jmpnz_cond, sizeof(jmpnz_cond), MOV_WIDTH);
-
-  // Change the top of the stack so it points at the bottom-half of the wrapper,
-  // which is the bit that does the calling of the rtn-handler.
-  //
-  // The displacement computation +72(%rsp):
-  // 0x48 is the displacement for the number of entries currently on the stack
-  // before the return value. In our case, all the saved registers (9 of them)
-  // are on the stack:
-  // 9 registers * 8 bytes each = 72
-  // 72 = 0x48
-  emit_mov_addr_rsp(&wrapper_end, wrapper_end + sizeof(ins_restore_reg) +
-                                  JMP_WIDTH + MOV_WIDTH, 0x48);
-
-  // Restore the register file from what we just pushed onto the stack.
-  emit_restore_registers(&wrapper_end);
-
+  // Where the original code continues: the callee for callqs (the return
+  // address is already on the stack), the instruction after the __fentry__
+  // padding for SyS_ functions.
   if (is_call_ins(orig_addr)) {
-    // Run the original function.
-    // If this is a normal function (not a SyS_) then the code we run is the
-    // target of the call instruction that we're replacing. We jump into it as
-    // we've already pushed a return address onto the stack.
     switch(sys_type){
       case ADDR_CALLQ:
-        emit_jump(&wrapper_end, target);
+        orig_target = target;
         break;
       case ADDR_KERNEL_SYSCALL:
-        emit_jump(&wrapper_end, target+5);
+        orig_target = target + 5;
         break;
-      case ADDR_INVALID:
-      case ADDR_USER_SYSCALL:
+      default:
         // we shouldn't get syscalls that come directly from userspace
         // as callqs, nor should we probe invalid addresses.
         BUG();
     }
+  } else {
+    orig_target = (char *)(*orig_addr + CALL_WIDTH);
+  }
 
-    // Rtn-handling code.
+  // Fast path for processes not using rscfl.
+  if (can_emit_active_check()) {
+    emit_active_check(&wrapper_end, orig_target);
+  } else if (no_probes == 0) {
+    printk(KERN_WARNING "rscfl: rscfl_acct_active out of disp32 range, "
+                        "probes will not have a fast path\n");
+  }
 
+  // The value of the address pointed to by the stack pointer currently
+  // contains the return address of the function we're interposing.
+  // If we are storing the return address before the start of the current
+  // wrapper frame then we need to take the value of the stack pointer, and
+  // put it in a register that we can trash (eg r11), and then move that
+  // register to the top of the wrapper frame.
+  if (!is_call_ins(orig_addr)) {
+    debugk("sys at %p, firstb: %#0x, wrapper @ %p\n", *orig_addr,
+           **orig_addr, wrapper_fp - 8);
+    emit_mov_rsp_r11(&wrapper_end);
+
+    // mov r11 wrapper_fp - 8
+    emit_mov_r11_addr(&wrapper_end, wrapper_fp - 8);
+  }
+
+  // Hand over to the trampoline of the subsystem, which returns to resume
+  // (the jump into the original code just below).
+  emit_callq(&wrapper_end, tramp);
+
+  // Resume: run the original code.
+  // For callqs, the code we run is the target of the call instruction that
+  // we're replacing. We jump into it as the call already pushed a return
+  // address onto the stack.
+  // For SyS_ functions, we've added kamprobes to the function padding, at the
+  // top of a syscall. The original code we run is therefore not the target of
+  // this memory, which would be __fentry__. Rather it is the next instruction
+  // in the syscall.
+  emit_jump(&wrapper_end, orig_target);
+
+  // Rtn-handling code, at resume + JMP_WIDTH: if the pre-handler returned 0,
+  // the trampoline made the original function return here.
+  if (is_call_ins(orig_addr)) {
     // Set up the return address of the rtn-handler.
     // This is actually set to be the next instruction in the original
     // instruction stream. This means that control flow goes directly back from
@@ -374,12 +618,6 @@ int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
     // return to where we came from. However, it is efficient.
     emit_push_addr(&wrapper_end, (char *)(*orig_addr + CALL_WIDTH));
   } else {
-    // We're adding kamprobes to the function padding, at the top of a syscall.
-    // The original code we run is therefore not the target of this memory
-    // which would be __fentry__. Rather it is the next instruction in the
-    // syscall.
-    emit_jump(&wrapper_end, (char *)(*orig_addr + CALL_WIDTH));
-
     // At the start of our wrapper we mov'd the return pointer to wrapper_fp-8.
     // We now need to restore it.
 
@@ -400,11 +638,8 @@ int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
 
   // End of setting up the wrapper.
 
-  // Store the original address so that we can remove kamprobes.
-  add_to_probe_list(*orig_addr);
-  // Ensure we start with a callq opcode, in case of nop-ed insns.
-
-  // Poke the original instruction to point to our wrapper.
+  // The instruction pointing the original call site to our wrapper. Ensure we
+  // start with a callq opcode, in case of nop-ed insns.
   addr_ptr = wrapper_fp - CALL_WIDTH - (char *)*orig_addr;
 
   if(is_call_ins(orig_addr)) { // callq
@@ -414,10 +649,8 @@ int kamprobes_register(u8 **orig_addr, char sys_type, int (*pre_handler)(void),
   }
   memcpy(text_poke_isns + 1, &addr_ptr, CALL_WIDTH - 1);
 
-  get_online_cpus();
-  mutex_lock(KPRIV(text_mutex));
-  KPRIV(text_poke)(*orig_addr, &text_poke_isns, CALL_WIDTH);
-  mutex_unlock(KPRIV(text_mutex));
-  put_online_cpus();
+  // Store the original instruction so that we can remove kamprobes. The call
+  // site is only poked by kamprobes_arm.
+  add_to_probe_list(*orig_addr, text_poke_isns, group);
   return 0;
 }
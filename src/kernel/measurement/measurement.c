@@ -29,11 +29,9 @@
  * Some extra, useful counters
  */
 /*
- *static struct timespec rscfl_get_timestamp(void)
+ *static ru64 rscfl_get_timestamp(void)
  *{
- *  struct timespec ts;
- *  getrawmonotonic(&ts);
- *  return ts;
+ *  return ktime_get_raw_ns();
  *}
  */
 
@@ -65,27 +63,29 @@ int rscfl_counters_update_subsys_vals(struct subsys_accounting *add_subsys,
   pid_acct *current_pid_acct;
 
   u64 cycles = rscfl_get_cycles();
-  //struct timespec time = rscfl_get_timestamp();
+  //ru64 time = rscfl_get_timestamp();
   int subsys_err;
   volatile syscall_interest_t *interest;
+  _Bool shared;
 
   preempt_disable();
   current_pid_acct = CPU_VAR(current_acct);
   preempt_enable();
 
   interest = &(current_pid_acct->ctrl->interest);
+  shared = current_pid_acct->active_token->shared;
 
   // Update the WALL CLOCK TIME and CYCLES
   if (add_subsys != NULL) {
-    add_subsys->subsys_entries++;
-    add_subsys->cpu.cycles += cycles;
-    //rscfl_timespec_add(&add_subsys->cpu.wall_clock_time, &time);
+    RSCFL_SUBSYS_ADD(shared, add_subsys->subsys_entries, 1);
+    RSCFL_SUBSYS_ADD(shared, add_subsys->cpu.cycles, cycles);
+    //add_subsys->cpu.wall_clock_time += time;
   }
 
   if (minus_subsys != NULL) {
-    minus_subsys->subsys_exits++;
-    minus_subsys->cpu.cycles -= cycles;
-    //rscfl_timespec_diff_comp(&minus_subsys->cpu.wall_clock_time, &time);
+    RSCFL_SUBSYS_ADD(shared, minus_subsys->subsys_exits, 1);
+    RSCFL_SUBSYS_ADD(shared, minus_subsys->cpu.cycles, -cycles);
+    //minus_subsys->cpu.wall_clock_time -= time;
   }
 
 #ifdef XEN_ENABLED
@@ -128,10 +128,8 @@ int rscfl_counters_update_subsys_vals(struct subsys_accounting *add_subsys,
         continue;
       }
       if (add_subsys != NULL) {
-        // Get timespec from the scheduling event->
+        // Get the timestamp (ns) from the scheduling event->
         hypervisor_timestamp = 0;
-        //memset(&time, 0, sizeof(struct timespec));
-        //rscfl_timespec_add_ns(&time, hypervisor_timestamp);
 
         // Check the number of credits for the VCPU, and update min/max as
         // required.
@@ -145,7 +143,7 @@ int rscfl_counters_update_subsys_vals(struct subsys_accounting *add_subsys,
           // Update count of scheduling events.
           add_subsys->sched.xen_schedules++;
 
-          //rscfl_timespec_add(&add_subsys->sched.xen_sched_wct, &time);
+          //add_subsys->sched.xen_sched_wct += hypervisor_timestamp;
           add_subsys->sched.xen_sched_cycles += event->cycles;
           add_subsys->sched.xen_evtchn_pending_size += no_evtchn_events;
 
@@ -153,8 +151,7 @@ int rscfl_counters_update_subsys_vals(struct subsys_accounting *add_subsys,
           // Update count of scheduling events.
           add_subsys->sched.xen_schedules++;
 
-          //rscfl_timespec_diff_comp(&time, &add_subsys->sched.xen_sched_wct);
-          //add_subsys->sched.xen_sched_wct = time;
+          //add_subsys->sched.xen_sched_wct -= hypervisor_timestamp;
           add_subsys->sched.xen_sched_cycles -= event->cycles;
           add_subsys->sched.xen_evtchn_pending_size -= no_evtchn_events;
         }
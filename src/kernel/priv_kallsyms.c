@@ -32,6 +32,9 @@ int init_priv_kallsyms(void)
 {
   int symbols_not_found = 0;
   PRIV_KSYM_TABLE(KSYM_INIT);
+#ifdef PRIV_KSYM_POKE_TABLE
+  PRIV_KSYM_POKE_TABLE(KSYM_INIT);
+#endif
 #if SHDW_ENABLED != 0
   PRIV_KSYM_SHDW_TABLE(KSYM_INIT);
 #endif
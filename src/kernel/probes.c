@@ -9,6 +9,16 @@
 
 #include "rscfl/kernel/probes.h"
 
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+
 #include "rscfl/kernel/acct.h"
 #include "rscfl/kernel/cpu.h"
 #include "rscfl/kernel/kamprobes.h"
@@ -33,27 +43,84 @@ _(XENINTERRUPTS)
 #define PROBES_AS_SYSCALL_TYPE(a) a##_INTERNAL_SYSCALL,
 #define PROBES_AS_PRE_HANDLE(a) rscfl_pre_handler_##a,
 #define PROBES_AS_RTN_HANDLE(a) rscfl_rtn_handler_##a,
+#define PROBES_AS_SUBSYS(a) a,
+#define PROBES_AS_NAME(a) #a,
 
-int probes_init(void)
+static const rscfl_subsys probe_subsys_ids[] = {PROBE_LIST(PROBES_AS_SUBSYS)};
+static const char *probe_subsys_names[] = {PROBE_LIST(PROBES_AS_NAME)};
+#define NUM_PROBED_SUBSYS                                                      \
+  (sizeof(probe_subsys_ids) / sizeof(probe_subsys_ids[0]))
+
+/*
+ * Subsystems of PROBE_LIST whose call sites get poked when the probes are
+ * armed; bit i stands for the i-th entry of PROBE_LIST (the kamprobes group
+ * of its probes). The costs of a subsystem left out are accounted to the
+ * subsystem calling into it.
+ */
+static unsigned long probes_enabled = ~0UL;
+
+static char *probe_subsys;
+module_param(probe_subsys, charp, 0444);
+MODULE_PARM_DESC(probe_subsys, "Comma-separated list of the subsystems to "
+                 "probe (e.g. NETWORKINGGENERAL,FILESYSTEMSVFSANDINFRASTRUCTURE)"
+                 "; all of them by default. See also RSCFL_SUBSYS_MASK_CMD");
+
+static int parse_probe_subsys(void)
+{
+  char *copy, *list, *name;
+  int i;
+
+  if (probe_subsys == NULL || *probe_subsys == '\0') return 0;
+  // strsep writes into the string, and the parameter stays readable from
+  // sysfs: work on a copy
+  copy = kstrdup(probe_subsys, GFP_KERNEL);
+  if (copy == NULL) return -ENOMEM;
+  probes_enabled = 0;
+  list = copy;
+  while ((name = strsep(&list, ",")) != NULL) {
+    for (i = 0; i < NUM_PROBED_SUBSYS; i++) {
+      if (strcmp(name, probe_subsys_names[i]) == 0) {
+        probes_enabled |= 1UL << i;
+        break;
+      }
+    }
+    if (i == NUM_PROBED_SUBSYS && *name != '\0') {
+      printk(KERN_WARNING "rscfl: probe_subsys: unknown subsystem %s\n", name);
+    }
+  }
+  kfree(copy);
+  return 0;
+}
+
+/*
+ * Probes are registered (their wrappers built) by the rscfl_probes kthread, in
+ * chunks of PROBES_CHUNK with interrupts enabled and a reschedule point in
+ * between, so that loading the module does not stall the host. Arming waits
+ * for it to finish (probes_get).
+ */
+#define PROBES_CHUNK 1024
+
+static DECLARE_COMPLETION(probes_registered);
+static _Bool probes_reg_abort = 0;
+
+static int probes_register_fn(void *ignore)
 {
   u8 **probe_addrs_temp[] = {PROBE_LIST(PROBES_AS_ADDRS)};
   char *syscall_type_temp[] = {PROBE_LIST(PROBES_AS_SYSCALL_TYPE)};
 
   int i, rc, failures = 0, probes = 0;
-  unsigned long flags;
+  ktime_t start = ktime_get();
 
   int (*probe_pre_handlers_temp[])(void) = {PROBE_LIST(PROBES_AS_PRE_HANDLE)};
   void (*probe_post_handlers_temp[])(void) = {PROBE_LIST(PROBES_AS_RTN_HANDLE)};
 
   int num_subsys = sizeof(probe_pre_handlers_temp) / sizeof(u8*);
 
-  kamprobes_init(RSCFL_NUM_PROBES);
-  local_irq_save(flags);
   for (i = 0; i < num_subsys; i++) {
     u8 **sub_addr = probe_addrs_temp[i];
     int j = 0;
     while (*sub_addr) {
-      rc = kamprobes_register(sub_addr, syscall_type_temp[i][j],
+      rc = kamprobes_register(sub_addr, syscall_type_temp[i][j], i,
                               probe_pre_handlers_temp[i],
                               probe_post_handlers_temp[i]);
       if (rc) {
@@ -63,23 +130,181 @@ int probes_init(void)
       }
       sub_addr++;
       j++;
+      if ((probes + failures) % PROBES_CHUNK == 0) {
+        if (READ_ONCE(probes_reg_abort)) goto out;
+        cond_resched();
+      }
     }
   }
-  local_irq_restore(flags);
-  debugk("Registered %d probes\n", probes - failures);
-  return failures;
+
+out:
+  printk(KERN_NOTICE "rscfl: registered %d probes in %lld ms\n", probes,
+         ktime_ms_delta(ktime_get(), start));
+  if (failures) {
+    // Do not fail just because we couldn't set a couple of probes
+    // instead, print a warning.
+    printk(KERN_WARNING "rscfl: failed to insert %d probes\n", failures);
+  }
+  complete_all(&probes_registered);
+  return 0;
 }
 
-void probes_free() {
-  kamprobes_free();
+int probes_init(void)
+{
+  struct task_struct *reg_thread;
+  int rc;
+
+  rc = parse_probe_subsys();
+  if (rc) {
+    return rc;
+  }
+  rc = kamprobes_init(RSCFL_NUM_PROBES);
+  if (rc) {
+    return rc;
+  }
+  reg_thread = kthread_run(probes_register_fn, NULL, "rscfl_probes");
+  if (IS_ERR(reg_thread)) {
+    kamprobes_free();
+    return PTR_ERR(reg_thread);
+  }
+  return 0;
+}
+
+static DEFINE_MUTEX(probes_arm_mutex);
+static atomic_t probes_users = ATOMIC_INIT(0);
+static _Bool probes_armed = 0;
+static _Bool probes_stopped = 0;
+
+static void probes_arm_work_fn(struct work_struct *work);
+static DECLARE_WORK(probes_arm_work, probes_arm_work_fn);
+static void probes_disarm_work_fn(struct work_struct *work);
+static DECLARE_WORK(probes_disarm_work, probes_disarm_work_fn);
+
+// call with probes_arm_mutex held
+static void probes_arm(void)
+{
+  if (!probes_armed && !probes_stopped) {
+    ktime_t start = ktime_get();
+    register_sched_interposition();
+    kamprobes_arm(probes_enabled);
+    probes_armed = 1;
+    printk(KERN_NOTICE "rscfl: probes armed in %lld ms\n",
+           ktime_ms_delta(ktime_get(), start));
+  }
+}
+
+// call with probes_arm_mutex held
+static void probes_disarm(void)
+{
+  if (probes_armed) {
+    kamprobes_disarm_all();
+    unregister_sched_interposition();
+    probes_armed = 0;
+  }
+}
+
+static void probes_arm_work_fn(struct work_struct *work)
+{
+  wait_for_completion(&probes_registered);
+  mutex_lock(&probes_arm_mutex);
+  // the last thread might have gone since the work was scheduled
+  if (atomic_read(&probes_users) != 0) {
+    probes_arm();
+  }
+  mutex_unlock(&probes_arm_mutex);
+}
+
+static void probes_disarm_work_fn(struct work_struct *work)
+{
+  mutex_lock(&probes_arm_mutex);
+  // a thread might have registered since the work was scheduled
+  if (atomic_read(&probes_users) == 0) {
+    probes_disarm();
+  }
+  mutex_unlock(&probes_arm_mutex);
+}
+
+void probes_get(void)
+{
+  atomic_inc(&probes_users);
+  // all call sites get poked at once, so wait for the wrappers to be built
+  wait_for_completion(&probes_registered);
+  mutex_lock(&probes_arm_mutex);
+  probes_arm();
+  mutex_unlock(&probes_arm_mutex);
+}
+
+void probes_hold(void)
+{
+  if (READ_ONCE(probes_stopped)) return;
+  atomic_inc(&probes_users);
+  if (!READ_ONCE(probes_armed)) {
+    schedule_work(&probes_arm_work);
+  }
+}
+
+void probes_put(void)
+{
+  // the probes stay disarmed after RSCFL_SHUTDOWN_CMD
+  if (READ_ONCE(probes_stopped)) return;
+  if (atomic_dec_and_test(&probes_users)) {
+    schedule_work(&probes_disarm_work);
+  }
+}
+
+void probes_set_subsys(rscfl_subsys_mask *mask)
+{
+  int i;
+  rscfl_subsys id;
+
+  mutex_lock(&probes_arm_mutex);
+  for (i = 0; i < NUM_PROBED_SUBSYS; i++) {
+    id = probe_subsys_ids[i];
+    if (RSCFL_SUBSYS_MASK_ISSET(mask->enable, id)) {
+      probes_enabled |= 1UL << i;
+    }
+    if (RSCFL_SUBSYS_MASK_ISSET(mask->disable, id)) {
+      probes_enabled &= ~(1UL << i);
+    }
+  }
+  if (probes_armed) {
+    kamprobes_arm(probes_enabled);
+  }
+
+  memset(mask->probed, 0, sizeof(mask->probed));
+  for (i = 0; i < NUM_PROBED_SUBSYS; i++) {
+    if (probes_enabled & (1UL << i)) {
+      RSCFL_SUBSYS_MASK_SET(mask->probed, probe_subsys_ids[i]);
+    }
+  }
+  mutex_unlock(&probes_arm_mutex);
 }
 
 int probes_unregister(void)
 {
+  WRITE_ONCE(probes_reg_abort, 1);
+  wait_for_completion(&probes_registered);
+  mutex_lock(&probes_arm_mutex);
+  WRITE_ONCE(probes_stopped, 1);
+  probes_disarm();
+  mutex_unlock(&probes_arm_mutex);
+  cancel_work_sync(&probes_arm_work);
+  cancel_work_sync(&probes_disarm_work);
   kamprobes_unregister_all();
   return 0;
 }
 
+void probes_free() {
+  // the wrappers might still be being built
+  WRITE_ONCE(probes_reg_abort, 1);
+  wait_for_completion(&probes_registered);
+  // a data device closed, or a thread exiting, after RSCFL_SHUTDOWN_CMD might
+  // have queued these; they must not run once the module text is gone
+  cancel_work_sync(&probes_arm_work);
+  cancel_work_sync(&probes_disarm_work);
+  kamprobes_free();
+}
+
 
 // scheduler interposition probes
 struct tracepoint *rscfl_sched_switch,
@@ -15,6 +15,7 @@
 #include <linux/module.h>
 
 #include "rscfl/config.h"
+#include "rscfl/kernel/acct.h"
 #include "rscfl/kernel/cpu.h"
 #include "rscfl/kernel/chardev.h"
 #include "rscfl/kernel/kamprobes.h"
@@ -28,6 +29,7 @@ static int __init rscfl_init(void)
 {
 
   int rc;
+  rscfl_acct_geom_t default_geom;
 
   // Get addresses for private kernel symbols.
   rc = init_priv_kallsyms();
@@ -42,8 +44,9 @@ static int __init rscfl_init(void)
     printk(KERN_ERR "rscfl: cannot initialize per-cpu hash tables\n");
     return rc;
   }
-  debugk("per-thread mmap alloc: Total: %lu, /acct: %d, /subsys: %lu\n",
-         MMAP_BUF_SIZE, STRUCT_ACCT_NUM, ACCT_SUBSYS_NUM);
+  rscfl_acct_geom_init(&default_geom, 0, 0, 0);
+  debugk("default per-thread mmap alloc: Total: %u, /acct: %u, /subsys: %u\n",
+         default_geom.size, default_geom.acct_num, default_geom.subsys_num);
 
   // Initialise the rscfl drivers.
   rc = _rscfl_dev_init();
@@ -59,11 +62,11 @@ static int __init rscfl_init(void)
     return rc;
   }
 
+  // Probes get registered in the background (see probes_init).
   rc = probes_init();
   if (rc) {
-    // Do not fail just because we couldn't set a couple of probes
-    // instead, print a warning.
-    printk(KERN_WARNING "rscfl: failed to insert %d probes\n", rc);
+    printk(KERN_ERR "rscfl: cannot start probe registration\n");
+    return rc;
   }
 
   // Initialise scheduler interposition.
@@ -73,12 +76,8 @@ static int __init rscfl_init(void)
     probes_unregister();
     return rscfl_tracepoint_status;
   }
-  rc = register_sched_interposition();
-  if (rc) {
-    printk(KERN_ERR "rscfl: unable to interpose scheduler\n");
-    probes_unregister();
-    return rc;
-  }
+  // The probes and the scheduler interposition are armed when rscfl is first
+  // used (see probes_get).
   printk(KERN_NOTICE "rscfl: running\n");
   return 0;
 
@@ -89,7 +88,8 @@ static void __exit rscfl_cleanup(void)
 {
   int rcd = 0;
   rcd = _rscfl_dev_cleanup();
-  kamprobes_free();
+  probes_free();
+  acct_notify_drain();
 
   if (rcd) {
     printk(KERN_ERR "rscfl: cannot cleanup rscfl drivers\n");
@@ -99,20 +99,17 @@ static void __exit rscfl_cleanup(void)
 
 // called by the RSCFL_SHUTDOWN_CMD IOCTL
 void do_module_shutdown(void) {
-  int rcs, rcc, rcp = 0;
+  int rcc, rcp = 0;
 
   if(rscfl_is_stopped == 0) {
     rscfl_is_stopped = 1;
-    rcs = unregister_sched_interposition();
+    // disarms the probes and the scheduler interposition
+    rcp = probes_unregister();
     tracepoint_synchronize_unregister();
     rcc = _rscfl_cpus_cleanup();
-    rcp = probes_unregister();
     debugk("probe cleanup completed\n");
     rscfl_counters_stop();
 
-    if (rcs) {
-      printk(KERN_ERR "rscfl: disabling scheduler interposition failed\n");
-    }
     if (rcc) {
       printk(KERN_ERR "rscfl: cannot cleanup per-cpu hash tables\n");
     }
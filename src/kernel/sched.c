@@ -9,12 +9,14 @@
 
 #include "rscfl/kernel/sched.h"
 
-#include "linux/time.h"
+#include "linux/ktime.h"
 
 #include "rscfl/costs.h"
 #include "rscfl/kernel/acct.h"
+#include "rscfl/kernel/chardev.h"
 #include "rscfl/kernel/cpu.h"
 #include "rscfl/kernel/hasht.h"
+#include "rscfl/kernel/measurement.h"
 #include "rscfl/kernel/probes.h"
 #include "rscfl/kernel/shdw.h"
 #include "rscfl/res_common.h"
@@ -27,9 +29,10 @@ static void record_ctx_switch(pid_acct *p_acct, struct task_struct *task,
   acct = p_acct->probe_data->syscall_acct;
   if (acct != NULL){
     struct subsys_accounting *subsys_acct;
-    struct timespec ts;
+    ru64 ns;
     ru64 cycles;
     int err;
+    _Bool shared;
 
     err = get_subsys(*(p_acct->subsys_ptr-1), &subsys_acct);
     if (err < 0) {
@@ -38,16 +41,19 @@ static void record_ctx_switch(pid_acct *p_acct, struct task_struct *task,
 
     // Snapshot counters
     cycles = rscfl_get_cycles();
-    getrawmonotonic(&ts);
+    ns = ktime_get_raw_ns();
 
+    shared = p_acct->active_token->shared;
     if (values_add) {
-      rscfl_timespec_add(&subsys_acct->sched.wct_out_local, &ts);
-      subsys_acct->sched.cycles_out_local += cycles;
-      subsys_acct->sched.run_delay += task->sched_info.run_delay;
+      RSCFL_SUBSYS_ADD(shared, subsys_acct->sched.wct_out_local, ns);
+      RSCFL_SUBSYS_ADD(shared, subsys_acct->sched.cycles_out_local, cycles);
+      RSCFL_SUBSYS_ADD(shared, subsys_acct->sched.run_delay,
+                       task->sched_info.run_delay);
     } else {
-      rscfl_timespec_diff_comp(&subsys_acct->sched.wct_out_local, &ts);
-      subsys_acct->sched.cycles_out_local -= cycles;
-      subsys_acct->sched.run_delay -= task->sched_info.run_delay;
+      RSCFL_SUBSYS_ADD(shared, subsys_acct->sched.wct_out_local, -ns);
+      RSCFL_SUBSYS_ADD(shared, subsys_acct->sched.cycles_out_local, -cycles);
+      RSCFL_SUBSYS_ADD(shared, subsys_acct->sched.run_delay,
+                       -task->sched_info.run_delay);
     }
   }
 }
@@ -62,14 +68,16 @@ void on_ctx_switch(void *ignore,
 {
   pid_t next_tid = next->pid;
   pid_acct *curr_acct = CPU_VAR(current_acct);
-  if (curr_acct != NULL && curr_acct->ctrl->interest.token_id != NULL_TOKEN) {
+  // nothing to account for a syscall left out by sampling
+  if (curr_acct != NULL && curr_acct->ctrl->interest.token_id != NULL_TOKEN &&
+      !curr_acct->sample_skip) {
     update_acct();
     record_ctx_switch(curr_acct, prev, 0);
   }
 
   hash_for_each_possible(CPU_TBL(pid_acct_tbl), curr_acct, link, next_tid) {
     if(curr_acct->pid == next_tid){
-      CPU_VAR(current_acct) = curr_acct;
+      set_current_acct(curr_acct);
       if(curr_acct->ctrl->interest.token_id != NULL_TOKEN)
         record_ctx_switch(curr_acct, next, 1);
 #if SHDW_ENABLED != 0
@@ -88,7 +96,7 @@ void on_ctx_switch(void *ignore,
   }
 
   // next_tid is not in the hash table (not a process using resourceful)
-  CPU_VAR(current_acct) = NULL;
+  set_current_acct(NULL);
 }
 
 
@@ -136,6 +144,10 @@ void on_cpu_switch(void *ignore,
 
 
 /* Remove the pid from the hash tables of any CPUs that might hold it.
+ *
+ * A pid_acct is linked into one table at a time (it has a single link), so
+ * the search stops at the first match: the pid_acct is freed, and its probes
+ * reference dropped, exactly once.
  *
  * TODO(lc525): possible optimisation is to keep a set of what CPUs a pid has
  * been on, so that we minimise the number of hash table look-ups
@@ -149,7 +161,7 @@ void on_task_exit(void *ignore, struct task_struct *p)
   for_each_present_cpu(cpu_id) {
     hash_for_each_possible(per_cpu(pid_acct_tbl, cpu_id), it, link, pid) {
       if(it->pid == pid) {
-        CPU_VAR(current_acct) = NULL;
+        set_current_acct(NULL);
         hash_del(&it->link);
         // Freeing the probe_data prevents the rscfl_handle from being reused
         // on other threads. We should _at least_ reset it or provide an option
@@ -157,8 +169,13 @@ void on_task_exit(void *ignore, struct task_struct *p)
         // However, right now we don't have support for handle reuse, so we'll
         // free it here (on thread exit)
         if(it->probe_data) kfree(it->probe_data);
-        kfree(it);
-        break;
+        rscfl_region_release_slice(it);
+        free_kernel_tokens(it);
+        // this runs in the sched_process_exit tracepoint, which cannot
+        // sleep: the eventfd (if any) and it are freed from a work item
+        release_pid_acct(it);
+        probes_put();
+        return;
       }
     }
   }
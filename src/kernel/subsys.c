@@ -9,11 +9,50 @@
 
 #include "rscfl/kernel/subsys.h"
 
+#include <linux/bitops.h>
+
 #include "rscfl/kernel/acct.h"
 #include "rscfl/kernel/cpu.h"
 #include "rscfl/kernel/measurement.h"
 #include "rscfl/kernel/xen.h"
 
+/*
+ * Add (subsys_id, subsys_offset) to the acct_subsys list of the struct
+ * accounting of a process-wide token, which other threads may be adding to at
+ * the same time. Entries from nr onwards are either RSCFL_SUBSYS_ENTRY_EMPTY
+ * or being claimed, so the first empty one is taken with cmpxchg;
+ * nr_subsystems is only raised once the entry it covers is filled in.
+ *
+ * Returns the position of subsys_id in the list, which holds a different slot
+ * if another thread added subsys_id first, or -1 if the list is full.
+ */
+static short add_shared_subsys(struct accounting *acct, short nr,
+                               rscfl_subsys subsys_id, int subsys_offset)
+{
+  union {
+    struct acct_subsys_entry e;
+    u32 w;
+  } empty, entry, seen;
+  short pos, cur;
+
+  BUILD_BUG_ON(sizeof(struct acct_subsys_entry) != sizeof(u32));
+  empty.e.id = RSCFL_SUBSYS_ENTRY_EMPTY;
+  empty.e.slot = RSCFL_SUBSYS_ENTRY_EMPTY;
+  entry.e.id = subsys_id;
+  entry.e.slot = subsys_offset;
+  for (pos = nr; pos < NUM_SUBSYSTEMS; pos++) {
+    seen.w = cmpxchg((u32 *)&acct->acct_subsys[pos], empty.w, entry.w);
+    if (seen.w == empty.w) break;
+    if (seen.e.id == subsys_id) return pos;
+  }
+  if (pos == NUM_SUBSYSTEMS) return -1;
+
+  do {
+    cur = READ_ONCE(acct->nr_subsystems);
+  } while (cur <= pos && cmpxchg(&acct->nr_subsystems, cur, pos + 1) != cur);
+  return pos;
+}
+
 /*
  * Find the subsys_accounting for the current struct accounting with the
  * given subsys_id.
@@ -27,51 +66,108 @@ int get_subsys(rscfl_subsys subsys_id,
   struct subsys_accounting *subsys_acct;
   pid_acct *current_pid_acct;
   rscfl_acct_layout_t *rscfl_mem;
-  int subsys_offset;
+  rscfl_acct_geom_t *geom;
+  int subsys_offset = -1;
+  short pos, nr;
+  _Bool shared;
 
   current_pid_acct = CPU_VAR(current_acct);
   BUG_ON(current_pid_acct == NULL);
 
   acct = current_pid_acct->probe_data->syscall_acct;
-  rscfl_mem = current_pid_acct->shared_buf;
-  subsys_offset = acct->acct_subsys[subsys_id];
-  if (subsys_offset == -1) {
-    // Need to find space in the page where we can store the subsystem.
-    subsys_acct = rscfl_mem->subsyses;
-    // Walk through the subsyses, being careful not to wonder of the end of
-    // our memory.
-    while (subsys_acct - rscfl_mem->subsyses <= ACCT_SUBSYS_NUM) {
-      if (!subsys_acct->in_use) {
-        // acct_subsys is an index that describes the offset from the start of
-        // subsyses as measured by number of struct subsys_accountings.
-        // Recall that this is done as we need consistent indexing between
-        // userspace and kernel space.
-        subsys_offset = subsys_acct - rscfl_mem->subsyses;
-        acct->acct_subsys[subsys_id] = subsys_offset;
-        acct->nr_subsystems++;
-        break;
-      } else {
-        subsys_acct++;
-      }
+  // process-wide tokens keep their subsystems in the process-wide slice,
+  // which has the same geometry as the slices of the threads
+  shared = current_pid_acct->active_token->shared;
+  rscfl_mem = shared ? current_pid_acct->active_token->buf
+                     : current_pid_acct->shared_buf;
+  geom = &current_pid_acct->geom;
+  nr = READ_ONCE(acct->nr_subsystems);
+  if (nr < 0 || nr > NUM_SUBSYSTEMS) {
+    // the list lives in memory writable by user space
+    printk(KERN_ERR "rscfl: corrupted subsystem list\n");
+    return -EINVAL;
+  }
+
+  // Fast path: subsys_pos remembers where subsys_id was last added. It may
+  // point into the list of another struct accounting (after a token switch),
+  // so check it against this one and fall back to scanning the list.
+  pos = current_pid_acct->subsys_pos[subsys_id];
+  if (pos < 0 || pos >= nr || acct->acct_subsys[pos].id != subsys_id) {
+    for (pos = 0; pos < nr; pos++) {
+      if (acct->acct_subsys[pos].id == subsys_id) break;
     }
-    if (subsys_offset == -1) {
-      // We haven't found anywhere in the shared page where we can store
-      // this subsystem.
-      printk(KERN_ERR
-             "rscfl: Unable to allocate memory for subsystem accounting\n");
-      current_pid_acct->ctrl->interest.flags |= __ACCT_ERR;
-      current_pid_acct->ctrl->interest.syscall_id = 0;
-      return -ENOMEM;
+  }
+  if (pos < nr) {
+    current_pid_acct->subsys_pos[subsys_id] = pos;
+    subsys_offset = acct->acct_subsys[pos].slot;
+    if (subsys_offset < 0 || subsys_offset >= geom->subsys_num) {
+      printk(KERN_ERR "rscfl: invalid subsys slot %d\n", subsys_offset);
+      return -EINVAL;
     }
-    // Now need to initialise the subsystem's resources to be 0.
-    subsys_acct = &rscfl_mem->subsyses[subsys_offset];
+  }
+
+  if (subsys_offset == -1) {
+    if (nr == NUM_SUBSYSTEMS) {
+      printk(KERN_ERR "rscfl: subsystem list full\n");
+      return -EINVAL;
+    }
+    // Need to find space in the page where we can store the subsystem: take
+    // the first free slot in the subsys_map bitmap. User space may clear
+    // bits concurrently, so claim the slot atomically and retry if we lose.
+    do {
+      subsys_offset = find_first_zero_bit(RSCFL_SUBSYS_MAP(rscfl_mem, geom),
+                                          geom->subsys_num);
+      if (subsys_offset >= geom->subsys_num) {
+        // We haven't found anywhere in the shared page where we can store
+        // this subsystem.
+        printk(KERN_ERR
+               "rscfl: Unable to allocate memory for subsystem accounting\n");
+        current_pid_acct->ctrl->interest.flags |= __ACCT_ERR;
+        current_pid_acct->ctrl->interest.syscall_id = 0;
+        acct_notify(current_pid_acct, 1);
+        return -ENOMEM;
+      }
+    } while (test_and_set_bit(subsys_offset,
+                              RSCFL_SUBSYS_MAP(rscfl_mem, geom)));
+
+    // Now need to initialise the subsystem's resources to be 0. For
+    // process-wide tokens, this must happen before other threads can find
+    // the slot in acct_subsys.
+    subsys_acct = &RSCFL_SUBSYSES(rscfl_mem, geom)[subsys_offset];
     memset(subsys_acct, 0, sizeof(struct subsys_accounting));
-    subsys_acct->in_use = 1;
     subsys_acct->sched.xen_credits_min = INT_MAX;
     subsys_acct->sched.xen_credits_max = INT_MIN;
 
+    // the slot in acct_subsys is an offset from the start of subsyses as
+    // measured by number of struct subsys_accountings.
+    // Recall that this is done as we need consistent indexing between
+    // userspace and kernel space.
+    if (shared) {
+      pos = add_shared_subsys(acct, nr, subsys_id, subsys_offset);
+      if (pos < 0 || acct->acct_subsys[pos].slot != subsys_offset) {
+        // the list is full, or another thread added subsys_id first
+        clear_bit(subsys_offset, RSCFL_SUBSYS_MAP(rscfl_mem, geom));
+        if (pos < 0) {
+          printk(KERN_ERR "rscfl: subsystem list full\n");
+          return -EINVAL;
+        }
+        subsys_offset = acct->acct_subsys[pos].slot;
+        if (subsys_offset < 0 || subsys_offset >= geom->subsys_num) {
+          printk(KERN_ERR "rscfl: invalid subsys slot %d\n", subsys_offset);
+          return -EINVAL;
+        }
+        subsys_acct = &RSCFL_SUBSYSES(rscfl_mem, geom)[subsys_offset];
+      }
+      current_pid_acct->subsys_pos[subsys_id] = pos;
+    } else {
+      acct->acct_subsys[nr].id = subsys_id;
+      acct->acct_subsys[nr].slot = subsys_offset;
+      current_pid_acct->subsys_pos[subsys_id] = nr;
+      acct->nr_subsystems = nr + 1;
+    }
+
   } else {
-    subsys_acct = &rscfl_mem->subsyses[subsys_offset];
+    subsys_acct = &RSCFL_SUBSYSES(rscfl_mem, geom)[subsys_offset];
   }
   *subsys_acct_ret = subsys_acct;
   return 0;
@@ -123,14 +219,34 @@ int rscfl_subsys_entry(rscfl_subsys subsys_id)
 
   if(current_pid_acct->subsys_ptr == current_pid_acct->subsys_stack + 1) {
     int u_err;
-    u_err = update_acct();
-    if(u_err) {
-      current_pid_acct->executing_probe = 0;
-      preempt_enable();
-      return -1;
+    // a syscall left out by sampling is not measured at all: the probes only
+    // track its subsystem nesting, to find out where it ends (see
+    // rscfl_subsys_exit). The decision is only taken here, once per syscall
+    if((interest->flags & ACCT_SAMPLE) && !acct_sampled(current_pid_acct)) {
+      interest->flags |= __ACCT_NOT_SAMPLED;
+      current_pid_acct->sample_skip = 1;
+      current_pid_acct->probe_data->syscall_acct = NULL;
+    } else {
+      interest->flags &= ~__ACCT_NOT_SAMPLED;
+      current_pid_acct->sample_skip = 0;
+      u_err = update_acct();
+      if(u_err) {
+        current_pid_acct->executing_probe = 0;
+        preempt_enable();
+        return -1;
+      }
     }
   }
 
+  if (current_pid_acct->sample_skip) {
+    // the syscall was left out by sampling
+    *(current_pid_acct->subsys_ptr) = subsys_id;
+    current_pid_acct->subsys_ptr++;
+    current_pid_acct->executing_probe = 0;
+    preempt_enable();
+    return 0;
+  }
+
   err = get_subsys(subsys_id, &new_subsys_acct);
   if (err < 0) {
     goto error;
@@ -193,6 +309,16 @@ void rscfl_subsys_exit(rscfl_subsys subsys_id)
   //*(current_pid_acct->subsys_ptr) = subsys_id;
   current_pid_acct->subsys_ptr--;
 
+  if (current_pid_acct->sample_skip) {
+    if (current_pid_acct->subsys_ptr == current_pid_acct->subsys_stack + 1) {
+      current_pid_acct->sample_skip = 0;
+      clear_acct_next();
+    }
+    current_pid_acct->executing_probe = 0;
+    preempt_enable();
+    return;
+  }
+
   err = get_subsys(subsys_id, &subsys_acct);
   if (err) {
     goto error;
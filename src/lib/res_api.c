@@ -13,15 +13,22 @@
 #include <fcntl.h>
 #include <linux/netlink.h>
 #include <linux/types.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sched.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+  #include <immintrin.h>
+#endif
 
 #include "rscfl/config.h"
 #include "rscfl/costs.h"
@@ -40,7 +47,6 @@
 
 // macro function definitions
 DEFINE_REDUCE_FUNCTION(rint, ru64)
-DEFINE_REDUCE_FUNCTION(wc, struct timespec)
 
 // define subsystem name array for user-space includes of subsys_list.h
 const char *rscfl_subsys_name[NUM_SUBSYSTEMS] = {
@@ -53,12 +59,171 @@ __thread rscfl_handle handle = NULL;
 syscall_interest_t dummy_interest;
 #endif
 
+/*
+ * Per-process mode (rscfl_config.max_threads != 0): the first thread calling
+ * rscfl_init opens the devices and maps a region with one slice per thread;
+ * the handles of all threads share those fds and mappings, and the other
+ * threads only register with the kernel for a slice
+ * (RSCFL_REGISTER_THREAD_CMD). Nothing is unmapped until the process exits.
+ *
+ * shared is the handle of the process-wide slice: its tokens are the
+ * process-wide tokens, and it only has buf, geom and the token stack set up.
+ */
+#define RSCFL_REGION_UNMAPPED 0
+#define RSCFL_REGION_MAPPING 1
+#define RSCFL_REGION_MAPPED 2
+
+static struct {
+  volatile int state;
+  int fd_data;
+  int fd_ctrl;
+  char *buf;
+  char *ctrl;
+  unsigned int max_threads;
+  rscfl_acct_geom_t geom;
+  struct rscfl_handle_t shared;
+} region = { RSCFL_REGION_UNMAPPED, -1, -1, NULL, NULL, 0 };
+
+#define REGION_MAP_SIZE(geom)                                                  \
+  ( (size_t)RSCFL_SLICE_SIZE(geom) * (region.max_threads + 1) )
+
+static inline void token_push(rscfl_handle rhdl, rscfl_token *token);
+
+static int region_map(rscfl_config *config, const rscfl_acct_geom_t *geom)
+{
+  unsigned int i;
+
+  region.fd_data = open("/dev/" RSCFL_DATA_DRIVER, O_RDWR | O_DSYNC);
+  region.fd_ctrl = open("/dev/" RSCFL_CTRL_DRIVER, O_RDWR | O_DSYNC);
+  if ((region.fd_data == -1) || (region.fd_ctrl == -1)) {
+    fprintf(stderr, "rscfl:Unable to access data or ctrl devices\n");
+    goto error;
+  }
+  if(ioctl(region.fd_ctrl, RSCFL_CONFIG_CMD, config)) {
+    fprintf(stderr, "rscfl: Unable to configure the kernel module\n");
+    goto error;
+  }
+  region.max_threads = config->max_threads;
+  region.geom = *geom;
+
+  // the kernel gives the first slice to the thread doing the data mmap.
+  // Slices are mapped when first touched, so no MAP_POPULATE here.
+  region.buf = mmap(NULL, REGION_MAP_SIZE(geom), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, region.fd_data, 0);
+  if (region.buf == MAP_FAILED) {
+    region.buf = NULL;
+    fprintf(stderr,
+            "rscfl: Unable to mmap shared memory with kernel module for data.\n");
+    goto error;
+  }
+  region.ctrl = mmap(NULL, (size_t)MMAP_CTL_SIZE * region.max_threads,
+                     PROT_READ | PROT_WRITE, MAP_SHARED, region.fd_ctrl, 0);
+  if (region.ctrl == MAP_FAILED) {
+    region.ctrl = NULL;
+    fprintf(stderr,
+            "rscfl: Unable to mmap shared memory for storing interests\n");
+    goto error;
+  }
+
+  region.shared.buf = region.buf + (size_t)RSCFL_SLICE_SIZE(geom) *
+                                   RSCFL_SHARED_SLICE(region.max_threads);
+  region.shared.geom = *geom;
+  region.shared.fd_ctrl = region.fd_ctrl;
+  region.shared.shared_map = 1;
+  region.shared.tokens = (rscfl_token *)calloc(geom->acct_num,
+                                               sizeof(rscfl_token));
+  if (!region.shared.tokens) {
+    fprintf(stderr, "rscfl: Unable to allocate memory for tokens\n");
+    goto error;
+  }
+  region.shared.free_tokens = TK_STACK_WORD(0UL, TK_STACK_EMPTY);
+  for (i = geom->acct_num; i-- > 0; ) {
+    region.shared.tokens[i].id = RSCFL_SHARED_TOKEN_BIT | i;
+    token_push(&region.shared, &region.shared.tokens[i]);
+  }
+  return 0;
+
+error:
+  if (region.ctrl != NULL) {
+    munmap(region.ctrl, (size_t)MMAP_CTL_SIZE * region.max_threads);
+    region.ctrl = NULL;
+  }
+  if (region.buf != NULL) {
+    munmap(region.buf, REGION_MAP_SIZE(geom));
+    region.buf = NULL;
+  }
+  if (region.fd_data != -1) {
+    close(region.fd_data);
+    region.fd_data = -1;
+  }
+  if (region.fd_ctrl != -1) {
+    close(region.fd_ctrl);
+    region.fd_ctrl = -1;
+  }
+  return -1;
+}
+
+/*
+ * Point rhdl to a slice of the per-process region, mapping the region first if
+ * the calling thread is the first one to get there.
+ */
+static int region_attach(rscfl_handle rhdl, rscfl_config *config)
+{
+  int slice;
+
+  if (config->max_threads > RSCFL_MAX_THREADS) {
+    fprintf(stderr, "rscfl: max_threads (%u) above %d\n",
+            config->max_threads, RSCFL_MAX_THREADS);
+    return -1;
+  }
+  while (1) {
+    if (region.state == RSCFL_REGION_MAPPED) {
+      __sync_synchronize();
+      if (region.max_threads != config->max_threads ||
+          memcmp(&region.geom, &rhdl->geom, sizeof(rscfl_acct_geom_t))) {
+        fprintf(stderr, "rscfl: the per-process region was mapped with a "
+                        "different config\n");
+        return -1;
+      }
+      slice = ioctl(region.fd_ctrl, RSCFL_REGISTER_THREAD_CMD);
+      if (slice < 0) {
+        fprintf(stderr, "rscfl: Unable to register thread (%s)\n",
+                strerror(errno));
+        return -1;
+      }
+      break;
+    }
+    if (__sync_bool_compare_and_swap(&region.state, RSCFL_REGION_UNMAPPED,
+                                     RSCFL_REGION_MAPPING)) {
+      if (region_map(config, &rhdl->geom)) {
+        region.state = RSCFL_REGION_UNMAPPED;
+        return -1;
+      }
+      slice = 0;
+      __sync_synchronize();
+      region.state = RSCFL_REGION_MAPPED;
+      break;
+    }
+    // another thread is mapping the region
+    sched_yield();
+  }
+
+  rhdl->buf = region.buf + (size_t)RSCFL_SLICE_SIZE(&rhdl->geom) * slice;
+  rhdl->ctrl = (rscfl_ctrl_layout_t *)(region.ctrl +
+                                       (size_t)MMAP_CTL_SIZE * slice);
+  rhdl->fd_ctrl = region.fd_ctrl;
+  rhdl->shared_map = 1;
+  return 0;
+}
+
 rscfl_handle rscfl_init_api(rscfl_version_t rscfl_ver, rscfl_config* config)
 {
   struct stat sb;
   void *ctrl, *buf;
-  int fd_data, fd_ctrl;
+  int fd_data = -1, fd_ctrl = -1;
   struct accounting acct;
+  rscfl_config default_cfg;
+  rscfl_layout_check_t layout_chk;
 
   // library was compiled with RSCFL_VERSION, API called from rscfl_ver
   // emit warning if the APIs have different major versions
@@ -74,22 +239,53 @@ rscfl_handle rscfl_init_api(rscfl_version_t rscfl_ver, rscfl_config* config)
     // initialize rscfl
   }
 
-  fd_data = open("/dev/" RSCFL_DATA_DRIVER, O_RDWR | O_DSYNC);
-  fd_ctrl = open("/dev/" RSCFL_CTRL_DRIVER, O_RDWR | O_DSYNC);
   rscfl_handle rhdl = (rscfl_handle)calloc(1, sizeof(*rhdl));
   if (!rhdl) {
     fprintf(stderr, "Unable to allocate memory for rscfl handle\n");
     return NULL;
   }
 
+  // always send a config: the size of the data buffer mmap-ed below is
+  // negotiated through it, and the kernel would otherwise use the config of
+  // whoever called rscfl_init last
+  if(config == NULL) {
+    rscfl_init_default_config(&default_cfg);
+    config = &default_cfg;
+  }
+  if(rscfl_acct_geom_init(&rhdl->geom, config->acct_num, config->subsys_num,
+                          config->max_tokens)) {
+    fprintf(stderr, "rscfl: Invalid buffer sizes in config: %u (acct), "
+                    "%u (subsys), %u (tokens). Maximum: %d, %d, %d\n",
+                    config->acct_num, config->subsys_num, config->max_tokens,
+                    RSCFL_MAX_ACCT_NUM, RSCFL_MAX_SUBSYS_NUM,
+                    RSCFL_MAX_TOKEN_NUM);
+    goto error;
+  }
+  rhdl->tokens = (rscfl_token *)calloc(rhdl->geom.token_num,
+                                       sizeof(rscfl_token));
+  if (!rhdl->tokens) {
+    fprintf(stderr, "rscfl: Unable to allocate memory for tokens\n");
+    goto error;
+  }
+
+  if(config->max_threads != 0) {
+    if(region_attach(rhdl, config)) {
+      goto error;
+    }
+    goto check_layout;
+  }
+
+  fd_data = open("/dev/" RSCFL_DATA_DRIVER, O_RDWR | O_DSYNC);
+  fd_ctrl = open("/dev/" RSCFL_CTRL_DRIVER, O_RDWR | O_DSYNC);
   if ((fd_data == -1) || (fd_ctrl == -1)) {
     fprintf(stderr, "rscfl:Unable to access data or ctrl devices\n");
     goto error;
   }
   rhdl->fd_ctrl = fd_ctrl;
 
-  if(config != NULL) {
-    ioctl(rhdl->fd_ctrl, RSCFL_CONFIG_CMD, config);
+  if(ioctl(rhdl->fd_ctrl, RSCFL_CONFIG_CMD, config)) {
+    fprintf(stderr, "rscfl: Unable to configure the kernel module\n");
+    goto error;
   }
 
   // mmap memory to store our struct accountings, and struct subsys_accountings
@@ -97,7 +293,7 @@ rscfl_handle rscfl_init_api(rscfl_version_t rscfl_ver, rscfl_config* config)
   // note: this (data) mmap needs to happen _before_ the ctrl mmap because the
   // rscfl_data character device also does the initialisation of per-cpu
   // variables later used by rscfl_ctrl.
-  buf = mmap(NULL, MMAP_BUF_SIZE, PROT_READ | PROT_WRITE,
+  buf = mmap(NULL, rhdl->geom.size, PROT_READ | PROT_WRITE,
              MAP_SHARED | MAP_POPULATE, fd_data, 0);
   if (buf == MAP_FAILED) {
     fprintf(stderr,
@@ -119,6 +315,7 @@ rscfl_handle rscfl_init_api(rscfl_version_t rscfl_ver, rscfl_config* config)
   // of memory, so resourceful can read them.
   rhdl->ctrl = ctrl;
 
+check_layout:
   // Check data layout version
   if (rhdl->ctrl->version != rscfl_ver.data_layout) {
     fprintf(stderr,
@@ -127,20 +324,61 @@ rscfl_handle rscfl_init_api(rscfl_version_t rscfl_ver, rscfl_config* config)
     goto error;
   }
 
+  // Check that the kernel was built with the same shared data structures
+  rscfl_layout_check_init(&layout_chk);
+  if (memcmp(&rhdl->ctrl->layout, &layout_chk, sizeof(rscfl_layout_check_t))) {
+    const rscfl_layout_check_t *k = &rhdl->ctrl->layout;
+    fprintf(stderr,
+            "rscfl: Shared data layout mismatch between rscfl API and kernel "
+            "(API vs .ko):\n"
+            "  cacheline %u vs %u, ctrl page %u vs %u (interest @%u vs @%u, "
+            "tokens @%u vs @%u)\n"
+            "  sizeof acct header %u vs %u, accounting %u vs %u, "
+            "subsys_accounting %u vs %u\n",
+            layout_chk.cacheline, k->cacheline,
+            layout_chk.ctrl_size, k->ctrl_size,
+            layout_chk.interest_off, k->interest_off,
+            layout_chk.tokens_off, k->tokens_off,
+            layout_chk.acct_hdr_size, k->acct_hdr_size,
+            layout_chk.acct_size, k->acct_size,
+            layout_chk.subsys_size, k->subsys_size);
+    goto error;
+  }
+
+  // Check that the kernel agrees on where everything is in the data buffer
+  if (memcmp(&rhdl->ctrl->geom, &rhdl->geom, sizeof(rscfl_acct_geom_t))) {
+    fprintf(stderr,
+            "rscfl: Data buffer geometry mismatch between rscfl API and "
+            "kernel: %u bytes, %u acct (API) vs %u bytes, %u acct (.ko)\n",
+            rhdl->geom.size, rhdl->geom.acct_num,
+            rhdl->ctrl->geom.size, rhdl->ctrl->geom.acct_num);
+    goto error;
+  }
+
   rhdl->lst_syscall_id = RSCFL_SYSCALL_ID_OFFSET;
+  rhdl->free_tokens = TK_STACK_WORD(0UL, TK_STACK_EMPTY);
+  rhdl->ring_reserve = ((rscfl_acct_layout_t *)rhdl->buf)->acct_ring.tail;
   handle = rhdl;
   return rhdl;
 
 error:
   if (rhdl != NULL) {
-    if (rhdl->buf != NULL) {
-      munmap(rhdl->buf, MMAP_BUF_SIZE);
+    // a slice of the per-process region stays registered to the thread
+    if (rhdl->buf != NULL && !rhdl->shared_map) {
+      munmap(rhdl->buf, rhdl->geom.size);
     }
-    if (rhdl->ctrl != NULL) {
-      munmap(rhdl->ctrl, MMAP_BUF_SIZE);
+    if (rhdl->ctrl != NULL && !rhdl->shared_map) {
+      munmap(rhdl->ctrl, MMAP_CTL_SIZE);
     }
+    free(rhdl->tokens);
     free(rhdl);
   }
+  if (fd_data != -1) {
+    close(fd_data);
+  }
+  if (fd_ctrl != -1) {
+    close(fd_ctrl);
+  }
   return NULL;
 }
 
@@ -152,71 +390,87 @@ rscfl_handle rscfl_get_handle_api(rscfl_config *cfg)
   return handle;
 }
 
+/*
+ * Push token on the free token stack of rhdl. Safe to call concurrently with
+ * token_push and token_pop on the same handle. The stack links tokens by
+ * their index in rhdl->tokens, which for process-wide tokens is not their id.
+ */
+static inline void token_push(rscfl_handle rhdl, rscfl_token *token)
+{
+  unsigned long top, new_top;
+  do {
+    top = rhdl->free_tokens;
+    token->next_free = TK_STACK_TOP(top);
+    new_top = TK_STACK_WORD(top, token - rhdl->tokens);
+  } while (!__sync_bool_compare_and_swap(&rhdl->free_tokens, top, new_top));
+}
+
+/*
+ * Pop a token from the free token stack of rhdl, or return NULL if the stack
+ * is empty. The tokens array is never freed while rhdl is valid, so reading
+ * next_free of a token popped by another thread in the meantime is harmless:
+ * the tag in free_tokens will have changed and the CAS fails.
+ */
+static inline rscfl_token* token_pop(rscfl_handle rhdl)
+{
+  unsigned long top, new_top;
+  short id;
+  do {
+    top = rhdl->free_tokens;
+    id = TK_STACK_TOP(top);
+    if (id == TK_STACK_EMPTY) return NULL;
+    new_top = TK_STACK_WORD(top, rhdl->tokens[id].next_free);
+  } while (!__sync_bool_compare_and_swap(&rhdl->free_tokens, top, new_top));
+  return &rhdl->tokens[id];
+}
+
 int rscfl_get_token(rscfl_handle rhdl, rscfl_token **token)
 {
-  _Bool consume_ctrl = 0;
-  rscfl_token_list *token_list_hd, *start;
+  rscfl_token *tk;
+  int i, num_ids;
   if ((rhdl == NULL) || (token == NULL)) {
     return -EINVAL;
   }
   // First see if there are any available tokens in the free list
-  if(rhdl->free_token_list != NULL) {
-    token_list_hd = rhdl->free_token_list;
-    *token = token_list_hd->token;
-    (*token)->first_acct = 1;
-    (*token)->in_use = 1;
-    (*token)->data_read = 0;
-    rhdl->free_token_list = token_list_hd->next;
-    free(token_list_hd);
-    //printf("Get token %d\n", (*token)->id);
-    return 0;
-  } else if(rhdl->ctrl->num_avail_token_ids > 0){
-    // consume tokens registered by the kernel with the rscfl_ctrl device
-    consume_ctrl = 1;
-  } else {
-    // explicitly request from the rscfl kernel module some more tokens
-    int rc;
-    rc = ioctl(rhdl->fd_ctrl, RSCFL_NEW_TOKENS_CMD);
-    if(rc != 0)
+  tk = token_pop(rhdl);
+  if (tk == NULL) {
+    // explicitly request from the rscfl kernel module some more tokens if it
+    // has not already registered some with the rscfl_ctrl device
+    if (rhdl->ctrl->num_avail_token_ids <= 0 &&
+        ioctl(rhdl->fd_ctrl, RSCFL_NEW_TOKENS_CMD) != 0) {
       return -EAGAIN;
-    else
-      consume_ctrl = 1;
-  }
-
-  // the kernel has placed available token ids in rhdl->ctrl->avail_token_ids
-  // effectively, the kernel promisses not to use those ids for any other
-  // resource accounting activities.
-  //
-  // create user-space tokens for those kernel-side ids and add them to a free
-  // token list
-  //
-  // skip adding the first of the available kernel tokens to the free list;
-  // instead, return it as the out-argument of this function (**token)
-  if(consume_ctrl && rhdl->ctrl->num_avail_token_ids > 0) {
-    int i;
-    for(i = 0; i<rhdl->ctrl->num_avail_token_ids; i++) {
-      rscfl_token *new_token = (rscfl_token *)malloc(sizeof(rscfl_token));
-      new_token->id = rhdl->ctrl->avail_token_ids[i];
-      new_token->first_acct = 1;
+    }
+
+    // the kernel has placed available token ids in rhdl->ctrl->avail_token_ids
+    // effectively, the kernel promisses not to use those ids for any other
+    // resource accounting activities.
+    //
+    // take the first id for ourselves and put the others on the free token
+    // stack. Claiming num_avail_token_ids first means that only one of the
+    // threads sharing rhdl consumes each batch of ids.
+    num_ids = __sync_lock_test_and_set(&rhdl->ctrl->num_avail_token_ids, 0);
+    for (i = 0; i < num_ids && i < NUM_READY_TOKENS; i++) {
+      int id = rhdl->ctrl->avail_token_ids[i];
       rhdl->ctrl->avail_token_ids[i] = DEFAULT_TOKEN;
-      if(i == 0) {
-        *token = new_token;
-        (*token)->in_use = 1;
-        (*token)->data_read = 0;
-        //printf("Get token %d\n", (*token)->id);
+      if (id < 0 || (unsigned int)id >= rhdl->geom.token_num) continue;
+      rhdl->tokens[id].id = id;
+      if (tk == NULL) {
+        tk = &rhdl->tokens[id];
       } else {
-        new_token->in_use = 0;
-        rscfl_token_list *new_free_token = (rscfl_token_list *)malloc(sizeof(rscfl_token_list));
-        new_free_token->token = new_token;
-        new_free_token->next = rhdl->free_token_list;
-        rhdl->free_token_list = new_free_token;
+        token_push(rhdl, &rhdl->tokens[id]);
       }
     }
-    rhdl->ctrl->num_avail_token_ids = 0;
-  } else {
-    return -EAGAIN;
+    // another thread might have consumed the ids, but pushed them already
+    if (tk == NULL && (tk = token_pop(rhdl)) == NULL) {
+      return -EAGAIN;
+    }
   }
 
+  tk->first_acct = 1;
+  tk->data_read = 0;
+  tk->in_use = 1;
+  *token = tk;
+  //printf("Get token %d\n", tk->id);
   return 0;
 }
 
@@ -273,38 +527,101 @@ int rscfl_switch_token_api(rscfl_handle rhdl, rscfl_token *token_to, token_switc
   }
 }
 
+static inline _Bool is_shared_token(rscfl_token *token)
+{
+  return region.shared.tokens != NULL && token >= region.shared.tokens &&
+         token < region.shared.tokens + region.shared.geom.acct_num;
+}
+
+int rscfl_get_shared_token(rscfl_handle rhdl, rscfl_token **token)
+{
+  rscfl_token *tk;
+  if ((rhdl == NULL) || (token == NULL) || !rhdl->shared_map) {
+    return -EINVAL;
+  }
+  tk = token_pop(&region.shared);
+  if (tk == NULL) {
+    return -EAGAIN;
+  }
+  tk->first_acct = 1;
+  tk->data_read = 0;
+  tk->in_use = 1;
+  *token = tk;
+  return 0;
+}
+
+rscfl_handle rscfl_shared_handle(rscfl_handle rhdl)
+{
+  if (rhdl == NULL || !rhdl->shared_map) return NULL;
+  return &region.shared;
+}
+
+/*
+ * Copy the measurement of a process-wide token out of the process-wide slice
+ * and start a new one. The kernel never stops aggregating into it, so this
+ * must not race with syscalls measured for the token.
+ */
+static int shared_token_read(struct accounting *acct, rscfl_token *token)
+{
+  struct accounting *shared_acct =
+    &RSCFL_ACCT(region.shared.buf, &region.shared.geom)
+      [SHARED_TOKEN_IX(token->id)];
+  short nr = shared_acct->nr_subsystems;
+  int i;
+
+  token->data_read = 1;
+  if (nr < 0 || nr > NUM_SUBSYSTEMS) {
+    return -EINVAL;
+  }
+  memcpy(acct, shared_acct, offsetof(struct accounting, acct_subsys) +
+                            nr * sizeof(struct acct_subsys_entry));
+  acct->nr_subsystems = nr;
+
+  // the subsystems now belong to acct; the kernel claims empty entries with
+  // cmpxchg, so clear them all before resetting nr_subsystems
+  for (i = 0; i < NUM_SUBSYSTEMS; i++) {
+    shared_acct->acct_subsys[i].id = RSCFL_SUBSYS_ENTRY_EMPTY;
+    shared_acct->acct_subsys[i].slot = RSCFL_SUBSYS_ENTRY_EMPTY;
+  }
+  __sync_synchronize();
+  shared_acct->rc = 0;
+  shared_acct->nr_subsystems = 0;
+  return acct->rc;
+}
+
 int rscfl_free_token(rscfl_handle rhdl, rscfl_token *token)
 {
+  rscfl_handle owner = rhdl;
   //rscfl_debug dbg;
+  if ((rhdl == NULL) || (token == NULL)) {
+    return -EINVAL;
+  }
+  if (is_shared_token(token)) {
+    owner = &region.shared;
+  } else if ((token < rhdl->tokens) ||
+             (token >= rhdl->tokens + rhdl->geom.token_num)) {
+    return -EINVAL;
+  }
   //printf("Free for token %d, in_read: %d\n", token->id, token->in_use);
-  if(token->in_use) {
-    rscfl_token_list *new_hd;
-    if ((rhdl == NULL) || (token == NULL)) {
-      return -EINVAL;
-    }
-    if (!token->data_read) {
-      struct accounting tmp_acct;
-      if(rscfl_read_acct(rhdl, &tmp_acct, token) == 0) {
-        rscfl_subsys_free(rhdl, &tmp_acct);
-      }
-    }
-    new_hd = (rscfl_token_list *)malloc(sizeof(rscfl_token_list));
-    if (new_hd == NULL) {
-      return -ENOMEM;
-    }
-    new_hd->next = rhdl->free_token_list;
-    new_hd->token = token;
-    token->first_acct = 1;
-    token->in_use = 0;
-    rhdl->free_token_list = new_hd;
-
-    /*
-     *strncpy(dbg.msg, "FREE", 5);
-     *dbg.new_token_id = token->id;
-     *ioctl(rhdl->fd_ctrl, RSCFL_DEBUG_CMD, &dbg);
-     */
+  // of multiple (racing) frees of the same token, only the first one puts it
+  // back on the free token stack
+  if (!__sync_bool_compare_and_swap(&token->in_use, 1, 0)) {
     return 0;
   }
+  if (!token->data_read) {
+    struct accounting tmp_acct;
+    if(rscfl_read_acct(rhdl, &tmp_acct, token) == 0) {
+      rscfl_subsys_free(owner, &tmp_acct);
+    }
+  }
+  token->first_acct = 1;
+  token_push(owner, token);
+
+  /*
+   *strncpy(dbg.msg, "FREE", 5);
+   *dbg.new_token_id = token->id;
+   *ioctl(rhdl->fd_ctrl, RSCFL_DEBUG_CMD, &dbg);
+   */
   return 0;
 }
 
@@ -335,6 +652,9 @@ int rscfl_acct_api(rscfl_handle rhdl, rscfl_token *token, interest_flags fl)
     to_acct->flags = (to_acct->flags & __ACCT_ERR) | (fl & __ACCT_FLAG_IS_PERSISTENT);
   else
     to_acct->flags |= (fl & __ACCT_FLAG_IS_PERSISTENT);
+  // sampling applies to the syscalls covered by this call only
+  to_acct->flags = (to_acct->flags & ~(ACCT_SAMPLE | __ACCT_NOT_SAMPLED)) |
+                   (fl & ACCT_SAMPLE);
 
   // stop on kernel-side error
   if((to_acct->flags & __ACCT_ERR) != 0) {
@@ -385,16 +705,94 @@ int rscfl_acct_api(rscfl_handle rhdl, rscfl_token *token, interest_flags fl)
   return 0;
 }
 
+/*
+ * Claim the struct accounting in slot ix (see RSCFL_ACCT_CLAIMED) if it holds
+ * a COMPLETE measurement, or an OPEN one when accept_open is set. Returns 1 on
+ * success.
+ */
+static inline int acct_slot_claim(rscfl_handle rhdl, short ix,
+                                  _Bool accept_open)
+{
+  volatile unsigned char *state = &RSCFL_ACCT_IN_USE(rhdl->buf, &rhdl->geom)[ix];
+  unsigned char s;
+  do {
+    s = *state;
+    if (s != RSCFL_ACCT_COMPLETE && !(accept_open && s == RSCFL_ACCT_OPEN))
+      return 0;
+  } while (!__sync_bool_compare_and_swap(state, s, RSCFL_ACCT_CLAIMED));
+  return 1;
+}
+
+/*
+ * Mark the n claimed struct accountings in slots ix[] as read and put the
+ * slots back in the free slot ring.
+ *
+ * More than one thread can release slots of the same handle (the collector
+ * and the thread owning the handle, through rscfl_free_token), so ring
+ * positions are first reserved (rhdl->ring_reserve) and the tail is only
+ * moved past them once all earlier reservations are published: the kernel
+ * never sees a tail covering slot indices that are not written yet.
+ */
+#define ACCT_RELEASE_BATCH 64
+static void acct_slots_release(rscfl_handle rhdl, const short *ix,
+                               unsigned int n)
+{
+  rscfl_acct_ring_t *ring = &((rscfl_acct_layout_t *)rhdl->buf)->acct_ring;
+  volatile short *slots = RSCFL_RING_SLOTS(rhdl->buf, &rhdl->geom);
+  unsigned int pos, i;
+
+  if (n == 0) return;
+  pos = __sync_fetch_and_add(&rhdl->ring_reserve, n);
+  for (i = 0; i < n; i++) {
+    RSCFL_ACCT_IN_USE(rhdl->buf, &rhdl->geom)[ix[i]] = RSCFL_ACCT_FREE;
+    slots[(pos + i) % rhdl->geom.acct_num] = ix[i];
+  }
+  // the kernel must not see the new tail before the slot indices
+  __sync_synchronize();
+  // a slot is only ever released by the thread that claimed it, so the
+  // reservations ahead of ours are about to be published
+  while (ring->tail != pos) sched_yield();
+  ring->tail = pos + n;
+}
+
+/*
+ * Return the slot index found at index entry ix_entry if the struct accounting
+ * stored there is the one identified by (syscall_id, tk_id), or -1 otherwise.
+ */
+static inline short acct_slot_lookup(rscfl_handle rhdl,
+                                     volatile short *ix_entry,
+                                     unsigned long syscall_id,
+                                     unsigned short tk_id, _Bool match_token)
+{
+  struct accounting *shared_acct;
+  short ix = *ix_entry;
+
+  if (ix < 0 || ix >= rhdl->geom.acct_num) return -1;
+  shared_acct = &RSCFL_ACCT(rhdl->buf, &rhdl->geom)[ix];
+  if (RSCFL_ACCT_IN_USE(rhdl->buf, &rhdl->geom)[ix] == RSCFL_ACCT_FREE ||
+      shared_acct->syscall_id != syscall_id)
+    return -1;
+  if (match_token && shared_acct->token_id != tk_id) return -1;
+  return ix;
+}
+
 int rscfl_read_acct_api(rscfl_handle rhdl, struct accounting *acct, rscfl_token *token)
 {
-  int i = 0;
+  short ix;
   unsigned short tk_id;
-  rscfl_token_list *start;
+  rscfl_acct_layout_t *layout;
   //rscfl_debug dbg;
   if (rhdl == NULL || (rhdl->ctrl->interest.flags & __ACCT_ERR) != 0) {
     return -EINVAL;
   }
 
+  if(token == NULL && IS_SHARED_TOKEN(rhdl->ctrl->interest.token_id)) {
+    token = rhdl->current_token;
+  }
+  if(token != NULL && is_shared_token(token)) {
+    return shared_token_read(acct, token);
+  }
+
   if(token == NULL) {
     tk_id = rhdl->ctrl->interest.token_id;
   }
@@ -404,106 +802,253 @@ int rscfl_read_acct_api(rscfl_handle rhdl, struct accounting *acct, rscfl_token
   }
 
   //printf("Read for token %d\n", token->id);
-  struct accounting *shared_acct = (struct accounting *)rhdl->buf;
-  if (shared_acct != NULL) {
-    while (i < STRUCT_ACCT_NUM) {
-      /*
-       *printf("** acct use:%d, syscall:%lu, tk_id:%d, subsys_nr:%d\n",
-       *       shared_acct->in_use, shared_acct->syscall_id, shared_acct->token_id, shared_acct->nr_subsystems);
-       */
-      if (shared_acct->in_use == 1) {
-        if ((shared_acct->syscall_id == rhdl->lst_syscall_id) ||
-            ((shared_acct->syscall_id == ID_RSCFL_IGNORE) && (shared_acct->token_id == tk_id))) {
-          memcpy(acct, shared_acct, sizeof(struct accounting));
-          shared_acct->in_use = 0;
-          /*
-           *strncpy(dbg.msg, "READ", 5);
-           *dbg.new_token_id = tk_id;
-           *ioctl(rhdl->fd_ctrl, RSCFL_DEBUG_CMD, &dbg);
-           */
-          return shared_acct->rc;
-        } else {
-          shared_acct++;
-          i++;
-        }
-      } else {
-        shared_acct++;
-        i++;
-      }
-    }
-  } else {
+  layout = (rscfl_acct_layout_t *)rhdl->buf;
+  if (layout == NULL) {
     return -EINVAL;
   }
 
+  // look for the struct accounting of the last syscall we've expressed an
+  // interest in, and then for the one where the kernel aggregates data for
+  // the token
+  ix = acct_slot_lookup(rhdl, &RSCFL_SYSCALL_IX(layout, &rhdl->geom)
+                          [ACCT_SYSCALL_IX(&rhdl->geom, rhdl->lst_syscall_id)],
+                        rhdl->lst_syscall_id, tk_id, 0);
+  if (ix == -1) {
+    ix = acct_slot_lookup(rhdl, &RSCFL_TOKEN_IX(layout, &rhdl->geom)
+                            [ACCT_TOKEN_IX(&rhdl->geom, tk_id)],
+                          ID_RSCFL_IGNORE, tk_id, 1);
+  }
+  if (ix != -1 && acct_slot_claim(rhdl, ix, 1)) {
+    struct accounting *shared_acct = &RSCFL_ACCT(layout, &rhdl->geom)[ix];
+    // only copy the part of acct_subsys in use
+    if (shared_acct->nr_subsystems < 0 ||
+        shared_acct->nr_subsystems > NUM_SUBSYSTEMS) {
+      acct_slots_release(rhdl, &ix, 1);
+      return -EINVAL;
+    }
+    memcpy(acct, shared_acct, ACCT_USED_SIZE(shared_acct));
+    acct_slots_release(rhdl, &ix, 1);
+    /*
+     *strncpy(dbg.msg, "READ", 5);
+     *dbg.new_token_id = tk_id;
+     *ioctl(rhdl->fd_ctrl, RSCFL_DEBUG_CMD, &dbg);
+     */
+    return acct->rc;
+  }
+
+  // the syscall was left out by sampling, so there is nothing to read
+  if ((rhdl->ctrl->interest.flags & __ACCT_NOT_SAMPLED) != 0) {
+    return -ENODATA;
+  }
+
 #ifndef NDEBUG
-  // We have failed in finding the correct kernel-side struct accounting
-  // loop again for debug purposes:
-  shared_acct = (struct accounting *)rhdl->buf;
-  i = 0;
-  printf("Was looking for token: %d\n", tk_id);
-  /*
-   *strncpy(dbg.msg, "RERR", 5);
-   *dbg.new_token_id = tk_id;
-   *ioctl(rhdl->fd_ctrl, RSCFL_DEBUG_CMD, &dbg);
-   */
-  while (i < STRUCT_ACCT_NUM) {
-    printf("acct use:%d, syscall:%lu, tk_id:%d, subsys_nr:%d\n",
-        shared_acct->in_use, shared_acct->syscall_id, shared_acct->token_id, shared_acct->nr_subsystems);
-    shared_acct++;
-    i++;
-  }
-  printf("Free token list:");
-  start = rhdl->free_token_list;
-  while(start != NULL) {
-    printf("%d, ", start->token->id);
-    start = start->next;
-  }
-  printf("\n");
+  {
+    // We have failed in finding the correct kernel-side struct accounting
+    // dump the whole buffer for debug purposes:
+    int i;
+    short tk_ix;
+    struct accounting *shared_acct = RSCFL_ACCT(layout, &rhdl->geom);
+    printf("Was looking for token: %d\n", tk_id);
+    /*
+     *strncpy(dbg.msg, "RERR", 5);
+     *dbg.new_token_id = tk_id;
+     *ioctl(rhdl->fd_ctrl, RSCFL_DEBUG_CMD, &dbg);
+     */
+    for (i = 0; i < rhdl->geom.acct_num; i++, shared_acct++) {
+      printf("acct use:%d, syscall:%lu, tk_id:%d, subsys_nr:%d\n",
+          RSCFL_ACCT_IN_USE(layout, &rhdl->geom)[i], shared_acct->syscall_id,
+          shared_acct->token_id, shared_acct->nr_subsystems);
+    }
+    printf("Free slots: %u\n",
+           layout->acct_ring.tail - layout->acct_ring.head);
+    printf("Free token list:");
+    for (tk_ix = TK_STACK_TOP(rhdl->free_tokens); tk_ix >= 0;
+         tk_ix = rhdl->tokens[tk_ix].next_free) {
+      printf("%d, ", tk_ix);
+    }
+    printf("\n");
+  }
 #endif
   return -EINVAL;
 }
 
+int rscfl_read_acct_batch(rscfl_handle rhdl, struct accounting *acct, int max)
+{
+  int i, nr_read = 0;
+  unsigned int nr_released = 0;
+  short released[ACCT_RELEASE_BATCH];
+  volatile unsigned char *state;
+  struct accounting *shared_acct;
+
+  if (rhdl == NULL || rhdl->buf == NULL || acct == NULL || max < 0) {
+    return -EINVAL;
+  }
+  state = RSCFL_ACCT_IN_USE(rhdl->buf, &rhdl->geom);
+  shared_acct = RSCFL_ACCT(rhdl->buf, &rhdl->geom);
+
+  // the slot states are packed together, so scanning them touches one cache
+  // line per 64 slots; only the measurements we claim are read
+  for (i = 0; i < rhdl->geom.acct_num && nr_read < max; i++) {
+    if (state[i] != RSCFL_ACCT_COMPLETE || !acct_slot_claim(rhdl, i, 0)) {
+      continue;
+    }
+    // only copy the part of acct_subsys in use, drop corrupted measurements
+    if (shared_acct[i].nr_subsystems >= 0 &&
+        shared_acct[i].nr_subsystems <= NUM_SUBSYSTEMS) {
+      memcpy(&acct[nr_read++], &shared_acct[i],
+             ACCT_USED_SIZE(&shared_acct[i]));
+    }
+    released[nr_released++] = i;
+    if (nr_released == ACCT_RELEASE_BATCH) {
+      acct_slots_release(rhdl, released, nr_released);
+      nr_released = 0;
+    }
+  }
+  acct_slots_release(rhdl, released, nr_released);
+  return nr_read;
+}
+
+int rscfl_notify_fd(rscfl_handle rhdl, int efd, unsigned int watermark)
+{
+  rscfl_notify notify;
+  int new_efd = -1;
+
+  if (rhdl == NULL) return -EINVAL;
+  if (watermark != 0 && efd < 0) {
+    new_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (new_efd < 0) return -errno;
+    efd = new_efd;
+  }
+  notify.efd = efd;
+  notify.watermark = watermark;
+  if (ioctl(rhdl->fd_ctrl, RSCFL_NOTIFY_CMD, &notify)) {
+    int err = errno;
+    if (new_efd != -1) close(new_efd);
+    return -err;
+  }
+  return watermark != 0 ? efd : 0;
+}
+
+int rscfl_probe_subsys(rscfl_handle rhdl, rscfl_subsys_mask *mask)
+{
+  if (rhdl == NULL || mask == NULL) return -EINVAL;
+  if (ioctl(rhdl->fd_ctrl, RSCFL_SUBSYS_MASK_CMD, mask)) {
+    return -errno;
+  }
+  return 0;
+}
+
+/*
+ * Scales the additive fields of s by the sampling weight w (see ACCT_SAMPLE);
+ * the xen credit min/max are left as they are.
+ */
+static void subsys_scale(struct subsys_accounting *s, unsigned int w)
+{
+  if (w <= 1) return;
+  s->subsys_entries              *= w;
+  s->subsys_exits                *= w;
+
+  s->cpu.cycles                  *= w;
+  s->cpu.branch_mispredictions   *= w;
+  s->cpu.instructions            *= w;
+
+  s->cpu.wall_clock_time         *= w;
+
+  s->mem.alloc                   *= w;
+  s->mem.freed                   *= w;
+  s->mem.page_faults             *= w;
+  s->mem.align_faults            *= w;
+
+  s->sched.wct_out_local           *= w;
+  s->sched.xen_sched_wct           *= w;
+  s->sched.run_delay               *= w;
+  s->sched.xen_schedules           *= w;
+  s->sched.xen_sched_cycles        *= w;
+  s->sched.xen_blocks              *= w;
+  s->sched.xen_yields              *= w;
+  s->sched.xen_evtchn_pending_size *= w;
+}
 
 subsys_idx_set* rscfl_get_subsys(rscfl_handle rhdl, struct accounting *acct)
 {
-  int curr_set_ix = 0, i;
   subsys_idx_set *ret_subsys_idx;
 
   if (acct == NULL) return NULL;
 
-  ret_subsys_idx = malloc(sizeof(subsys_idx_set));
+  ret_subsys_idx = rscfl_get_new_aggregator(acct->nr_subsystems);
   if (!ret_subsys_idx) return NULL;
+  rscfl_get_subsys_into(rhdl, acct, ret_subsys_idx);
 
-  ret_subsys_idx->set_size = acct->nr_subsystems;
-  ret_subsys_idx->max_set_size = acct->nr_subsystems;
-  ret_subsys_idx->set =
-      malloc(sizeof(struct subsys_accounting) * acct->nr_subsystems);
-  if (!ret_subsys_idx->set) {
-    free(ret_subsys_idx);
-    return NULL;
-  }
-  ret_subsys_idx->ids = malloc(sizeof(short) * acct->nr_subsystems);
-  if (!ret_subsys_idx->ids) {
-    free(ret_subsys_idx->set);
-    free(ret_subsys_idx);
-    return NULL;
-  }
+  return ret_subsys_idx;
+}
+
+int rscfl_get_subsys_into(rscfl_handle rhdl, struct accounting *acct,
+                          subsys_idx_set *subsys_set)
+{
+  int i, rc = 0;
+
+  if (rhdl == NULL || acct == NULL || subsys_set == NULL) return -EINVAL;
 
-  for (i = 0; i < NUM_SUBSYSTEMS; ++i) {
-    struct subsys_accounting *subsys = rscfl_get_subsys_by_id(rhdl, acct, i);
-    if (subsys != NULL) {
-      ret_subsys_idx->idx[i] = curr_set_ix;
-      memcpy(&ret_subsys_idx->set[curr_set_ix], subsys,
+  // only the entries set for the previous measurement need resetting
+  for (i = 0; i < subsys_set->set_size; ++i) {
+    subsys_set->idx[subsys_set->ids[i]] = -1;
+  }
+  subsys_set->set_size = 0;
+  subsys_set->weight = ACCT_SAMPLE_WEIGHT(acct);
+
+  for (i = 0; i < acct->nr_subsystems; ++i) {
+    struct subsys_accounting *subsys = rscfl_get_subsys_at(rhdl, acct, i);
+    short subsys_id = acct->acct_subsys[i].id;
+    if (subsys == NULL) {
+      rc++;
+      continue;
+    }
+    if (subsys_set->set_size < subsys_set->max_set_size) {
+      subsys_set->idx[subsys_id] = subsys_set->set_size;
+      memcpy(&subsys_set->set[subsys_set->set_size], subsys,
              sizeof(struct subsys_accounting));
-      ret_subsys_idx->ids[curr_set_ix] = i;
-      subsys->in_use = 0;
-      curr_set_ix++;
+      subsys_scale(&subsys_set->set[subsys_set->set_size], subsys_set->weight);
+      subsys_set->ids[subsys_set->set_size] = subsys_id;
+      subsys_set->set_size++;
     } else {
-      ret_subsys_idx->idx[i] = -1;
+      rc++;
     }
+    rscfl_subsys_release(rhdl, subsys);
   }
+  return rc;
+}
 
-  return ret_subsys_idx;
+int rscfl_get_subsys_view(rscfl_handle rhdl, const struct accounting *acct,
+                          rscfl_subsys_view *view)
+{
+  int i;
+
+  if (rhdl == NULL || acct == NULL || view == NULL ||
+      acct->nr_subsystems < 0 || acct->nr_subsystems > NUM_SUBSYSTEMS) {
+    return -EINVAL;
+  }
+
+  memset(view->idx, -1, sizeof(short) * NUM_SUBSYSTEMS);
+  for (i = 0; i < acct->nr_subsystems; ++i) {
+    short subsys_id = acct->acct_subsys[i].id;
+    view->idx[subsys_id] = i;
+    view->ids[i] = subsys_id;
+    view->set[i] = &RSCFL_SUBSYSES(rhdl->buf, &rhdl->geom)
+                     [acct->acct_subsys[i].slot];
+  }
+  view->set_size = acct->nr_subsystems;
+  return 0;
+}
+
+void rscfl_subsys_view_release(rscfl_handle rhdl, rscfl_subsys_view *view)
+{
+  int i;
+  if (rhdl == NULL || view == NULL) return;
+
+  for (i = 0; i < view->set_size; ++i) {
+    rscfl_subsys_release(rhdl, (struct subsys_accounting *)view->set[i]);
+  }
+  view->set_size = 0;
 }
 
 subsys_idx_set* rscfl_get_new_aggregator(unsigned short no_subsystems)
@@ -516,6 +1061,7 @@ subsys_idx_set* rscfl_get_new_aggregator(unsigned short no_subsystems)
 
   ret_subsys_idx->set_size = 0;
   ret_subsys_idx->max_set_size = no_subsystems;
+  ret_subsys_idx->weight = 0;
   ret_subsys_idx->set = calloc(no_subsystems, sizeof(struct subsys_accounting));
   if (!ret_subsys_idx->set) {
     free(ret_subsys_idx);
@@ -533,10 +1079,400 @@ subsys_idx_set* rscfl_get_new_aggregator(unsigned short no_subsystems)
   return ret_subsys_idx;
 }
 
+/*
+ * Arena allocation of subsys_idx_set objects.
+ *
+ * An arena is a list of blocks; memory is handed out from the current block
+ * by bumping its used offset. Resetting rewinds to the first block, and blocks
+ * after it are rewound only once allocation reaches them.
+ */
+#define ARENA_ALIGN 16
+
+struct rscfl_arena_block {
+  struct rscfl_arena_block *next;
+  size_t size;
+  size_t used;
+  char mem[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct rscfl_arena {
+  rscfl_handle rhdl;
+  struct rscfl_arena_block *head;
+  struct rscfl_arena_block *cur;
+  size_t block_size;
+};
+
+static struct rscfl_arena_block* arena_block_new(size_t size)
+{
+  struct rscfl_arena_block *blk;
+  if (posix_memalign((void **)&blk, ARENA_ALIGN,
+                     sizeof(struct rscfl_arena_block) + size)) {
+    return NULL;
+  }
+  blk->next = NULL;
+  blk->size = size;
+  blk->used = 0;
+  return blk;
+}
+
+static void* arena_alloc(rscfl_arena *arena, size_t size)
+{
+  struct rscfl_arena_block *blk = arena->cur;
+
+  size = RSCFL_ALIGN_UP(size, ARENA_ALIGN);
+  while (blk->size - blk->used < size) {
+    if (blk->next == NULL || blk->next->size < size) {
+      // insert a new block after the current one
+      struct rscfl_arena_block *new_blk =
+        arena_block_new(max(size, arena->block_size));
+      if (new_blk == NULL) return NULL;
+      new_blk->next = blk->next;
+      blk->next = new_blk;
+    }
+    blk = blk->next;
+    blk->used = 0;
+    arena->cur = blk;
+  }
+  blk->used += size;
+  return blk->mem + blk->used - size;
+}
+
+rscfl_arena* rscfl_arena_create(rscfl_handle rhdl, size_t block_size)
+{
+  rscfl_arena *arena = (rscfl_arena *)malloc(sizeof(rscfl_arena));
+  if (arena == NULL) return NULL;
+
+  if (block_size == 0) block_size = RSCFL_ARENA_BLOCK_SIZE;
+  arena->rhdl = rhdl;
+  arena->block_size = block_size;
+  arena->head = arena_block_new(block_size);
+  if (arena->head == NULL) {
+    free(arena);
+    return NULL;
+  }
+  arena->cur = arena->head;
+  return arena;
+}
+
+void rscfl_arena_reset(rscfl_arena *arena)
+{
+  if (arena == NULL) return;
+  arena->cur = arena->head;
+  arena->head->used = 0;
+}
+
+void rscfl_arena_destroy(rscfl_arena *arena)
+{
+  struct rscfl_arena_block *blk, *next;
+  if (arena == NULL) return;
+
+  for (blk = arena->head; blk != NULL; blk = next) {
+    next = blk->next;
+    free(blk);
+  }
+  free(arena);
+}
+
+subsys_idx_set* rscfl_arena_new_aggregator(rscfl_arena *arena,
+                                           unsigned short no_subsystems)
+{
+  subsys_idx_set *ret_subsys_idx;
+  size_t set_off, ids_off;
+  char *mem;
+
+  if (arena == NULL) return NULL;
+  if (no_subsystems > NUM_SUBSYSTEMS) no_subsystems = NUM_SUBSYSTEMS;
+
+  // one allocation: the subsys_idx_set, followed by its set and ids arrays
+  set_off = RSCFL_ALIGN_UP(sizeof(subsys_idx_set), ARENA_ALIGN);
+  ids_off = set_off + no_subsystems * sizeof(struct subsys_accounting);
+  mem = arena_alloc(arena, ids_off + no_subsystems * sizeof(short));
+  if (mem == NULL) return NULL;
+
+  ret_subsys_idx = (subsys_idx_set *)mem;
+  ret_subsys_idx->set = (struct subsys_accounting *)(mem + set_off);
+  ret_subsys_idx->ids = (short *)(mem + ids_off);
+  ret_subsys_idx->app_data = NULL;
+  ret_subsys_idx->set_size = 0;
+  ret_subsys_idx->max_set_size = no_subsystems;
+  ret_subsys_idx->weight = 0;
+  memset(ret_subsys_idx->idx, -1, sizeof(short) * NUM_SUBSYSTEMS);
+  memset(ret_subsys_idx->set, 0,
+         no_subsystems * sizeof(struct subsys_accounting));
+  return ret_subsys_idx;
+}
+
+subsys_idx_set* rscfl_arena_get_subsys(rscfl_arena *arena,
+                                       struct accounting *acct)
+{
+  subsys_idx_set *ret_subsys_idx;
+
+  if (arena == NULL || arena->rhdl == NULL || acct == NULL) return NULL;
+
+  ret_subsys_idx = rscfl_arena_new_aggregator(arena, acct->nr_subsystems);
+  if (!ret_subsys_idx) return NULL;
+  rscfl_get_subsys_into(arena->rhdl, acct, ret_subsys_idx);
+
+  return ret_subsys_idx;
+}
+
+/*
+ * The collector ring is a single-producer (the collector thread),
+ * single-consumer (rscfl_collector_pop) byte ring. head and tail are
+ * free-running byte counters. Each record is a struct collector_rec, followed
+ * by the used part of a struct accounting and by its subsystem data, in
+ * acct_subsys order; records are 8-byte aligned and never wrap around: a
+ * record with size 0 marks that the rest of the ring is unused and the next
+ * record starts at offset 0.
+ */
+#define COLLECTOR_ALIGN 8
+#define COLLECTOR_BATCH 32
+
+struct collector_rec {
+  unsigned int size;       // of the whole record
+  unsigned int acct_size;  // bytes of struct accounting stored
+  rscfl_handle rhdl;
+};
+
+struct rscfl_collector {
+  volatile unsigned long head RSCFL_CACHELINE_ALIGNED;  // collector thread
+  volatile unsigned long tail RSCFL_CACHELINE_ALIGNED;  // rscfl_collector_pop
+  char *ring;
+  size_t ring_size;
+  volatile unsigned long dropped;
+
+  pthread_t thread;
+  pthread_mutex_t add_lock;
+  volatile int stop;
+  int efd;
+  rscfl_handle *handles;
+  volatile unsigned int nr_handles;
+  unsigned int max_handles;
+  struct accounting batch[COLLECTOR_BATCH];
+};
+
+static void collector_push(rscfl_collector *c, rscfl_handle rhdl,
+                           struct accounting *acct)
+{
+  struct collector_rec *rec;
+  struct subsys_accounting *subsys;
+  unsigned long head = c->head;
+  size_t off = head & (c->ring_size - 1), pad = 0, acct_size, rec_size;
+  int i;
+
+  acct_size = RSCFL_ALIGN_UP(ACCT_USED_SIZE(acct), COLLECTOR_ALIGN);
+  rec_size = sizeof(struct collector_rec) + acct_size +
+             acct->nr_subsystems * sizeof(struct subsys_accounting);
+  rec_size = RSCFL_ALIGN_UP(rec_size, COLLECTOR_ALIGN);
+  if (off + rec_size > c->ring_size) pad = c->ring_size - off;
+  if (pad + rec_size > c->ring_size - (head - c->tail)) {
+    c->dropped++;
+    return;
+  }
+  if (pad) {
+    ((struct collector_rec *)(c->ring + off))->size = 0;
+    head += pad;
+    off = 0;
+  }
+
+  rec = (struct collector_rec *)(c->ring + off);
+  rec->size = rec_size;
+  rec->acct_size = acct_size;
+  rec->rhdl = rhdl;
+  memcpy(rec + 1, acct, ACCT_USED_SIZE(acct));
+  subsys = (struct subsys_accounting *)((char *)(rec + 1) + acct_size);
+  for (i = 0; i < acct->nr_subsystems; i++) {
+    struct subsys_accounting *from = rscfl_get_subsys_at(rhdl, acct, i);
+    if (from)
+      memcpy(&subsys[i], from, sizeof(struct subsys_accounting));
+    else
+      memset(&subsys[i], 0, sizeof(struct subsys_accounting));
+  }
+  // the consumer must not see the new head before the record
+  __sync_synchronize();
+  c->head = head + rec_size;
+}
+
+static void collector_drain(rscfl_collector *c)
+{
+  unsigned int h, nr_handles = c->nr_handles;
+  int i, nr_read;
+
+  __sync_synchronize();  // pairs with rscfl_collector_add
+  for (h = 0; h < nr_handles; h++) {
+    rscfl_handle rhdl = c->handles[h];
+    do {
+      nr_read = rscfl_read_acct_batch(rhdl, c->batch, COLLECTOR_BATCH);
+      for (i = 0; i < nr_read; i++) {
+        collector_push(c, rhdl, &c->batch[i]);
+        rscfl_subsys_free(rhdl, &c->batch[i]);
+      }
+    } while (nr_read == COLLECTOR_BATCH);
+  }
+}
+
+static void* collector_main(void *arg)
+{
+  rscfl_collector *c = (rscfl_collector *)arg;
+  struct pollfd pfd;
+  uint64_t signalled;
+
+  pfd.fd = c->efd;
+  pfd.events = POLLIN;
+  while (!c->stop) {
+    if (poll(&pfd, 1, RSCFL_COLLECTOR_PERIOD_MS) > 0) {
+      if (read(c->efd, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN)
+        break;
+    }
+    collector_drain(c);
+  }
+  collector_drain(c);
+  return NULL;
+}
+
+rscfl_collector* rscfl_collector_start(size_t ring_size,
+                                       unsigned int max_handles)
+{
+  rscfl_collector *c;
+  size_t size = COLLECTOR_ALIGN;
+
+  if (ring_size == 0) ring_size = RSCFL_COLLECTOR_RING_SIZE;
+  if (max_handles == 0) max_handles = RSCFL_COLLECTOR_MAX_HANDLES;
+  while (size < ring_size) size <<= 1;
+
+  if (posix_memalign((void **)&c, RSCFL_CACHELINE, sizeof(rscfl_collector)))
+    return NULL;
+  memset(c, 0, sizeof(rscfl_collector));
+  c->ring_size = size;
+  c->max_handles = max_handles;
+  c->efd = -1;
+  c->ring = (char *)malloc(size);
+  c->handles = (rscfl_handle *)calloc(max_handles, sizeof(rscfl_handle));
+  if (c->ring == NULL || c->handles == NULL) {
+    fprintf(stderr, "rscfl: Unable to allocate memory for the collector\n");
+    goto error;
+  }
+  c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (c->efd < 0) {
+    fprintf(stderr, "rscfl: Unable to create the collector eventfd\n");
+    goto error;
+  }
+  pthread_mutex_init(&c->add_lock, NULL);
+  if (pthread_create(&c->thread, NULL, collector_main, c)) {
+    fprintf(stderr, "rscfl: Unable to start the collector thread\n");
+    pthread_mutex_destroy(&c->add_lock);
+    goto error;
+  }
+  return c;
+
+error:
+  if (c->efd >= 0) close(c->efd);
+  free(c->handles);
+  free(c->ring);
+  free(c);
+  return NULL;
+}
+
+int rscfl_collector_add(rscfl_collector *c, rscfl_handle rhdl)
+{
+  int rc = 0;
+  unsigned int watermark;
+
+  if (c == NULL || rhdl == NULL) return -EINVAL;
+
+  pthread_mutex_lock(&c->add_lock);
+  if (c->nr_handles == c->max_handles) {
+    rc = -ENOSPC;
+    goto out;
+  }
+  // wake the collector when the buffer is half full
+  watermark = max(rhdl->geom.acct_num / 2, 1U);
+  if ((rc = rscfl_notify_fd(rhdl, c->efd, watermark)) < 0) {
+    goto out;
+  }
+  c->handles[c->nr_handles] = rhdl;
+  __sync_synchronize();
+  c->nr_handles++;
+  rc = 0;
+out:
+  pthread_mutex_unlock(&c->add_lock);
+  return rc;
+}
+
+int rscfl_collector_pop(rscfl_collector *c, struct accounting *acct,
+                        subsys_idx_set *subsys_set, rscfl_handle *rhdl)
+{
+  struct collector_rec *rec;
+  struct subsys_accounting *subsys;
+  unsigned long tail, head;
+  size_t off;
+  int i;
+
+  if (c == NULL || acct == NULL) return -EINVAL;
+  tail = c->tail;
+  head = c->head;
+  if (tail == head) return 0;
+  // read the record only after having seen the new head
+  __sync_synchronize();
+
+  off = tail & (c->ring_size - 1);
+  rec = (struct collector_rec *)(c->ring + off);
+  if (rec->size == 0) {
+    tail += c->ring_size - off;
+    rec = (struct collector_rec *)c->ring;
+  }
+  memcpy(acct, rec + 1, min((size_t)rec->acct_size, sizeof(struct accounting)));
+  if (subsys_set != NULL) {
+    if (acct->nr_subsystems > subsys_set->max_set_size) return -ENOSPC;
+    subsys = (struct subsys_accounting *)((char *)(rec + 1) + rec->acct_size);
+    for (i = 0; i < subsys_set->set_size; ++i) {
+      subsys_set->idx[subsys_set->ids[i]] = -1;
+    }
+    for (i = 0; i < acct->nr_subsystems; ++i) {
+      short subsys_id = acct->acct_subsys[i].id;
+      subsys_set->idx[subsys_id] = i;
+      subsys_set->ids[i] = subsys_id;
+      memcpy(&subsys_set->set[i], &subsys[i],
+             sizeof(struct subsys_accounting));
+    }
+    subsys_set->set_size = acct->nr_subsystems;
+  }
+  if (rhdl != NULL) *rhdl = rec->rhdl;
+
+  // the producer must not reuse the record before we're done copying it
+  __sync_synchronize();
+  c->tail = tail + rec->size;
+  return 1;
+}
+
+unsigned long rscfl_collector_dropped(rscfl_collector *c)
+{
+  return c != NULL ? c->dropped : 0;
+}
+
+void rscfl_collector_stop(rscfl_collector *c)
+{
+  uint64_t wake = 1;
+
+  if (c == NULL) return;
+  c->stop = 1;
+  // wake the collector up; if this fails, it still notices stop within
+  // RSCFL_COLLECTOR_PERIOD_MS
+  if (write(c->efd, &wake, sizeof(wake)) < 0) wake = 0;
+  pthread_join(c->thread, NULL);
+  pthread_mutex_destroy(&c->add_lock);
+  close(c->efd);
+  free(c->handles);
+  free(c->ring);
+  free(c);
+}
+
 int rscfl_merge_idx_set_into(subsys_idx_set *current, subsys_idx_set *aggregator_into) {
   int agg_set_ix, i, rc = 0;
 
   agg_set_ix = aggregator_into->set_size;
+  // current already holds scaled data (see rscfl_get_subsys_into)
+  aggregator_into->weight += current->weight;
 
   for(i=0; i<current->set_size; i++) {
     // fold set[i] into aggregator_info
@@ -568,35 +1504,44 @@ int rscfl_merge_acct_into(rscfl_handle rhdl, struct accounting *acct_from,
                           subsys_idx_set *aggregator_into)
 {
   int curr_set_ix, i, rc = 0;
+  unsigned int weight;
   if (!acct_from || !aggregator_into) return -EINVAL;
 
   curr_set_ix = aggregator_into->set_size;
+  weight = ACCT_SAMPLE_WEIGHT(acct_from);
+  aggregator_into->weight += weight;
 
-  for (i = 0; i < NUM_SUBSYSTEMS; ++i) {
+  for (i = 0; i < acct_from->nr_subsystems; ++i) {
     struct subsys_accounting *new_subsys =
-        rscfl_get_subsys_by_id(rhdl, acct_from, i);
-    if (new_subsys != NULL) {
-      if (aggregator_into->idx[i] == -1) {
-        // new_subsys i not in aggregator_into, add if sufficient space
-        if (curr_set_ix < aggregator_into->max_set_size) {
-          aggregator_into->idx[i] = curr_set_ix;
-          memcpy(&aggregator_into->set[curr_set_ix], new_subsys,
-                 sizeof(struct subsys_accounting));
-          aggregator_into->ids[curr_set_ix] = i;
-          new_subsys->in_use = 0;
-          curr_set_ix++;
-          aggregator_into->set_size++;
-        } else {
-          // not enough space in aggregator_into, set error but continue
-          // (the values that could be aggregated remain correct)
-          rc++;
-        }
+        rscfl_get_subsys_at(rhdl, acct_from, i);
+    short subsys_id = acct_from->acct_subsys[i].id;
+    if (new_subsys == NULL) {
+      rc++;
+      continue;
+    }
+    if (aggregator_into->idx[subsys_id] == -1) {
+      // new_subsys not in aggregator_into, add if sufficient space
+      if (curr_set_ix < aggregator_into->max_set_size) {
+        aggregator_into->idx[subsys_id] = curr_set_ix;
+        memcpy(&aggregator_into->set[curr_set_ix], new_subsys,
+               sizeof(struct subsys_accounting));
+        subsys_scale(&aggregator_into->set[curr_set_ix], weight);
+        aggregator_into->ids[curr_set_ix] = subsys_id;
+        rscfl_subsys_release(rhdl, new_subsys);
+        curr_set_ix++;
+        aggregator_into->set_size++;
       } else {
-        // subsys i exists, merge values
-        rscfl_subsys_merge(&aggregator_into->set[aggregator_into->idx[i]],
-                           new_subsys);
-        new_subsys->in_use = 0;
+        // not enough space in aggregator_into, set error but continue
+        // (the values that could be aggregated remain correct)
+        rc++;
       }
+    } else {
+      // subsys exists, merge values
+      struct subsys_accounting scaled = *new_subsys;
+      rscfl_subsys_release(rhdl, new_subsys);
+      subsys_scale(&scaled, weight);
+      rscfl_subsys_merge(&aggregator_into->set[aggregator_into->idx[subsys_id]],
+                         &scaled);
     }
   }
   return rc;
@@ -628,16 +1573,15 @@ inline void rscfl_subsys_merge(struct subsys_accounting *e,
   e->cpu.branch_mispredictions   += c->cpu.branch_mispredictions;
   e->cpu.instructions            += c->cpu.instructions;
 
-  rscfl_timespec_add(&e->cpu.wall_clock_time, &c->cpu.wall_clock_time);
+  e->cpu.wall_clock_time         += c->cpu.wall_clock_time;
 
   e->mem.alloc                   += c->mem.alloc;
   e->mem.freed                   += c->mem.freed;
   e->mem.page_faults             += c->mem.page_faults;
   e->mem.align_faults            += c->mem.align_faults;
 
-  rscfl_timespec_add(&e->sched.wct_out_local, &c->sched.wct_out_local);
-  rscfl_timespec_add(&e->sched.xen_sched_wct, &c->sched.xen_sched_wct);
-
+  e->sched.wct_out_local           += c->sched.wct_out_local;
+  e->sched.xen_sched_wct           += c->sched.xen_sched_wct;
   e->sched.run_delay               += c->sched.run_delay;
   e->sched.xen_schedules           += c->sched.xen_schedules;
   e->sched.xen_sched_cycles        += c->sched.xen_sched_cycles;
@@ -654,11 +1598,28 @@ struct subsys_accounting* rscfl_get_subsys_by_id(rscfl_handle rhdl,
                                                  struct accounting *acct,
                                                  rscfl_subsys subsys_id)
 {
-  if (!acct || acct->acct_subsys[subsys_id] == -1) {
-    return NULL;
+  int i;
+  if (!acct) return NULL;
+
+  for (i = 0; i < acct->nr_subsystems; ++i) {
+    if (acct->acct_subsys[i].id == subsys_id) {
+      return rscfl_get_subsys_at(rhdl, acct, i);
+    }
   }
-  rscfl_acct_layout_t *rscfl_data = (rscfl_acct_layout_t *)rhdl->buf;
-  return &rscfl_data->subsyses[acct->acct_subsys[subsys_id]];
+  return NULL;
+}
+
+struct subsys_accounting* rscfl_get_subsys_at(rscfl_handle rhdl,
+                                              struct accounting *acct,
+                                              int pos)
+{
+  short slot;
+  if (!rhdl || !acct || pos < 0 || pos >= acct->nr_subsystems) return NULL;
+  // the slot is read from memory the kernel writes; don't trust it to be
+  // within the buffer
+  slot = acct->acct_subsys[pos].slot;
+  if (slot < 0 || (unsigned int)slot >= rhdl->geom.subsys_num) return NULL;
+  return &RSCFL_SUBSYSES(rhdl->buf, &rhdl->geom)[slot];
 }
 
 void rscfl_subsys_free(rscfl_handle rhdl, struct accounting *acct)
@@ -666,9 +1627,297 @@ void rscfl_subsys_free(rscfl_handle rhdl, struct accounting *acct)
   int i;
   if (rhdl == NULL || acct == NULL) return;
 
-  for (i = 0; i < NUM_SUBSYSTEMS; ++i) {
-    struct subsys_accounting *subsys = rscfl_get_subsys_by_id(rhdl, acct, i);
-    if (subsys != NULL) subsys->in_use = 0;
+  for (i = 0; i < acct->nr_subsystems; ++i) {
+    rscfl_subsys_release(rhdl, rscfl_get_subsys_at(rhdl, acct, i));
+  }
+}
+
+void rscfl_subsys_release(rscfl_handle rhdl, struct subsys_accounting *subsys)
+{
+  unsigned long ix;
+  unsigned long *subsys_map;
+  if (rhdl == NULL || subsys == NULL) return;
+
+  ix = subsys - RSCFL_SUBSYSES(rhdl->buf, &rhdl->geom);
+  if (ix >= rhdl->geom.subsys_num) return;
+  subsys_map = RSCFL_SUBSYS_MAP(rhdl->buf, &rhdl->geom);
+  // the kernel sets bits in the same words concurrently
+  __sync_fetch_and_and(&subsys_map[ix / RSCFL_BITS_PER_LONG],
+                       ~(1UL << (ix % RSCFL_BITS_PER_LONG)));
+}
+
+/*
+ * Offline aggregation (rscfl_subsys_soa)
+ *
+ * Maps between the columns of a rscfl_subsys_soa and the fields of
+ * struct subsys_accounting.
+ */
+#define SOA_U64_FIELDS(X)                                                      \
+  X(RSCFL_SOA_CPU_CYCLES,                    cpu.cycles)                       \
+  X(RSCFL_SOA_CPU_BRANCH_MISPREDICTIONS,     cpu.branch_mispredictions)        \
+  X(RSCFL_SOA_CPU_INSTRUCTIONS,              cpu.instructions)                 \
+  X(RSCFL_SOA_CPU_ALIGNMENT_FAULTS,          cpu.alignment_faults)             \
+  X(RSCFL_SOA_CPU_WALL_CLOCK_NS,             cpu.wall_clock_time)              \
+  X(RSCFL_SOA_MEM_ALLOC,                     mem.alloc)                        \
+  X(RSCFL_SOA_MEM_FREED,                     mem.freed)                        \
+  X(RSCFL_SOA_MEM_PAGE_FAULTS,               mem.page_faults)                  \
+  X(RSCFL_SOA_MEM_ALIGN_FAULTS,              mem.align_faults)                 \
+  X(RSCFL_SOA_SCHED_WCT_OUT_LOCAL_NS,        sched.wct_out_local)              \
+  X(RSCFL_SOA_SCHED_CYCLES_OUT_LOCAL,        sched.cycles_out_local)           \
+  X(RSCFL_SOA_SCHED_RUN_DELAY,               sched.run_delay)                  \
+  X(RSCFL_SOA_SCHED_XEN_SCHEDULES,           sched.xen_schedules)              \
+  X(RSCFL_SOA_SCHED_XEN_SCHED_WCT_NS,        sched.xen_sched_wct)              \
+  X(RSCFL_SOA_SCHED_XEN_SCHED_CYCLES,        sched.xen_sched_cycles)           \
+  X(RSCFL_SOA_SCHED_XEN_SCHED_NS,            sched.xen_sched_ns)               \
+  X(RSCFL_SOA_SCHED_XEN_BLOCKS,              sched.xen_blocks)                 \
+  X(RSCFL_SOA_SCHED_XEN_YIELDS,              sched.xen_yields)                 \
+  X(RSCFL_SOA_SCHED_XEN_EVTCHN_PENDING_SIZE, sched.xen_evtchn_pending_size)    \
+  X(RSCFL_SOA_SUBSYS_ENTRIES,                subsys_entries)                   \
+  X(RSCFL_SOA_SUBSYS_EXITS,                  subsys_exits)
+
+/*
+ * Column kernels. Columns are RSCFL_SOA_ALIGN-aligned and allocated in
+ * multiples of RSCFL_SOA_ALIGN bytes, so the vector loops only need a scalar
+ * tail when n is not a multiple of the vector width.
+ *
+ * The AVX2 variants are compiled regardless of the -m flags used for the rest
+ * of the library and picked at run time (soa_kernels_init).
+ */
+struct soa_kernels {
+  void (*add_u64)(ru64 *dst, const ru64 *src, unsigned int n);
+  ru64 (*sum_u64)(const ru64 *src, unsigned int n);
+  void (*min_i32)(int *dst, const int *src, unsigned int n);
+  void (*max_i32)(int *dst, const int *src, unsigned int n);
+};
+
+static void soa_add_u64_scalar(ru64 *dst, const ru64 *src, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i < n; i++) dst[i] += src[i];
+}
+
+static ru64 soa_sum_u64_scalar(const ru64 *src, unsigned int n)
+{
+  unsigned int i;
+  ru64 sum = 0;
+  for (i = 0; i < n; i++) sum += src[i];
+  return sum;
+}
+
+static void soa_min_i32_scalar(int *dst, const int *src, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i < n; i++) dst[i] = min(dst[i], src[i]);
+}
+
+static void soa_max_i32_scalar(int *dst, const int *src, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i < n; i++) dst[i] = max(dst[i], src[i]);
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of the x86_64 baseline
+static void soa_add_u64_sse2(ru64 *dst, const ru64 *src, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i + 2 <= n; i += 2) {
+    __m128i d = _mm_load_si128((const __m128i *)&dst[i]);
+    __m128i c = _mm_load_si128((const __m128i *)&src[i]);
+    _mm_store_si128((__m128i *)&dst[i], _mm_add_epi64(d, c));
+  }
+  soa_add_u64_scalar(dst + i, src + i, n - i);
+}
+
+static ru64 soa_sum_u64_sse2(const ru64 *src, unsigned int n)
+{
+  unsigned int i;
+  ru64 lanes[2];
+  __m128i acc = _mm_setzero_si128();
+  for (i = 0; i + 2 <= n; i += 2) {
+    acc = _mm_add_epi64(acc, _mm_load_si128((const __m128i *)&src[i]));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1] + soa_sum_u64_scalar(src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void soa_add_u64_avx2(ru64 *dst, const ru64 *src, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m256i d = _mm256_load_si256((const __m256i *)&dst[i]);
+    __m256i c = _mm256_load_si256((const __m256i *)&src[i]);
+    _mm256_store_si256((__m256i *)&dst[i], _mm256_add_epi64(d, c));
+  }
+  soa_add_u64_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static ru64 soa_sum_u64_avx2(const ru64 *src, unsigned int n)
+{
+  unsigned int i;
+  ru64 lanes[4];
+  // two accumulators hide the latency of the dependent adds
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  for (i = 0; i + 8 <= n; i += 8) {
+    acc0 = _mm256_add_epi64(acc0,
+                            _mm256_load_si256((const __m256i *)&src[i]));
+    acc1 = _mm256_add_epi64(acc1,
+                            _mm256_load_si256((const __m256i *)&src[i + 4]));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         soa_sum_u64_scalar(src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void soa_min_i32_avx2(int *dst, const int *src, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i d = _mm256_load_si256((const __m256i *)&dst[i]);
+    __m256i c = _mm256_load_si256((const __m256i *)&src[i]);
+    _mm256_store_si256((__m256i *)&dst[i], _mm256_min_epi32(d, c));
+  }
+  soa_min_i32_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void soa_max_i32_avx2(int *dst, const int *src, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i d = _mm256_load_si256((const __m256i *)&dst[i]);
+    __m256i c = _mm256_load_si256((const __m256i *)&src[i]);
+    _mm256_store_si256((__m256i *)&dst[i], _mm256_max_epi32(d, c));
+  }
+  soa_max_i32_scalar(dst + i, src + i, n - i);
+}
+#endif /* __x86_64__ */
+
+static struct soa_kernels soa_kern = {
+  soa_add_u64_scalar, soa_sum_u64_scalar,
+  soa_min_i32_scalar, soa_max_i32_scalar
+};
+static int soa_kern_ready = 0;
+
+static inline const struct soa_kernels* soa_kernels_init(void)
+{
+  // racing threads pick the same kernels, so no locking is needed
+  if (soa_kern_ready) return &soa_kern;
+#if defined(__x86_64__)
+  soa_kern.add_u64 = soa_add_u64_sse2;
+  soa_kern.sum_u64 = soa_sum_u64_sse2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    soa_kern.add_u64 = soa_add_u64_avx2;
+    soa_kern.sum_u64 = soa_sum_u64_avx2;
+    soa_kern.min_i32 = soa_min_i32_avx2;
+    soa_kern.max_i32 = soa_max_i32_avx2;
+  }
+#endif
+  soa_kern_ready = 1;
+  return &soa_kern;
+}
+
+rscfl_subsys_soa* rscfl_soa_alloc(unsigned int capacity)
+{
+  int i;
+  size_t rows, col_bytes;
+  char *mem;
+  rscfl_subsys_soa *soa = (rscfl_subsys_soa *)calloc(1, sizeof(*soa));
+  if (soa == NULL) return NULL;
+
+  // round up so that every column (including the int ones) starts aligned
+  rows = RSCFL_ALIGN_UP((size_t)max(capacity, 1U),
+                        RSCFL_SOA_ALIGN / sizeof(int));
+  col_bytes = rows * sizeof(ru64);
+  if (posix_memalign((void **)&mem, RSCFL_SOA_ALIGN,
+                     RSCFL_SOA_U64_COLS * col_bytes + 2 * rows * sizeof(int))) {
+    free(soa);
+    return NULL;
+  }
+  for (i = 0; i < RSCFL_SOA_U64_COLS; i++) {
+    soa->col[i] = (ru64 *)(mem + i * col_bytes);
+  }
+  soa->xen_credits_min = (int *)(mem + RSCFL_SOA_U64_COLS * col_bytes);
+  soa->xen_credits_max = soa->xen_credits_min + rows;
+  soa->size = 0;
+  soa->capacity = capacity;
+  return soa;
+}
+
+void rscfl_soa_free(rscfl_subsys_soa *soa)
+{
+  if (soa == NULL) return;
+  // all columns share the allocation of the first one
+  free(soa->col[0]);
+  free(soa);
+}
+
+int rscfl_soa_append(rscfl_subsys_soa *soa,
+                     const struct subsys_accounting *subsys)
+{
+  unsigned int row;
+  if (soa == NULL || subsys == NULL) return -EINVAL;
+  if (soa->size >= soa->capacity) return -ENOMEM;
+
+  row = soa->size++;
+#define SOA_SCATTER_U64(c, field) soa->col[c][row] = subsys->field;
+  SOA_U64_FIELDS(SOA_SCATTER_U64)
+#undef SOA_SCATTER_U64
+  soa->xen_credits_min[row] = subsys->sched.xen_credits_min;
+  soa->xen_credits_max[row] = subsys->sched.xen_credits_max;
+  return row;
+}
+
+void rscfl_soa_get(const rscfl_subsys_soa *soa, unsigned int row,
+                   struct subsys_accounting *subsys)
+{
+  if (soa == NULL || subsys == NULL || row >= soa->size) return;
+
+  memset(subsys, 0, sizeof(struct subsys_accounting));
+#define SOA_GATHER_U64(c, field) subsys->field = soa->col[c][row];
+  SOA_U64_FIELDS(SOA_GATHER_U64)
+#undef SOA_GATHER_U64
+  subsys->sched.xen_credits_min = soa->xen_credits_min[row];
+  subsys->sched.xen_credits_max = soa->xen_credits_max[row];
+}
+
+int rscfl_soa_merge(rscfl_subsys_soa *into, const rscfl_subsys_soa *from)
+{
+  int i;
+  const struct soa_kernels *k = soa_kernels_init();
+  if (into == NULL || from == NULL || into->size != from->size) return -EINVAL;
+
+  for (i = 0; i < RSCFL_SOA_U64_COLS; i++) {
+    k->add_u64(into->col[i], from->col[i], into->size);
+  }
+  k->min_i32(into->xen_credits_min, from->xen_credits_min, into->size);
+  k->max_i32(into->xen_credits_max, from->xen_credits_max, into->size);
+  return 0;
+}
+
+void rscfl_soa_reduce(const rscfl_subsys_soa *soa,
+                      struct subsys_accounting *accum)
+{
+  unsigned int row;
+  const struct soa_kernels *k = soa_kernels_init();
+  if (soa == NULL || accum == NULL) return;
+
+#define SOA_REDUCE_U64(c, field)                                             \
+  accum->field += k->sum_u64(soa->col[c], soa->size);
+  SOA_U64_FIELDS(SOA_REDUCE_U64)
+#undef SOA_REDUCE_U64
+  // min/max reductions are cheap compared to the sums; leave them to the
+  // compiler
+  for (row = 0; row < soa->size; row++) {
+    accum->sched.xen_credits_min = min(accum->sched.xen_credits_min,
+                                       soa->xen_credits_min[row]);
+    accum->sched.xen_credits_max = max(accum->sched.xen_credits_max,
+                                       soa->xen_credits_max[row]);
   }
 }
 
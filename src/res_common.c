@@ -9,9 +9,98 @@
 
 #include "rscfl/res_common.h"
 
+#ifdef __KERNEL__
+  #include <linux/errno.h>
+  #include <linux/stddef.h>
+#else
+  #include <errno.h>
+  #include <stddef.h>
+#endif
+
 void rscfl_init_default_config(rscfl_config* default_cfg){
   default_cfg->monitored_pid = RSCFL_PID_SELF;
   default_cfg->kernel_agg = 1;
+  default_cfg->acct_num = STRUCT_ACCT_NUM;
+  default_cfg->subsys_num = 0;
+  default_cfg->max_tokens = 0;
+  default_cfg->huge_pages = 0;
+  default_cfg->max_threads = 0;
+  default_cfg->sample_period = 0;
+  default_cfg->sample_random = 0;
+}
+
+int rscfl_acct_geom_init(rscfl_acct_geom_t *geom, unsigned int acct_num,
+                         unsigned int subsys_num, unsigned int token_num)
+{
+  unsigned int off, max_subsys_num;
+
+  if (acct_num == 0) acct_num = STRUCT_ACCT_NUM;
+  if (subsys_num == 0) {
+    // a derived default is clamped rather than rejected; only explicitly
+    // requested sizes above the limit are an error
+    subsys_num = acct_num * ACCT_SUBSYS_RATIO;
+    if (subsys_num > RSCFL_MAX_SUBSYS_NUM)
+      subsys_num = RSCFL_MAX_SUBSYS_NUM;
+  }
+  if (token_num == 0) token_num = TOKEN_NUM;
+  if (acct_num > RSCFL_MAX_ACCT_NUM || subsys_num > RSCFL_MAX_SUBSYS_NUM ||
+      token_num > RSCFL_MAX_TOKEN_NUM)
+    return -EINVAL;
+  geom->token_num = token_num;
+
+  // the bitmap also needs to cover the struct subsys_accountings that fit in
+  // the space left when rounding the buffer size up to PAGE_SIZE
+  max_subsys_num = subsys_num + PAGE_SIZE / sizeof(struct subsys_accounting);
+  if (max_subsys_num > RSCFL_MAX_SUBSYS_NUM)
+    max_subsys_num = RSCFL_MAX_SUBSYS_NUM;
+
+  // groups written by different sides start on different cache lines, see
+  // struct rscfl_acct_geom_t
+  off = sizeof(rscfl_acct_layout_t);
+  off = RSCFL_ALIGN_UP(off, RSCFL_CACHELINE);
+  geom->slot_off = off;
+  off += acct_num * sizeof(short);
+
+  off = RSCFL_ALIGN_UP(off, RSCFL_CACHELINE);
+  geom->syscall_ix_off = off;
+  off += acct_num * sizeof(short);
+  geom->token_ix_off = off;
+  off += ACCT_TOKEN_IX_NUM(geom) * sizeof(short);
+
+  off = RSCFL_ALIGN_UP(off, RSCFL_CACHELINE);
+  geom->in_use_off = off;
+  off += acct_num * sizeof(unsigned char);
+
+  off = RSCFL_ALIGN_UP(off, RSCFL_CACHELINE);
+  geom->subsys_map_off = off;
+  off += RSCFL_BITMAP_LONGS(max_subsys_num) * sizeof(unsigned long);
+
+  off = RSCFL_ALIGN_UP(off, RSCFL_CACHELINE);
+  geom->acct_off = off;
+  off += acct_num * sizeof(struct accounting);
+
+  off = RSCFL_ALIGN_UP(off, sizeof(ru64));
+  geom->subsys_off = off;
+  off += subsys_num * sizeof(struct subsys_accounting);
+
+  geom->size = PAGE_ROUND_UP(off);
+  geom->acct_num = acct_num;
+  geom->subsys_num = (geom->size - geom->subsys_off)
+                     / sizeof(struct subsys_accounting);
+  if (geom->subsys_num > max_subsys_num)
+    geom->subsys_num = max_subsys_num;
+  return 0;
+}
+
+void rscfl_layout_check_init(rscfl_layout_check_t *chk)
+{
+  chk->cacheline = RSCFL_CACHELINE;
+  chk->ctrl_size = sizeof(rscfl_ctrl_layout_t);
+  chk->interest_off = offsetof(rscfl_ctrl_layout_t, interest);
+  chk->tokens_off = offsetof(rscfl_ctrl_layout_t, avail_token_ids);
+  chk->acct_hdr_size = sizeof(rscfl_acct_layout_t);
+  chk->acct_size = sizeof(struct accounting);
+  chk->subsys_size = sizeof(struct subsys_accounting);
 }
 
 ru64 rscfl_get_cycles(void)
@@ -42,7 +131,7 @@ void rscfl_timespec_add(struct timespec *to, const struct timespec *from) {
 }
 
 void rscfl_timespec_add_ns(struct timespec *ts, ru64 ns) {
-  int sec = ns/1000000000;
+  ru64 sec = ns/1000000000;
   ns=ns - sec*1000000000;
 
   // perform the addition
@@ -10,11 +10,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include "gtest/gtest.h"
+#include <atomic>
+#include <poll.h>
+#include <set>
 #include <stdio.h>
 #include <string.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <thread>
+#include <vector>
 
 #include <rscfl/costs.h>
 #include <rscfl/subsys_list.h>
@@ -29,6 +34,7 @@ class APITest : public testing::Test
     one_acct_ = NULL;
     subsys_agg_ = NULL;
 
+    rscfl_init_default_config(&cfg);
     cfg.monitored_pid = RSCFL_PID_SELF;
     cfg.kernel_agg = 0;
 
@@ -119,6 +125,25 @@ TEST_F(APITest,
   }
 }
 
+TEST_F(APITest,
+       SubsysListMatchesLookupById)
+{
+  ASSERT_LE(0, acct_.nr_subsystems);
+  ASSERT_GE(NUM_SUBSYSTEMS, acct_.nr_subsystems);
+
+  // every subsystem appears once in the list of touched subsystems, and
+  // looking it up by id finds the same data
+  for(int i = 0; i < acct_.nr_subsystems; ++i) {
+    rscfl_subsys id = (rscfl_subsys)acct_.acct_subsys[i].id;
+    for(int j = i + 1; j < acct_.nr_subsystems; ++j) {
+      EXPECT_NE(id, acct_.acct_subsys[j].id);
+    }
+    EXPECT_EQ(rscfl_get_subsys_at(rhdl_, &acct_, i),
+              rscfl_get_subsys_by_id(rhdl_, &acct_, id));
+  }
+  EXPECT_EQ(nullptr, rscfl_get_subsys_at(rhdl_, &acct_, acct_.nr_subsystems));
+}
+
 TEST_F(APITest,
        UserAcctAggregators)
 {
@@ -188,6 +213,221 @@ TEST_F(APITest, MergeHypervisorMinCreditsGivesSmallestValue)
   ASSERT_EQ(10, larger.sched.xen_credits_min);
 }
 
+TEST_F(APITest, SubsysViewPointsIntoSharedBuffer)
+{
+  rscfl_subsys_view view;
+
+  ASSERT_EQ(0, rscfl_get_subsys_view(rhdl_, &acct_, &view));
+  ASSERT_EQ(acct_.nr_subsystems, view.set_size);
+  for (int i = 0; i < view.set_size; ++i) {
+    EXPECT_EQ(acct_.acct_subsys[i].id, view.ids[i]);
+    EXPECT_EQ(i, view.idx[view.ids[i]]);
+    EXPECT_EQ(rscfl_get_subsys_at(rhdl_, &acct_, i), view.set[i]);
+  }
+  rscfl_subsys_view_release(rhdl_, &view);
+  EXPECT_EQ(0, view.set_size);
+  acct_.nr_subsystems = 0; // released with the view
+}
+
+TEST_F(APITest, GetSubsysIntoResetsReusedSet)
+{
+  subsys_agg_ = rscfl_get_new_aggregator(NUM_SUBSYSTEMS);
+  ASSERT_NE(nullptr, subsys_agg_);
+  // pretend the set holds data from a previous measurement
+  subsys_agg_->ids[0] = USERSPACE_XEN;
+  subsys_agg_->idx[USERSPACE_XEN] = 0;
+  subsys_agg_->set_size = 1;
+
+  ASSERT_EQ(0, rscfl_get_subsys_into(rhdl_, &acct2_, subsys_agg_));
+  EXPECT_EQ(acct2_.nr_subsystems, subsys_agg_->set_size);
+  for (int i = 0; i < subsys_agg_->set_size; ++i) {
+    EXPECT_EQ(acct2_.acct_subsys[i].id, subsys_agg_->ids[i]);
+    EXPECT_EQ(i, subsys_agg_->idx[subsys_agg_->ids[i]]);
+  }
+  if (rscfl_get_subsys_by_id(rhdl_, &acct2_, USERSPACE_XEN) == NULL) {
+    EXPECT_EQ(-1, subsys_agg_->idx[USERSPACE_XEN]);
+  }
+  acct2_.nr_subsystems = 0; // released by rscfl_get_subsys_into
+}
+
+TEST_F(APITest, BatchReadReturnsAllCompletedMeasurements)
+{
+  const int nr_syscalls = 4;
+  unsigned long syscall_ids[nr_syscalls];
+  struct accounting accts[2 * nr_syscalls];
+
+  // the measurements read in SetUp are not returned again
+  ASSERT_EQ(0, rscfl_read_acct_batch(rhdl_, accts, 2 * nr_syscalls));
+
+  for (int i = 0; i < nr_syscalls; i++) {
+    ASSERT_EQ(0, rscfl_acct(rhdl_));
+    syscall_ids[i] = rhdl_->lst_syscall_id;
+    close(dup(1));
+  }
+
+  // max is respected, and slots are left for the next call
+  ASSERT_EQ(1, rscfl_read_acct_batch(rhdl_, accts, 1));
+  ASSERT_EQ(nr_syscalls - 1,
+            rscfl_read_acct_batch(rhdl_, accts + 1, 2 * nr_syscalls - 1));
+
+  std::set<unsigned long> read_ids;
+  for (int i = 0; i < nr_syscalls; i++) {
+    EXPECT_EQ((unsigned short)DEFAULT_TOKEN, accts[i].token_id);
+    read_ids.insert(accts[i].syscall_id);
+    rscfl_subsys_free(rhdl_, &accts[i]);
+  }
+  for (int i = 0; i < nr_syscalls; i++) {
+    EXPECT_EQ(1u, read_ids.count(syscall_ids[i])) << "syscall " << i;
+  }
+}
+
+TEST_F(APITest, NotifyFdSignalsAtWatermark)
+{
+  const int watermark = 3;
+  struct accounting accts[2 * watermark];
+  struct pollfd pfd;
+  uint64_t completed = 0;
+
+  ASSERT_EQ(0, rscfl_read_acct_batch(rhdl_, accts, 2 * watermark));
+  int efd = rscfl_notify_fd(rhdl_, -1, watermark);
+  ASSERT_LE(0, efd);
+  pfd.fd = efd;
+  pfd.events = POLLIN;
+
+  for (int i = 0; i < watermark; i++) {
+    EXPECT_EQ(0, poll(&pfd, 1, 0)) << "signalled after " << i;
+    ASSERT_EQ(0, rscfl_acct(rhdl_));
+    close(dup(1));
+  }
+  ASSERT_EQ(1, poll(&pfd, 1, 1000));
+  ASSERT_EQ((ssize_t)sizeof(completed),
+            read(efd, &completed, sizeof(completed)));
+  EXPECT_EQ((uint64_t)watermark, completed);
+
+  int nr_read = rscfl_read_acct_batch(rhdl_, accts, 2 * watermark);
+  EXPECT_EQ(watermark, nr_read);
+  for (int i = 0; i < nr_read; i++) {
+    rscfl_subsys_free(rhdl_, &accts[i]);
+  }
+  EXPECT_EQ(0, rscfl_notify_fd(rhdl_, efd, 0));
+  close(efd);
+}
+
+TEST_F(APITest, CollectorDrainsMeasurements)
+{
+  // more syscalls than the buffer can hold unread measurements
+  const int nr_syscalls = 3 * STRUCT_ACCT_NUM;
+  std::set<unsigned long> syscall_ids;
+  struct accounting acct;
+  rscfl_handle from;
+  subsys_idx_set *subsys = rscfl_get_new_aggregator(NUM_SUBSYSTEMS);
+  ASSERT_NE(nullptr, subsys);
+
+  rscfl_collector *c = rscfl_collector_start(0, 0);
+  ASSERT_NE(nullptr, c);
+  ASSERT_EQ(0, rscfl_collector_add(c, rhdl_));
+  for (int i = 0; i < nr_syscalls; i++) {
+    ASSERT_EQ(0, rscfl_acct(rhdl_)) << "syscall " << i;
+    syscall_ids.insert(rhdl_->lst_syscall_id);
+    close(dup(1));
+    // give the collector time to run
+    if (i % (STRUCT_ACCT_NUM / 2) == 0) {
+      usleep(2000 * RSCFL_COLLECTOR_PERIOD_MS);
+    }
+  }
+  usleep(2000 * RSCFL_COLLECTOR_PERIOD_MS);
+
+  int nr_popped = 0;
+  while (rscfl_collector_pop(c, &acct, subsys, &from) == 1) {
+    EXPECT_EQ(rhdl_, from);
+    EXPECT_EQ(1u, syscall_ids.count(acct.syscall_id));
+    EXPECT_EQ(acct.nr_subsystems, subsys->set_size);
+    nr_popped++;
+  }
+  EXPECT_EQ(nr_syscalls, nr_popped);
+  EXPECT_EQ(0u, rscfl_collector_dropped(c));
+  rscfl_collector_stop(c);
+  free_subsys_idx_set(subsys);
+}
+
+TEST_F(APITest, CollectorAndFreeTokenReleaseSlots)
+{
+  const int nr_syscalls = 3 * STRUCT_ACCT_NUM;
+  rscfl_acct_ring_t *ring = &((rscfl_acct_layout_t *)rhdl_->buf)->acct_ring;
+  struct accounting acct;
+
+  rscfl_collector *c = rscfl_collector_start(0, 0);
+  ASSERT_NE(nullptr, c);
+  ASSERT_EQ(0, rscfl_collector_add(c, rhdl_));
+  for (int i = 0; i < nr_syscalls; i++) {
+    rscfl_token *token;
+    ASSERT_EQ(0, rscfl_get_token(rhdl_, &token)) << "syscall " << i;
+    ASSERT_EQ(0, rscfl_acct(rhdl_, token));
+    close(dup(1));
+    // the implicit read of the unread measurement races with the collector;
+    // both put slots back in the free slot ring
+    ASSERT_EQ(0, rscfl_free_token(rhdl_, token));
+  }
+  rscfl_collector_stop(c);
+
+  // all the reserved ring positions were published
+  EXPECT_EQ(rhdl_->ring_reserve, ring->tail);
+  EXPECT_LE(ring->tail - ring->head, rhdl_->geom.acct_num);
+  // and no slot was lost: a buffer's worth of measurements still fits
+  for (int i = 0; i < STRUCT_ACCT_NUM; i++) {
+    ASSERT_EQ(0, rscfl_acct(rhdl_)) << "syscall " << i;
+    close(dup(1));
+    ASSERT_EQ(0, rscfl_read_acct(rhdl_, &acct)) << "syscall " << i;
+    rscfl_subsys_free(rhdl_, &acct);
+  }
+}
+
+TEST_F(APITest, DisabledSubsystemIsNotMeasured)
+{
+  rscfl_subsys_mask mask;
+  struct accounting acct;
+
+  // the probed set is global to the module: whatever happens below, put
+  // SECURITYSUBSYSTEM back the way it was found
+  struct RestoreProbed {
+    rscfl_handle rhdl;
+    bool was_probed;
+    ~RestoreProbed()
+    {
+      rscfl_subsys_mask restore;
+      memset(&restore, 0, sizeof(restore));
+      if (was_probed)
+        RSCFL_SUBSYS_MASK_SET(restore.enable, SECURITYSUBSYSTEM);
+      else
+        RSCFL_SUBSYS_MASK_SET(restore.disable, SECURITYSUBSYSTEM);
+      rscfl_probe_subsys(rhdl, &restore);
+    }
+  };
+
+  memset(&mask, 0, sizeof(mask));
+  ASSERT_EQ(0, rscfl_probe_subsys(rhdl_, &mask));
+  RestoreProbed restore{rhdl_,
+      (bool)RSCFL_SUBSYS_MASK_ISSET(mask.probed, SECURITYSUBSYSTEM)};
+
+  memset(&mask, 0, sizeof(mask));
+  RSCFL_SUBSYS_MASK_SET(mask.disable, SECURITYSUBSYSTEM);
+  ASSERT_EQ(0, rscfl_probe_subsys(rhdl_, &mask));
+  EXPECT_FALSE(RSCFL_SUBSYS_MASK_ISSET(mask.probed, SECURITYSUBSYSTEM));
+
+  ASSERT_EQ(0, rscfl_acct(rhdl_));
+  int sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+  ASSERT_EQ(0, rscfl_read_acct(rhdl_, &acct));
+  close(sockfd);
+  EXPECT_LT(0, acct.nr_subsystems);
+  EXPECT_EQ(nullptr, rscfl_get_subsys_by_id(rhdl_, &acct, SECURITYSUBSYSTEM));
+  rscfl_subsys_free(rhdl_, &acct);
+
+  memset(&mask, 0, sizeof(mask));
+  RSCFL_SUBSYS_MASK_SET(mask.enable, SECURITYSUBSYSTEM);
+  ASSERT_EQ(0, rscfl_probe_subsys(rhdl_, &mask));
+  EXPECT_TRUE(RSCFL_SUBSYS_MASK_ISSET(mask.probed, SECURITYSUBSYSTEM));
+}
+
 TEST_F(APITest, SubsequentGetTokensHaveUniqueValues)
 {
   rscfl_token *token_a;
@@ -213,6 +453,41 @@ TEST_F(APITest, MultipleGetTokensSucceedOrFailGracefully)
   }
 }
 
+TEST_F(APITest, FreedTokensAreReusedOnce)
+{
+  rscfl_token *token_a;
+  rscfl_token *token_b;
+  rscfl_token *token_c;
+  ASSERT_EQ(0, rscfl_get_token(rhdl_, &token_a));
+  ASSERT_EQ(0, rscfl_free_token(rhdl_, token_a));
+  // a second free of the same token must not put it on the free list again
+  ASSERT_EQ(0, rscfl_free_token(rhdl_, token_a));
+
+  ASSERT_EQ(0, rscfl_get_token(rhdl_, &token_b));
+  ASSERT_EQ(token_a, token_b);
+  ASSERT_EQ(0, rscfl_get_token(rhdl_, &token_c));
+  ASSERT_NE(token_b->id, token_c->id);
+}
+
+/*
+ * Threads multiplexing many requests need more tokens than the kernel hands
+ * out in one batch (NUM_READY_TOKENS)
+ */
+TEST_F(APITest, ManyTokensCanBeInUse)
+{
+  const int num_tokens = 2 * NUM_READY_TOKENS + 1;
+  rscfl_token *tokens[num_tokens];
+  std::set<unsigned short> ids;
+  for (int i = 0; i < num_tokens; i++) {
+    ASSERT_EQ(0, rscfl_get_token(rhdl_, &tokens[i])) << "token " << i;
+    ids.insert(tokens[i]->id);
+  }
+  ASSERT_EQ(num_tokens, (int)ids.size());
+  for (int i = 0; i < num_tokens; i++) {
+    ASSERT_EQ(0, rscfl_free_token(rhdl_, tokens[i]));
+  }
+}
+
 /*
  * We reserve token 0 for times where we don't want to tokenize Rscfl.
  * Make sure that we don't get assigned it
@@ -227,3 +502,208 @@ TEST_F(APITest, TokenIDNotZero)
     ASSERT_NE(0, token->id) << "token id=" << token->id;
   }
 }
+
+/*
+ * In per-process mode, threads share one mapping but each gets its own slice
+ * of it, and measures into that slice.
+ */
+TEST(PerProcessTest, ThreadsGetSeparateSlices)
+{
+  const int num_threads = 8;
+  std::atomic<int> registered(0);
+  std::vector<std::thread> threads;
+  std::vector<rscfl_handle> handles(num_threads, nullptr);
+  std::vector<int> nr_subsystems(num_threads, 0);
+  rscfl_config cfg;
+
+  rscfl_init_default_config(&cfg);
+  cfg.kernel_agg = 0;
+  cfg.max_threads = 2 * num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.push_back(std::thread([&, i]() {
+      struct accounting acct;
+      handles[i] = rscfl_init(&cfg);
+      registered++;
+      if (handles[i] == nullptr) return;
+      // keep every thread registered until all of them got a slice
+      while (registered < num_threads) std::this_thread::yield();
+
+      if (rscfl_acct(handles[i]) != 0) return;
+      int sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+      if (rscfl_read_acct(handles[i], &acct) == 0) {
+        nr_subsystems[i] = acct.nr_subsystems;
+        rscfl_subsys_free(handles[i], &acct);
+      }
+      close(sockfd);
+    }));
+  }
+  for (auto &t : threads) t.join();
+
+  std::set<char *> bufs;
+  for (int i = 0; i < num_threads; i++) {
+    ASSERT_NE(nullptr, handles[i]) << "thread " << i;
+    EXPECT_EQ(handles[0]->fd_ctrl, handles[i]->fd_ctrl);
+    EXPECT_LT(0, nr_subsystems[i]) << "thread " << i;
+    bufs.insert(handles[i]->buf);
+  }
+  EXPECT_EQ(num_threads, (int)bufs.size());
+}
+
+static ru64 shared_subsys_entries(rscfl_handle shdl, struct accounting *acct)
+{
+  ru64 entries = 0;
+  struct subsys_accounting *subsyses = RSCFL_SUBSYSES(shdl->buf, &shdl->geom);
+  for (int i = 0; i < acct->nr_subsystems; i++) {
+    entries += subsyses[acct->acct_subsys[i].slot].subsys_entries;
+  }
+  rscfl_subsys_free(shdl, acct);
+  return entries;
+}
+
+// runs fn(rhdl) on a new thread, registered into the per-process region
+template <typename Fn>
+static void on_new_thread(rscfl_config *cfg, Fn fn)
+{
+  std::thread t([&]() {
+    rscfl_handle rhdl = rscfl_init(cfg);
+    ASSERT_NE(nullptr, rhdl);
+    fn(rhdl);
+  });
+  t.join();
+}
+
+TEST(PerProcessTest, SharedTokenFollowsRequestAcrossThreads)
+{
+  rscfl_config cfg;
+  rscfl_token *token = nullptr;
+  struct accounting acct;
+  ru64 one_thread = 0, two_threads = 0;
+
+  // same config as ThreadsGetSeparateSlices, which maps the region. The test
+  // thread has a handle of its own (APITest), so the request runs on an
+  // acceptor and a worker thread
+  rscfl_init_default_config(&cfg);
+  cfg.kernel_agg = 0;
+  cfg.max_threads = 16;
+  on_new_thread(&cfg, [&](rscfl_handle rhdl) {
+    ASSERT_NE(nullptr, rscfl_shared_handle(rhdl));
+    ASSERT_EQ(0, rscfl_get_shared_token(rhdl, &token));
+
+    ASSERT_EQ(0, rscfl_acct(rhdl, token));
+    int sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+    close(sockfd);
+    ASSERT_EQ(0, rscfl_read_acct(rhdl, &acct, token));
+    ASSERT_LT(0, acct.nr_subsystems);
+    one_thread = shared_subsys_entries(rscfl_shared_handle(rhdl), &acct);
+
+    // the request starts here and is handed over to the worker
+    ASSERT_EQ(0, rscfl_acct(rhdl, token));
+    sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+    close(sockfd);
+  });
+  ASSERT_NE(nullptr, token);
+  on_new_thread(&cfg, [&](rscfl_handle rhdl) {
+    ASSERT_EQ(0, rscfl_acct(rhdl, token));
+    int sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+    close(sockfd);
+    ASSERT_EQ(0, rscfl_read_acct(rhdl, &acct, token));
+    two_threads = shared_subsys_entries(rscfl_shared_handle(rhdl), &acct);
+    EXPECT_EQ(0, rscfl_free_token(rhdl, token));
+  });
+
+  EXPECT_LT(one_thread, two_threads);
+}
+
+/*
+ * With ACCT_SAMPLE and sample_period = 4, the first of every four syscalls is
+ * measured, with a weight of 4, and aggregators scale its data accordingly.
+ */
+TEST(SamplingTest, OneInPeriodSyscallsMeasured)
+{
+  const unsigned short period = 4;
+  rscfl_config cfg;
+
+  rscfl_init_default_config(&cfg);
+  cfg.kernel_agg = 0;
+  cfg.sample_period = period;
+  on_new_thread(&cfg, [&](rscfl_handle rhdl) {
+    struct accounting acct;
+    int measured = 0;
+    subsys_idx_set *agg = rscfl_get_new_aggregator(NUM_SUBSYSTEMS);
+    ASSERT_NE(nullptr, agg);
+
+    for (int i = 0; i < 4 * period; i++) {
+      ASSERT_EQ(0, rscfl_acct(rhdl, NULL, ACCT_SAMPLE));
+      int sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+      int rc = rscfl_read_acct(rhdl, &acct);
+      close(sockfd);
+      if (i % period != 0) {
+        EXPECT_EQ(-ENODATA, rc) << "syscall " << i;
+        continue;
+      }
+      ASSERT_EQ(0, rc) << "syscall " << i;
+      EXPECT_EQ(period, ACCT_SAMPLE_WEIGHT(&acct));
+      EXPECT_EQ(0, rscfl_merge_acct_into(rhdl, &acct, agg));
+      rscfl_subsys_free(rhdl, &acct);
+      measured++;
+    }
+    EXPECT_EQ(4, measured);
+    EXPECT_EQ(4ul * period, agg->weight);
+    for (int i = 0; i < agg->set_size; i++) {
+      EXPECT_EQ(0u, agg->set[i].subsys_entries % period);
+    }
+
+    // without ACCT_SAMPLE, every syscall is measured with a weight of 1
+    ASSERT_EQ(0, rscfl_acct(rhdl));
+    int sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+    ASSERT_EQ(0, rscfl_read_acct(rhdl, &acct));
+    close(sockfd);
+    EXPECT_EQ(1u, ACCT_SAMPLE_WEIGHT(&acct));
+    rscfl_subsys_free(rhdl, &acct);
+    free_subsys_idx_set(agg);
+  });
+}
+
+/*
+ * The syscalls below block until another thread writes to the socket, so the
+ * measured thread is switched out in the middle of each of them: that must
+ * not count as a syscall for sampling, nor change the decision taken when
+ * the syscall started.
+ */
+TEST(SamplingTest, ContextSwitchesDoNotAffectSampling)
+{
+  const unsigned short period = 4;
+  rscfl_config cfg;
+
+  rscfl_init_default_config(&cfg);
+  cfg.kernel_agg = 0;
+  cfg.sample_period = period;
+  on_new_thread(&cfg, [&](rscfl_handle rhdl) {
+    struct accounting acct;
+    int fds[2];
+    char c;
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    for (int i = 0; i < 4 * period; i++) {
+      std::thread writer([&]() {
+        usleep(2000);
+        ASSERT_EQ(1, write(fds[1], "x", 1));
+      });
+      ASSERT_EQ(0, rscfl_acct(rhdl, NULL, ACCT_SAMPLE));
+      ssize_t nr = read(fds[0], &c, 1);
+      int rc = rscfl_read_acct(rhdl, &acct);
+      writer.join();
+      ASSERT_EQ(1, nr);
+      if (i % period != 0) {
+        EXPECT_EQ(-ENODATA, rc) << "syscall " << i;
+        continue;
+      }
+      ASSERT_EQ(0, rc) << "syscall " << i;
+      EXPECT_EQ(period, ACCT_SAMPLE_WEIGHT(&acct));
+      EXPECT_LT(0, acct.nr_subsystems);
+      rscfl_subsys_free(rhdl, &acct);
+    }
+    close(fds[0]);
+    close(fds[1]);
+  });
+}
@@ -0,0 +1,90 @@
+/**** Notice
+ * arena_test.cpp: rscfl source code
+ *
+ * Copyright 2015-2017 The rscfl owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the rscfl open-source project: github.com/lc525/rscfl;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#include "gtest/gtest.h"
+#include <stdint.h>
+#include <string.h>
+
+#include <rscfl/costs.h>
+#include <rscfl/subsys_list.h>
+#include <rscfl/user/res_api.h>
+
+/*
+ * Aggregators allocated from an arena do not need the rscfl kernel module.
+ */
+
+// small blocks, so that a few aggregators already span several of them
+#define ARENA_TEST_BLOCK_SIZE 4096
+
+class ArenaTest : public testing::Test
+{
+ protected:
+  virtual void SetUp()
+  {
+    arena_ = rscfl_arena_create(NULL, ARENA_TEST_BLOCK_SIZE);
+    ASSERT_NE(nullptr, arena_);
+  }
+
+  virtual void TearDown()
+  {
+    rscfl_arena_destroy(arena_);
+  }
+
+  rscfl_arena *arena_;
+};
+
+TEST_F(ArenaTest, NewAggregatorIsEmptyAndAligned)
+{
+  subsys_idx_set *agg = rscfl_arena_new_aggregator(arena_, NUM_SUBSYSTEMS);
+  ASSERT_NE(nullptr, agg);
+  EXPECT_EQ(0, agg->set_size);
+  EXPECT_EQ(NUM_SUBSYSTEMS, agg->max_set_size);
+  EXPECT_EQ(0u, (uintptr_t)agg->set % sizeof(ru64));
+  for (int i = 0; i < NUM_SUBSYSTEMS; i++) {
+    EXPECT_EQ(-1, agg->idx[i]);
+    EXPECT_EQ(0u, agg->set[i].cpu.cycles);
+  }
+}
+
+TEST_F(ArenaTest, AggregatorsDoNotOverlap)
+{
+  const int nr_agg = 16;
+  subsys_idx_set *agg[nr_agg];
+  for (int i = 0; i < nr_agg; i++) {
+    agg[i] = rscfl_arena_new_aggregator(arena_, NUM_SUBSYSTEMS);
+    ASSERT_NE(nullptr, agg[i]);
+    for (int j = 0; j < NUM_SUBSYSTEMS; j++) {
+      agg[i]->set[j].cpu.cycles = i;
+      agg[i]->ids[j] = i;
+    }
+  }
+  for (int i = 0; i < nr_agg; i++) {
+    for (int j = 0; j < NUM_SUBSYSTEMS; j++) {
+      ASSERT_EQ((ru64)i, agg[i]->set[j].cpu.cycles);
+      ASSERT_EQ(i, agg[i]->ids[j]);
+    }
+  }
+}
+
+TEST_F(ArenaTest, ResetReusesMemory)
+{
+  const int nr_agg = 16;
+  subsys_idx_set *first[nr_agg];
+  for (int i = 0; i < nr_agg; i++) {
+    first[i] = rscfl_arena_new_aggregator(arena_, NUM_SUBSYSTEMS);
+    ASSERT_NE(nullptr, first[i]);
+  }
+  rscfl_arena_reset(arena_);
+  // the same allocation sequence after a reset gets the same memory back
+  for (int i = 0; i < nr_agg; i++) {
+    subsys_idx_set *agg = rscfl_arena_new_aggregator(arena_, NUM_SUBSYSTEMS);
+    ASSERT_EQ(first[i], agg);
+    EXPECT_EQ(0, agg->set_size);
+  }
+}
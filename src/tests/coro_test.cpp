@@ -0,0 +1,252 @@
+/**** Notice
+ * coro_test.cpp: rscfl source code
+ *
+ * Copyright 2015-2017 The rscfl owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the rscfl open-source project: github.com/lc525/rscfl;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#include "gtest/gtest.h"
+#include <exception>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include <rscfl/costs.h>
+#include <rscfl/res_common.h>
+#include <rscfl/user/res_api.h>
+#include <rscfl/user/rscfl_coro.hpp>
+
+struct Task {
+  struct promise_type : rscfl::coro::TokenPromise {
+    Task get_return_object()
+    {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept
+    {
+      release_thread();
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  explicit Task(std::coroutine_handle<promise_type> handle) : h(handle) {}
+  Task(const Task&) = delete;
+  ~Task() { if (h) h.destroy(); }
+
+  std::coroutine_handle<promise_type> h;
+};
+
+// lazily started coroutine, run by co_await-ing it from another coroutine
+struct Lazy {
+  struct promise_type : rscfl::coro::TokenPromise {
+    struct Continue {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<promise_type> h) noexcept
+      {
+        return h.promise().continuation;
+      }
+      void await_resume() noexcept {}
+    };
+
+    Lazy get_return_object()
+    {
+      return Lazy{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    Continue final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    std::coroutine_handle<> continuation;
+  };
+
+  explicit Lazy(std::coroutine_handle<promise_type> handle) : h(handle) {}
+  Lazy(const Lazy&) = delete;
+  ~Lazy() { if (h) h.destroy(); }
+
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+  {
+    h.promise().continuation = awaiting;
+    return h;
+  }
+  void await_resume() {}
+
+  std::coroutine_handle<promise_type> h;
+};
+
+// suspends the coroutine, leaving its handle to whoever resumes it
+struct Park {
+  std::coroutine_handle<> *parked;
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> h) { *parked = h; }
+  void await_resume() {}
+};
+
+static short active_token()
+{
+  return rscfl::coro::detail::bound_handle()->ctrl->interest.token_id;
+}
+
+/*
+ * Token switching only writes into the ctrl page, so these tests run on
+ * handles with a ctrl page allocated by hand and do not need the rscfl kernel
+ * module.
+ */
+class CoroSwitchTest : public testing::Test
+{
+ protected:
+  static void fake_handle(struct rscfl_handle_t *hdl)
+  {
+    memset(hdl, 0, sizeof(*hdl));
+    hdl->ctrl = (rscfl_ctrl_layout_t *)calloc(1, MMAP_CTL_SIZE);
+  }
+
+  virtual void SetUp()
+  {
+    fake_handle(&hdl_);
+    ASSERT_NE(nullptr, hdl_.ctrl);
+    ASSERT_EQ(0, rscfl::coro::bind_thread(&hdl_));
+    tk_.id = RSCFL_SHARED_TOKEN_BIT | 3;
+  }
+
+  virtual void TearDown()
+  {
+    rscfl::coro::unbind_thread();
+    free(hdl_.ctrl);
+  }
+
+  struct rscfl_handle_t hdl_;
+  rscfl_token tk_;
+};
+
+TEST_F(CoroSwitchTest, TokenActiveOnlyWhileRunning)
+{
+  std::coroutine_handle<> parked;
+  short in_body = 0, after_resume = 0;
+  auto body = [&]() -> Task {
+    co_await rscfl::coro::with_token(&tk_);
+    in_body = active_token();
+    co_await Park{&parked};
+    after_resume = active_token();
+  };
+
+  EXPECT_EQ(NULL_TOKEN, hdl_.ctrl->interest.token_id);
+  EXPECT_NE(0u, hdl_.ctrl->interest.syscall_id);
+  Task task = body();
+  task.h.resume();
+  EXPECT_EQ((short)tk_.id, in_body);
+  EXPECT_EQ(NULL_TOKEN, hdl_.ctrl->interest.token_id);
+
+  parked.resume();
+  EXPECT_TRUE(task.h.done());
+  EXPECT_EQ((short)tk_.id, after_resume);
+  EXPECT_EQ(NULL_TOKEN, hdl_.ctrl->interest.token_id);
+}
+
+TEST_F(CoroSwitchTest, ResumeOnOtherThreadSwitchesThere)
+{
+  std::coroutine_handle<> parked;
+  struct rscfl_handle_t other;
+  short other_thread = 0;
+  auto body = [&]() -> Task {
+    co_await rscfl::coro::with_token(&tk_);
+    co_await Park{&parked};
+    other_thread = active_token();
+  };
+
+  fake_handle(&other);
+  ASSERT_NE(nullptr, other.ctrl);
+  Task task = body();
+  task.h.resume();
+
+  std::thread worker([&]() {
+    rscfl::coro::bind_thread(&other);
+    parked.resume();
+    rscfl::coro::unbind_thread();
+  });
+  worker.join();
+
+  EXPECT_TRUE(task.h.done());
+  EXPECT_EQ((short)tk_.id, other_thread);
+  EXPECT_EQ(NULL_TOKEN, hdl_.ctrl->interest.token_id);
+  free(other.ctrl);
+}
+
+TEST_F(CoroSwitchTest, NestedCoroutineInheritsToken)
+{
+  std::coroutine_handle<> parked;
+  short in_child = 0, child_resumed = 0, after_child = 0;
+  auto child = [&]() -> Lazy {
+    in_child = active_token();
+    co_await Park{&parked};
+    child_resumed = active_token();
+  };
+  auto body = [&]() -> Task {
+    co_await rscfl::coro::with_token(&tk_);
+    co_await child();
+    after_child = active_token();
+  };
+
+  Task task = body();
+  task.h.resume();
+  EXPECT_EQ((short)tk_.id, in_child);
+  EXPECT_EQ(NULL_TOKEN, hdl_.ctrl->interest.token_id);
+
+  parked.resume();
+  EXPECT_TRUE(task.h.done());
+  EXPECT_EQ((short)tk_.id, child_resumed);
+  EXPECT_EQ((short)tk_.id, after_child);
+  EXPECT_EQ(NULL_TOKEN, hdl_.ctrl->interest.token_id);
+}
+
+/*
+ * Needs the rscfl kernel module.
+ */
+TEST(CoroTest, RequestMeasuredAcrossThreads)
+{
+  rscfl_config cfg;
+  rscfl_token *token;
+  struct accounting acct;
+  std::coroutine_handle<> parked;
+  auto body = [&]() -> Task {
+    co_await rscfl::coro::with_token(token);
+    int sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+    close(sockfd);
+    co_await Park{&parked};
+    sockfd = socket(PF_LOCAL, SOCK_RAW, 0);
+    close(sockfd);
+  };
+
+  rscfl_init_default_config(&cfg);
+  cfg.max_threads = 16;
+  rscfl_handle rhdl = rscfl_init(&cfg);
+  ASSERT_NE(nullptr, rhdl);
+  ASSERT_EQ(0, rscfl_get_shared_token(rhdl, &token));
+  ASSERT_EQ(0, rscfl::coro::bind_thread(rhdl));
+
+  Task task = body();
+  task.h.resume();
+  std::thread worker([&]() {
+    rscfl_handle whdl = rscfl_init(&cfg);
+    if (whdl == nullptr || rscfl::coro::bind_thread(whdl) != 0) return;
+    parked.resume();
+    rscfl::coro::unbind_thread();
+  });
+  worker.join();
+  rscfl::coro::unbind_thread();
+  EXPECT_TRUE(task.h.done());
+
+  ASSERT_EQ(0, rscfl_read_acct(rhdl, &acct, token));
+  EXPECT_LT(0, acct.nr_subsystems);
+  rscfl_subsys_free(rscfl_shared_handle(rhdl), &acct);
+  EXPECT_EQ(0, rscfl_free_token(rhdl, token));
+}
@@ -0,0 +1,207 @@
+/**** Notice
+ * cpp_api_test.cpp: rscfl source code
+ *
+ * Copyright 2015-2017 The rscfl owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the rscfl open-source project: github.com/lc525/rscfl;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rscfl/costs.h>
+#include <rscfl/res_common.h>
+#include <rscfl/subsys_list.h>
+#include <rscfl/user/res_api.h>
+#include <rscfl/user/rscfl.hpp>
+
+#define CPP_BENCH_REPS 1000000
+
+/*
+ * The reducer tests run on a data buffer filled in by hand, so they do not
+ * need the rscfl kernel module.
+ */
+class ReduceTest : public testing::Test
+{
+ protected:
+  virtual void SetUp()
+  {
+    memset(&hdl_, 0, sizeof(hdl_));
+    ASSERT_EQ(0, rscfl_acct_geom_init(&hdl_.geom, 0, 0, 0));
+    hdl_.buf = (char *)calloc(1, hdl_.geom.size);
+    ASSERT_NE(nullptr, hdl_.buf);
+
+    struct subsys_accounting *subsyses = RSCFL_SUBSYSES(hdl_.buf, &hdl_.geom);
+    memset(&acct_, 0, sizeof(acct_));
+    acct_.nr_subsystems = NUM_SUBSYSTEMS;
+    if (acct_.nr_subsystems > (short)hdl_.geom.subsys_num)
+      acct_.nr_subsystems = hdl_.geom.subsys_num;
+    for (int i = 0; i < acct_.nr_subsystems; i++) {
+      // use the slots in reverse, so that position != slot
+      short slot = acct_.nr_subsystems - 1 - i;
+      acct_.acct_subsys[i].id = i;
+      acct_.acct_subsys[i].slot = slot;
+      subsyses[slot].cpu.cycles = 1000 + 3 * i;
+      subsyses[slot].mem.page_faults = i % 4;
+      subsyses[slot].sched.xen_credits_min = 50 - i;
+      subsyses[slot].sched.xen_credits_max = i * i;
+    }
+  }
+
+  virtual void TearDown()
+  {
+    free(hdl_.buf);
+  }
+
+  struct rscfl_handle_t hdl_;
+  struct accounting acct_;
+};
+
+TEST_F(ReduceTest, SumMatchesMacroReducer)
+{
+  ru64 expected = 0, actual = 0;
+  ASSERT_EQ(0, REDUCE_SUBSYS(rint, &hdl_, &acct_, 0, &expected,
+      [](subsys_accounting *s, rscfl_subsys id){ return &s->cpu.cycles; },
+      [](ru64 *acc, const ru64 *elem){ *acc += *elem; }));
+  ASSERT_EQ(0, (rscfl::reduce<rscfl::field::cpu_cycles, rscfl::op::sum>(
+                    &hdl_, &acct_, &actual)));
+  EXPECT_NE(0u, actual);
+  EXPECT_EQ(expected, actual);
+}
+
+TEST_F(ReduceTest, MinMaxStartFromIdentity)
+{
+  int min_credits =
+    rscfl::op::min::identity<rscfl::field::sched_xen_credits_min::type>();
+  int max_credits =
+    rscfl::op::max::identity<rscfl::field::sched_xen_credits_max::type>();
+  int last = acct_.nr_subsystems - 1;
+
+  ASSERT_EQ(0, (rscfl::reduce<rscfl::field::sched_xen_credits_min,
+                              rscfl::op::min>(&hdl_, &acct_, &min_credits)));
+  ASSERT_EQ(0, (rscfl::reduce<rscfl::field::sched_xen_credits_max,
+                              rscfl::op::max>(&hdl_, &acct_, &max_credits)));
+  EXPECT_EQ(50 - last, min_credits);
+  EXPECT_EQ(last * last, max_credits);
+}
+
+TEST_F(ReduceTest, InvalidArguments)
+{
+  ru64 accum = 0;
+  EXPECT_EQ(-EINVAL, (rscfl::reduce<rscfl::field::cpu_cycles, rscfl::op::sum>(
+                          &hdl_, NULL, &accum)));
+  EXPECT_EQ(-EINVAL, (rscfl::reduce<rscfl::field::cpu_cycles, rscfl::op::sum>(
+                          NULL, &acct_, &accum)));
+}
+
+TEST_F(ReduceTest, OutOfRangeSlotIsSkipped)
+{
+  ru64 expected = 0, macro_accum = 0, tmpl_accum = 0;
+  struct subsys_accounting *subsyses = RSCFL_SUBSYSES(hdl_.buf, &hdl_.geom);
+  for (int i = 1; i < acct_.nr_subsystems; i++)
+    expected += subsyses[acct_.acct_subsys[i].slot].cpu.cycles;
+
+  acct_.acct_subsys[0].slot = hdl_.geom.subsys_num;
+  EXPECT_EQ(nullptr, rscfl_get_subsys_at(&hdl_, &acct_, 0));
+  ASSERT_EQ(0, REDUCE_SUBSYS(rint, &hdl_, &acct_, 0, &macro_accum,
+      [](subsys_accounting *s, rscfl_subsys id){ return &s->cpu.cycles; },
+      [](ru64 *acc, const ru64 *elem){ *acc += *elem; }));
+  ASSERT_EQ(0, (rscfl::reduce<rscfl::field::cpu_cycles, rscfl::op::sum>(
+                    &hdl_, &acct_, &tmpl_accum)));
+  EXPECT_EQ(expected, macro_accum);
+  EXPECT_EQ(expected, tmpl_accum);
+}
+
+/*
+ * Not a pass/fail test: compares REDUCE_SUBSYS (select and combine called
+ * through function pointers for every subsystem) with rscfl::reduce.
+ */
+TEST_F(ReduceTest, ReduceThroughput)
+{
+  struct timespec start, end;
+  ru64 macro_accum = 0, tmpl_accum = 0;
+  double macro_time, tmpl_time;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  for (int r = 0; r < CPP_BENCH_REPS; r++) {
+    REDUCE_SUBSYS(rint, &hdl_, &acct_, 0, &macro_accum,
+      [](subsys_accounting *s, rscfl_subsys id){ return &s->cpu.cycles; },
+      [](ru64 *acc, const ru64 *elem){ *acc += *elem; });
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  macro_time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  for (int r = 0; r < CPP_BENCH_REPS; r++) {
+    rscfl::reduce<rscfl::field::cpu_cycles, rscfl::op::sum>(&hdl_, &acct_,
+                                                            &tmpl_accum);
+    // keep the compiler from folding the repetitions together
+    asm volatile("" : "+m"(tmpl_accum));
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  tmpl_time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  EXPECT_EQ(macro_accum, tmpl_accum);
+  printf("reductions of %d subsystems: %d\n", acct_.nr_subsystems,
+         CPP_BENCH_REPS);
+  printf("  REDUCE_SUBSYS:  %8.2f ns/reduction\n",
+         macro_time * 1e9 / CPP_BENCH_REPS);
+  printf("  rscfl::reduce:  %8.2f ns/reduction\n",
+         tmpl_time * 1e9 / CPP_BENCH_REPS);
+  RecordProperty("macro_usec", (int)(macro_time * 1e6));
+  RecordProperty("template_usec", (int)(tmpl_time * 1e6));
+}
+
+/*
+ * The RAII types need the rscfl kernel module.
+ */
+class CppAPITest : public testing::Test
+{
+ protected:
+  virtual void SetUp()
+  {
+    rhdl_ = rscfl_init();
+    ASSERT_NE(nullptr, rhdl_);
+  }
+
+  rscfl_handle rhdl_;
+};
+
+TEST_F(CppAPITest, ScopedAcctMeasuresSyscall)
+{
+  ru64 cycles;
+  {
+    rscfl::ScopedAcct measure(rhdl_);
+    ASSERT_EQ(0, measure.status());
+    int sockfd = socket(AF_LOCAL, SOCK_RAW, 0);
+    ASSERT_EQ(0, measure.read());
+    close(sockfd);
+    EXPECT_LT(0, measure.acct().nr_subsystems);
+    cycles = measure.reduce<rscfl::field::cpu_cycles, rscfl::op::sum>();
+  }
+  EXPECT_NE(0u, cycles);
+}
+
+TEST_F(CppAPITest, TokenIsReturnedOnDestruction)
+{
+  rscfl_token *raw;
+  {
+    rscfl::Token token(rhdl_);
+    ASSERT_TRUE((bool)token);
+    raw = token.get();
+
+    rscfl::Token moved(std::move(token));
+    EXPECT_FALSE((bool)token);
+    EXPECT_EQ(raw, moved.get());
+  }
+  // the freed token is the first one handed out again
+  rscfl::Token again(rhdl_);
+  ASSERT_TRUE((bool)again);
+  EXPECT_EQ(raw, again.get());
+}
@@ -0,0 +1,216 @@
+/**** Notice
+ * soa_test.cpp: rscfl source code
+ *
+ * Copyright 2015-2017 The rscfl owners <lucian.carata@cl.cam.ac.uk>
+ *
+ * This file is part of the rscfl open-source project: github.com/lc525/rscfl;
+ * Its licensing is governed by the LICENSE file at the root of the project.
+ **/
+
+#include <errno.h>
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rscfl/costs.h>
+#include <rscfl/res_common.h>
+#include <rscfl/user/res_api.h>
+
+/*
+ * The structure-of-arrays aggregation functions work on copies of the
+ * measurement data, so these tests use synthetic records and do not need the
+ * rscfl kernel module.
+ */
+
+// not a multiple of any vector width, so the scalar tails get exercised
+#define SOA_TEST_ROWS 1003
+#define SOA_BENCH_ROWS (1 << 16)
+#define SOA_BENCH_REPS 200
+
+static void fill_subsys(struct subsys_accounting *s, unsigned int seed)
+{
+  memset(s, 0, sizeof(struct subsys_accounting));
+  s->cpu.cycles = 1000 + seed;
+  s->cpu.branch_mispredictions = seed % 17;
+  s->cpu.instructions = 3 * seed;
+  s->cpu.alignment_faults = seed % 3;
+  s->cpu.wall_clock_time = (seed % 5) * 1000000000ULL + seed * 7919;
+  s->mem.alloc = seed % 4096;
+  s->mem.freed = seed % 2048;
+  s->mem.page_faults = seed % 11;
+  s->mem.align_faults = seed % 2;
+  s->sched.wct_out_local = seed * 104729;
+  s->sched.cycles_out_local = 2 * seed;
+  s->sched.run_delay = seed % 97;
+  s->sched.xen_schedules = seed % 7;
+  s->sched.xen_sched_wct = (seed % 2) * 1000000000ULL + seed % 1000;
+  s->sched.xen_sched_cycles = seed * 5;
+  s->sched.xen_sched_ns = seed * 9;
+  s->sched.xen_blocks = seed % 13;
+  s->sched.xen_yields = seed % 19;
+  s->sched.xen_evtchn_pending_size = seed % 23;
+  s->sched.xen_credits_min = (int)(seed % 1000) - 500;
+  s->sched.xen_credits_max = (int)(seed % 777);
+  s->subsys_entries = seed % 31;
+  s->subsys_exits = seed % 37;
+}
+
+// rscfl_subsys_merge, plus the counters it does not aggregate
+static void reference_merge(struct subsys_accounting *e,
+                            const struct subsys_accounting *c)
+{
+  rscfl_subsys_merge(e, c);
+  e->cpu.alignment_faults += c->cpu.alignment_faults;
+  e->sched.cycles_out_local += c->sched.cycles_out_local;
+  e->sched.xen_sched_ns += c->sched.xen_sched_ns;
+}
+
+static void init_accum(struct subsys_accounting *s)
+{
+  memset(s, 0, sizeof(struct subsys_accounting));
+  s->sched.xen_credits_min = INT_MAX;
+  s->sched.xen_credits_max = INT_MIN;
+}
+
+static double soa_test_elapsed(const struct timespec *start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+class SoATest : public testing::Test
+{
+ protected:
+  virtual void SetUp()
+  {
+    soa_ = rscfl_soa_alloc(SOA_TEST_ROWS);
+    ASSERT_NE(nullptr, soa_);
+    aos_ = (struct subsys_accounting *)
+      calloc(SOA_TEST_ROWS, sizeof(struct subsys_accounting));
+    ASSERT_NE(nullptr, aos_);
+    for (int i = 0; i < SOA_TEST_ROWS; i++) {
+      fill_subsys(&aos_[i], i);
+      ASSERT_EQ(i, rscfl_soa_append(soa_, &aos_[i]));
+    }
+  }
+
+  virtual void TearDown()
+  {
+    rscfl_soa_free(soa_);
+    free(aos_);
+  }
+
+  rscfl_subsys_soa *soa_;
+  struct subsys_accounting *aos_;
+};
+
+TEST_F(SoATest, AppendGetRoundTrip)
+{
+  struct subsys_accounting row;
+  EXPECT_EQ(-ENOMEM, rscfl_soa_append(soa_, &aos_[0]));
+  for (int i = 0; i < SOA_TEST_ROWS; i++) {
+    rscfl_soa_get(soa_, i, &row);
+    ASSERT_EQ(0, memcmp(&row, &aos_[i], sizeof(struct subsys_accounting)))
+      << "row " << i << " differs after the round trip";
+  }
+}
+
+TEST_F(SoATest, ReduceMatchesScalarMerge)
+{
+  struct subsys_accounting expected, actual;
+  init_accum(&expected);
+  init_accum(&actual);
+  for (int i = 0; i < SOA_TEST_ROWS; i++) {
+    reference_merge(&expected, &aos_[i]);
+  }
+  rscfl_soa_reduce(soa_, &actual);
+  EXPECT_EQ(0, memcmp(&expected, &actual, sizeof(struct subsys_accounting)));
+  EXPECT_EQ(expected.cpu.cycles, actual.cpu.cycles);
+  EXPECT_EQ(expected.cpu.wall_clock_time, actual.cpu.wall_clock_time);
+  EXPECT_EQ(expected.sched.xen_credits_min, actual.sched.xen_credits_min);
+  EXPECT_EQ(expected.sched.xen_credits_max, actual.sched.xen_credits_max);
+}
+
+TEST_F(SoATest, MergeIsRowWise)
+{
+  struct subsys_accounting expected, actual;
+  rscfl_subsys_soa *into = rscfl_soa_alloc(SOA_TEST_ROWS);
+  ASSERT_NE(nullptr, into);
+  for (int i = 0; i < SOA_TEST_ROWS; i++) {
+    fill_subsys(&expected, SOA_TEST_ROWS - i);
+    ASSERT_EQ(i, rscfl_soa_append(into, &expected));
+  }
+  ASSERT_EQ(0, rscfl_soa_merge(into, soa_));
+
+  for (int i = 0; i < SOA_TEST_ROWS; i++) {
+    fill_subsys(&expected, SOA_TEST_ROWS - i);
+    reference_merge(&expected, &aos_[i]);
+    rscfl_soa_get(into, i, &actual);
+    ASSERT_EQ(0, memcmp(&expected, &actual, sizeof(struct subsys_accounting)))
+      << "row " << i << " differs after the merge";
+  }
+
+  // sets of different sizes can not be merged
+  rscfl_soa_free(into);
+  into = rscfl_soa_alloc(1);
+  ASSERT_NE(nullptr, into);
+  EXPECT_EQ(-EINVAL, rscfl_soa_merge(into, soa_));
+  rscfl_soa_free(into);
+}
+
+/*
+ * Not a pass/fail test: compares the throughput of aggregating records with
+ * rscfl_subsys_merge (one record at a time) and rscfl_soa_reduce (one column
+ * at a time).
+ */
+TEST(SoABench, ReduceThroughput)
+{
+  struct subsys_accounting rec, aos_accum, soa_accum;
+  struct subsys_accounting *aos;
+  struct timespec start;
+  double aos_time, soa_time;
+  rscfl_subsys_soa *soa = rscfl_soa_alloc(SOA_BENCH_ROWS);
+
+  ASSERT_NE(nullptr, soa);
+  aos = (struct subsys_accounting *)
+    calloc(SOA_BENCH_ROWS, sizeof(struct subsys_accounting));
+  ASSERT_NE(nullptr, aos);
+  for (int i = 0; i < SOA_BENCH_ROWS; i++) {
+    fill_subsys(&rec, i);
+    aos[i] = rec;
+    rscfl_soa_append(soa, &rec);
+  }
+
+  init_accum(&aos_accum);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  for (int r = 0; r < SOA_BENCH_REPS; r++) {
+    for (int i = 0; i < SOA_BENCH_ROWS; i++) {
+      rscfl_subsys_merge(&aos_accum, &aos[i]);
+    }
+  }
+  aos_time = soa_test_elapsed(&start);
+
+  init_accum(&soa_accum);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  for (int r = 0; r < SOA_BENCH_REPS; r++) {
+    rscfl_soa_reduce(soa, &soa_accum);
+  }
+  soa_time = soa_test_elapsed(&start);
+
+  EXPECT_EQ(aos_accum.cpu.cycles, soa_accum.cpu.cycles);
+  EXPECT_EQ(aos_accum.mem.page_faults, soa_accum.mem.page_faults);
+
+  printf("records merged: %d x %d\n", SOA_BENCH_ROWS, SOA_BENCH_REPS);
+  printf("  rscfl_subsys_merge: %8.2f Mrecords/s\n",
+         SOA_BENCH_ROWS * (double)SOA_BENCH_REPS / aos_time / 1e6);
+  printf("  rscfl_soa_reduce:   %8.2f Mrecords/s\n",
+         SOA_BENCH_ROWS * (double)SOA_BENCH_REPS / soa_time / 1e6);
+  RecordProperty("aos_usec", (int)(aos_time * 1e6));
+  RecordProperty("soa_usec", (int)(soa_time * 1e6));
+
+  rscfl_soa_free(soa);
+  free(aos);
+}
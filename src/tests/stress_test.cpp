@@ -21,6 +21,7 @@ class StressTest : public testing::Test
  protected:
   virtual void SetUp()
   {
+    rscfl_init_default_config(&cfg);
     cfg.monitored_pid = RSCFL_PID_SELF;
     cfg.kernel_agg = 0;
 
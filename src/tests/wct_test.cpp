@@ -31,14 +31,14 @@ class WCTTest : public testing::Test
   rscfl_handle rhdl_;
 };
 
-static struct timespec wct_test_get_time(void)
+static ru64 wct_test_get_time(void)
 {
   struct timespec ts;
   // We were originally using CLOCK_PROCESS_CPUTIME_ID but were occasionally
   // seeing strange (very small) values. By using CLOCK_MONOTONIC_RAW we're reading
   // a clock more similar to that of the kernel.
   clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-  return ts;
+  return (ru64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /*
@@ -49,26 +49,24 @@ TEST_F(WCTTest, WallClock_Kernel_LT_User)
 {
   ASSERT_EQ(0, rscfl_acct(rhdl_));
 
-  struct timespec val_pre = wct_test_get_time();
+  ru64 val_pre = wct_test_get_time();
   int sockfd = socket(AF_LOCAL, SOCK_RAW, 0);
   EXPECT_GT(sockfd, 0);
-  struct timespec val_post = wct_test_get_time();
-  rscfl_timespec_diff(&val_post, &val_pre);
+  ru64 val_post = wct_test_get_time() - val_pre;
 
   struct accounting acct;
   ASSERT_EQ(0, rscfl_read_acct(rhdl_, &acct));
 
   // Now add all of the subsystem times
-  timespec kernel_time = {0, 0};
+  ru64 kernel_time = 0;
   int reduce_err = 0;
-  reduce_err = REDUCE_SUBSYS(wc, rhdl_, &acct, 1, &kernel_time,
+  reduce_err = REDUCE_SUBSYS(rint, rhdl_, &acct, 1, &kernel_time,
     [](subsys_accounting *s, rscfl_subsys id){ return &s->cpu.wall_clock_time;},
-    rscfl_timespec_add);
+    [](ru64 *acct, const ru64* elem){ *acct += *elem; });
 
   EXPECT_EQ(0, reduce_err);
 
-  EXPECT_EQ(-1, rscfl_timespec_compare(&kernel_time, &val_post)) <<
+  EXPECT_LT(kernel_time, val_post) <<
     "expected (kernel_time) < (val_post) actual: (" <<
-    kernel_time.tv_sec << " s, " << kernel_time.tv_nsec <<" ns) vs (" <<
-    val_post.tv_sec << " s, " << val_post.tv_nsec <<" ns)";
+    kernel_time << " ns) vs (" << val_post << " ns)";
 }